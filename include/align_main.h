@@ -30,12 +30,20 @@
 #define ALIGN_SAM_SUB_STRAND_TAG "st"
 #define ALIGN_SAM_SUB_SEQ "su"
 #define ALIGN_SAM_PG_GDF "gd"
+#define ALIGN_SAM_READ_INDEX_TAG "ri" // Index of the read in its input, with --shard
 
 #include "cxxopts.hpp"
 #include "sam.h"
+#include "fasta.h"
 #include "graphman.h"
+#include "async_writer.h"
+#include "numa.h"
 
 #include <stdexcept>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
 
 
 // Forward decl to prevent main.cpp recompilation for alignment.h changes
@@ -43,6 +51,9 @@ namespace vargas {
   class AlignerBase;
   struct ScoreProfile;
 }
+namespace rg {
+  struct ForPool;
+}
 
 /**
  * Align given reads to specified target graphs.
@@ -51,12 +62,171 @@ namespace vargas {
  */
 int align_main(int argc, char *argv[]);
 
+/**
+ * @brief
+ * Destination of aligned records: one output file, or one per input file or per read group.
+ * @details
+ * Each output has its own writer thread and queue, so split outputs are formatted by the
+ * aligning threads and written concurrently.
+ */
+class AlignOutput {
+  public:
+    /**
+     * How records are split between outputs.
+     */
+    enum class Split {NONE, FILE, READ_GROUP};
+
+    /**
+     * @brief
+     * Write all records to out.
+     * @param out output file
+     * @param reorder_window Write tasks in index order, holding at most this many finished tasks.
+     * 0 writes tasks as they finish.
+     */
+    explicit AlignOutput(vargas::osam &out, size_t reorder_window = 0);
+
+    /**
+     * @brief
+     * Write one file per input file, or per read group.
+     * @details
+     * Read group outputs are opened when their first record is pushed, with the header of the
+     * input file the record came from, restricted to the read group.
+     * @param split FILE or READ_GROUP
+     * @param pattern Output file name, '%' is replaced with the input file name (without directory and
+     * extension) or the read group ID. The extension selects SAM, BAM, CRAM, or a results file.
+     * @param inputs input file names
+     * @param headers header of each input file
+     * @param pool htslib threads for BAM/CRAM compression, may be nullptr
+     * @throws std::invalid_argument pattern has no '%', or two input files have the same name
+     */
+    AlignOutput(Split split, const std::string &pattern, const std::vector<std::string> &inputs,
+                const std::vector<vargas::SAM::Header> &headers, std::shared_ptr<rg::HtsPool> pool);
+
+    AlignOutput(const AlignOutput &) = delete;
+
+    ~AlignOutput() {
+        close();
+    }
+
+    /**
+     * @brief
+     * Format the records of a task and queue them on their outputs. Safe to call from several threads.
+     * @param index task index, used to restore order with a reorder window
+     * @param file index of the input file of the records
+     * @param records aligned records
+     */
+    void push(size_t index, size_t file, const std::vector<vargas::SAM::Record> &records);
+
+    /**
+     * @brief
+     * Write all queued records and close the split outputs.
+     */
+    void close();
+
+    /**
+     * @brief
+     * Print how long the writers were busy, and how long workers waited on them.
+     */
+    void report() const;
+
+    /**
+     * @return true if tasks are written in index order
+     */
+    bool ordered() const {
+        return _reorder != nullptr;
+    }
+
+  private:
+    struct output {
+        vargas::osam *sam; // _file, or the osam of a single output
+        std::unique_ptr<vargas::osam> file;
+        std::unique_ptr<rg::AsyncWriter> writer;
+    };
+
+    output &_open(const std::string &name, const vargas::SAM::Header &hdr);
+    void _push(output &out, size_t index, std::vector<const vargas::SAM::Record *> &records);
+
+    Split _split;
+    std::string _pattern;
+    std::vector<vargas::SAM::Header> _headers;
+    std::shared_ptr<rg::HtsPool> _pool;
+    std::vector<std::unique_ptr<output>> _outputs; // One per input file for FILE
+    std::unique_ptr<rg::ReorderBuffer> _reorder;
+    size_t _reorder_window = 0;
+    std::unordered_map<std::string, output *> _rg_outputs;
+    std::mutex _mut; // Guards _outputs and _rg_outputs while opening read group outputs
+};
+
+/**
+ * @brief
+ * Align threads pinned to NUMA nodes, each reading a graph replica allocated on its node.
+ * @details
+ * Threads are spread over the nodes in contiguous blocks. Each replica is loaded by the
+ * first thread of its node, so its memory is allocated locally (first touch).
+ * A single thread is the calling thread of ForPool, so it is not pinned.
+ */
+class NumaPlacement {
+  public:
+    /**
+     * @param topo nodes to use, at least one
+     * @param threads number of align threads
+     * @param gdf graph definition file, loaded once per node with threads
+     * @throws std::invalid_argument topo has no nodes
+     */
+    NumaPlacement(const rg::NumaTopology &topo, size_t threads, const std::string &gdf);
+
+    NumaPlacement(const NumaPlacement &) = delete;
+
+    ~NumaPlacement();
+
+    /**
+     * @return Pool of the pinned threads. Thread tid of a ForPool call runs on node node_of(tid).
+     */
+    rg::ForPool &pool() {
+        return *_pool;
+    }
+
+    /**
+     * @param tid thread index
+     * @return node index of thread tid
+     */
+    size_t node_of(int tid) const {
+        return _thread_node.at(tid);
+    }
+
+    /**
+     * @param tid thread index
+     * @return Graph replica on the node of thread tid
+     */
+    vargas::GraphMan &graph(int tid) const {
+        return *_replicas.at(node_of(tid));
+    }
+
+    /**
+     * @brief
+     * Call f(tid) once on each pinned thread, e.g. to allocate per thread buffers locally.
+     */
+    void for_each_thread(const std::function<void(int)> &f);
+
+    /**
+     * @brief
+     * Print the nodes used and the threads on each.
+     */
+    void report() const;
+
+  private:
+    rg::NumaTopology _topo;
+    std::vector<size_t> _thread_node;
+    std::unique_ptr<rg::ForPool> _pool;
+    std::vector<std::unique_ptr<vargas::GraphMan>> _replicas; // Per node, nullptr for nodes without threads
+};
+
 /**
  * @brief
  * Align tasks to their graphs.
  * @param gm GraphMan hosting target graphs
  * @param task_list Parallel execution tasks
- * @param output SAM
+ * @param out destination of the aligned records
  * @param aligners
  * @param fwdonly
  * @param primary
@@ -64,12 +234,188 @@ int align_main(int argc, char *argv[]);
  * @param maxonly
  * @param notraceback
  * @param phred_offset
+ * @param task_file input file index of each task, nullptr if all tasks are from one file
+ * @param numa align on pinned threads with node local graphs, nullptr to use gm on unpinned threads
+ * @param affinity keep threads on one subgraph until its tasks run out, instead of taking the largest task
  */
 void align(vargas::GraphMan &gm,
            std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
-           vargas::osam &out,
+           AlignOutput &out,
            const std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners,
-           bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset);
+           bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+           const std::vector<size_t> *task_file = nullptr, NumaPlacement *numa = nullptr, bool affinity = true);
+
+/**
+ * Read file format type.
+ */
+enum class ReadFmt {SAM, FASTQ, FASTA};
+
+/**
+ * @brief
+ * Subset of the reads of each input aligned by one of several runs.
+ * @details
+ * Read i of an input belongs to shard i mod count, so shards are the same size and selecting
+ * a read needs only its position. Sharded reads carry their index in ALIGN_SAM_READ_INDEX_TAG,
+ * and each shard output is written in index order, so vargas merge restores input order
+ * while reading the shards.
+ */
+struct Shard {
+    size_t index = 0, count = 1;
+
+    /**
+     * @param spec shard as "i/N", i from 0 to N-1
+     * @return Parsed shard
+     * @throws std::invalid_argument if spec is malformed or i is not below N
+     */
+    static Shard parse(const std::string &spec);
+
+    /**
+     * @brief
+     * Find the --shard option of a command line, and remove it.
+     * @param cl command line, the option is removed if found
+     * @param shard set to the shard of the option
+     * @return false if cl has no --shard option
+     * @throws std::invalid_argument if the shard is malformed
+     */
+    static bool take_option(std::string &cl, Shard &shard);
+
+    /**
+     * @return true if every read is kept
+     */
+    bool all() const {
+        return count == 1;
+    }
+
+    /**
+     * @param read index of a read in its input
+     * @return true if the read belongs to this shard
+     */
+    bool keep(size_t read) const {
+        return read % count == index;
+    }
+};
+
+/**
+ * @brief
+ * Sequential reader over the records of a SAM, FASTQ or FASTA file.
+ * Records are parsed one at a time, the file is never fully loaded.
+ * FASTA/Q input may be gzip or bgzip compressed.
+ */
+class ReadStream {
+  public:
+    /**
+     * @param file read file
+     * @param fmt file format
+     * @param p64 Phred+64 encoding
+     */
+    ReadStream(const std::string &file, ReadFmt fmt, bool p64);
+
+    /**
+     * @brief
+     * Read the next record.
+     * @param rec record to fill
+     * @return false at the end of the file
+     * @throws std::runtime_error Malformed FASTA/Q record
+     */
+    bool next(vargas::SAM::Record &rec);
+
+    /**
+     * @brief
+     * Only return the reads of a shard, tagged with their index. Other records are skipped
+     * without being converted. Set before the first read.
+     * @param shard reads to keep
+     */
+    void set_shard(const Shard &shard) {
+        _shard = shard;
+    }
+
+    /**
+     * @return Reads returned by next()
+     */
+    const Shard &shard() const {
+        return _shard;
+    }
+
+    /**
+     * @brief
+     * Decompress BAM/CRAM input with a shared htslib thread pool.
+     * @param pool Pool to attach, nullptr for single threaded decoding.
+     */
+    void set_thread_pool(std::shared_ptr<rg::HtsPool> pool) {
+        if (_fastx) _fastx->set_thread_pool(pool);
+        _sam.set_thread_pool(std::move(pool));
+    }
+
+    /**
+     * @return Header of a SAM input, empty for FASTA/Q.
+     */
+    vargas::SAM::Header &header() {
+        return _batch ? _batch->header() : _sam.header();
+    }
+
+  private:
+    ReadFmt _fmt;
+    bool _p64, _first = true;
+    vargas::isam _sam; // BAM/CRAM
+    std::unique_ptr<vargas::SAMBatchReader> _batch; // SAM text
+    std::vector<vargas::SAM::RecordView> _views;
+    size_t _view = 0;
+    std::unique_ptr<vargas::ifastx> _fastx; // FASTA/Q
+    Shard _shard;
+    size_t _records = 0; // Records read, including skipped ones
+
+    bool _read(vargas::SAM::Record &rec, bool convert);
+};
+
+/**
+ * @brief
+ * Keep a uniform random sample of the reads, in input order, reading them once.
+ * Only n reads are held at a time.
+ * @param reads input reads
+ * @param n Number of reads to keep
+ * @param seed RNG seed
+ * @param ret Sampled reads are pushed here, with the header of reads
+ * @return Number of reads in the input
+ * @throws std::invalid_argument No reads in the input
+ */
+size_t sample_reads(ReadStream &reads, size_t n, uint64_t seed, vargas::isam &ret);
+
+/**
+ * @brief
+ * Align reads as they are read, through a read -> align -> write pipeline.
+ * @details
+ * The reader fills batches of reads and splits them into tasks of chunk_size reads,
+ * each batch is aligned on a pool of aligners.size() threads, and the writer emits the
+ * batches in input order. At most max_inflight batches are held at once, so memory does
+ * not depend on the size of the input. Aligners are rebuilt if a batch has longer reads
+ * than they were made for. With several inputs, batches are taken from each in turn.
+ * @param gm GraphMan hosting target graphs
+ * @param reads input files, each batch holds reads of one file
+ * @param align_targets List of targets : RG:Subgraph
+ * @param out destination of the aligned records
+ * @param aligners one aligner per thread
+ * @param prof Score profile used to rebuild aligners
+ * @param read_len Read length the aligners were made for
+ * @param chunk_size Reads per task
+ * @param max_inflight Maximum number of batches in memory
+ * @param numa align on pinned threads with node local graphs, nullptr to use gm on unpinned threads
+ * @param affinity keep threads on one subgraph until its tasks run out, instead of taking the largest task
+ * @return Number of reads aligned
+ */
+size_t align_stream(vargas::GraphMan &gm, const std::vector<ReadStream *> &reads, std::string align_targets,
+                    AlignOutput &out,
+                    std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners,
+                    const vargas::ScoreProfile &prof, size_t read_len, size_t chunk_size, int max_inflight,
+                    bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+                    NumaPlacement *numa = nullptr, bool affinity = true);
+
+/**
+ * @brief
+ * Add an @SQ line for each contig of the graph, so records can be written as BAM/CRAM.
+ * @param gm GraphMan with the contigs
+ * @param hdr Header to add to. Existing sequences are kept.
+ */
+void add_contig_lines(const vargas::GraphMan &gm, vargas::SAM::Header &hdr);
 
 /**
  * @brief
@@ -98,22 +444,57 @@ make_aligner(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide, b
 
 /**
  * @brief
- * Load a FASTA or FASTQ file into a SAM structure
- * @param file FAST file name
- * @param fastq
+ * Check if the score range of a read length overflows 8 bit cells.
+ * @param prof Score profile
+ * @param read_len Read length
+ * @return true if the 16 bit aligner is needed
+ */
+bool use_wide_aligner(const vargas::ScoreProfile &prof, size_t read_len);
+
+/**
+ * @brief
+ * Read the next FASTA/Q record as an unaligned SAM record.
+ * @param in reader
+ * @param rec record to fill, qual is "*" for FASTA records
+ * @param p64 Phred+64 encoding, converted to Phred+33
+ * @return false at the end of the input
+ * @throws std::runtime_error Malformed FASTA/Q record
+ */
+bool next_fast(vargas::ifastx &in, vargas::SAM::Record &rec, bool p64);
+
+/**
+ * @brief
+ * Load a FASTA or FASTQ file into a SAM structure. The file may be compressed.
+ * @param file FAST file name, empty for stdin
+ * @param fastq Unused, FASTA and FASTQ records are told apart as they are read
  * @param ret
  * @param p64 Phred+64 encoding
+ * @throws std::runtime_error Malformed FASTA/Q record
  */
 void load_fast(std::string &file, bool fastq, vargas::isam &ret, bool p64=false);
 
 /**
- * Read file format type.
+ * @brief
+ * Load an uncompressed SAM or FASTQ file by parsing blocks of it in parallel.
+ * @details
+ * The file is memory mapped and cut into blocks. Each block starts at the first record
+ * at or after its offset: the next line for SAM, and for FASTQ the next '@' line followed two
+ * lines later by a '+' line. Blocks are parsed on a ForPool and the records are kept in file order.
+ * @param file read file
+ * @param fmt file format, only SAM and FASTQ are loaded
+ * @param ret Records are pushed here, with the SAM header
+ * @param p64 Phred+64 encoding
+ * @param threads Number of parsing threads
+ * @param block_size Bytes per block, 0 to pick from the file size
+ * @return false if the file is not an uncompressed regular SAM or 4 line FASTQ file. ret is unchanged.
+ * @throws std::invalid_argument Malformed SAM record
  */
-enum class ReadFmt {SAM, FASTQ, FASTA};
+bool load_parallel(const std::string &file, ReadFmt fmt, vargas::isam &ret, bool p64, int threads,
+                   size_t block_size = 0);
 
 /**
  * @brief
- * Identity read file type
+ * Identity read file type. Compressed FASTA/Q is recognized by its content.
  * @param filename
  * @return SAM, FASTA, or FASTQ
  */
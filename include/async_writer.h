@@ -0,0 +1,267 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rg {
+/**
+ * @brief
+ * Hands formatted output buffers from worker threads to a dedicated writer thread.
+ * @details
+ * Workers push whole buffers into a bounded lock-free MPMC ring (Vyukov), and the writer
+ * thread coalesces them into large writes to the sink. Producers only wait when the
+ * ring is full. Time producers spent waiting and time the writer spent in the sink
+ * are recorded for the timing report.
+ */
+class AsyncWriter {
+  public:
+    using sink_t = std::function<void(const std::string &)>;
+
+    /**
+     * @brief
+     * Timing of a writer.
+     */
+    struct Stats {
+        size_t buffers = 0, bytes = 0, writes = 0;
+        double push_wait = 0; /**< Seconds producers waited on a full queue, summed over threads */
+        double busy = 0; /**< Seconds the writer spent writing */
+        double wall = 0; /**< Seconds the writer was running */
+    };
+
+    /**
+     * @param sink Called on the writer thread with coalesced output
+     * @param capacity Number of buffers in the queue, rounded up to a power of 2
+     * @param write_size Coalesce buffers up to this many bytes per write
+     */
+    explicit AsyncWriter(sink_t sink, size_t capacity = 256, size_t write_size = 1 << 22) :
+    _sink(std::move(sink)), _write_size(write_size) {
+        size_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        _mask = cap - 1;
+        _cells.reset(new cell[cap]);
+        for (size_t i = 0; i < cap; ++i) _cells[i].seq.store(i, std::memory_order_relaxed);
+        _start = std::chrono::steady_clock::now();
+        _thread = std::thread(&AsyncWriter::_run, this);
+    }
+
+    AsyncWriter(const AsyncWriter &) = delete;
+    AsyncWriter(AsyncWriter &&) = delete;
+
+    ~AsyncWriter() {
+        close();
+    }
+
+    /**
+     * @brief
+     * Queue a buffer for writing. Waits if the queue is full.
+     * @param buf formatted output, moved from
+     */
+    void push(std::string &&buf) {
+        if (buf.empty()) return;
+        if (_try_push(buf)) return;
+        const auto start = std::chrono::steady_clock::now();
+        unsigned spins = 0;
+        while (!_try_push(buf)) _backoff(spins);
+        _push_wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief
+     * Write all queued buffers and stop the writer thread.
+     */
+    void close() {
+        if (!_thread.joinable()) return;
+        _closed.store(true, std::memory_order_release);
+        _thread.join();
+    }
+
+    /**
+     * @return Timing so far. Complete after close().
+     */
+    Stats stats() const {
+        Stats s = _stats;
+        s.push_wait = _push_wait_ns.load(std::memory_order_relaxed) * 1e-9;
+        return s;
+    }
+
+  private:
+    struct cell {
+        std::atomic<size_t> seq{0};
+        std::string data;
+    };
+
+    bool _try_push(std::string &buf) {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        while (true) {
+            cell &c = _cells[pos & _mask];
+            const size_t seq = c.seq.load(std::memory_order_acquire);
+            const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.data.swap(buf);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // Full
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool _try_pop(std::string &buf) {
+        // Single consumer, no CAS needed on the head
+        cell &c = _cells[_head & _mask];
+        if (c.seq.load(std::memory_order_acquire) != _head + 1) return false;
+        buf.swap(c.data);
+        c.data.clear();
+        c.seq.store(_head + _mask + 1, std::memory_order_release);
+        ++_head;
+        return true;
+    }
+
+    static void _backoff(unsigned &spins) {
+        if (++spins < 64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    void _flush(std::string &out) {
+        if (out.empty()) return;
+        const auto start = std::chrono::steady_clock::now();
+        _sink(out);
+        _stats.busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        _stats.bytes += out.size();
+        ++_stats.writes;
+        out.clear();
+    }
+
+    void _run() {
+        std::string buf, out;
+        out.reserve(_write_size);
+        unsigned spins = 0;
+        while (true) {
+            if (_try_pop(buf)) {
+                spins = 0;
+                ++_stats.buffers;
+                out += buf;
+                if (out.size() >= _write_size) _flush(out);
+                continue;
+            }
+            if (_closed.load(std::memory_order_acquire)) {
+                if (_try_pop(buf)) { // Pushed before close
+                    ++_stats.buffers;
+                    out += buf;
+                    continue;
+                }
+                break;
+            }
+            if (spins >= 64) _flush(out); // Idle for a while, don't hold output back
+            _backoff(spins);
+        }
+        _flush(out);
+        _stats.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+    }
+
+    sink_t _sink;
+    size_t _write_size;
+    size_t _mask = 0;
+    std::unique_ptr<cell[]> _cells;
+    std::atomic<size_t> _tail{0};
+    size_t _head = 0; // Writer thread only
+    std::atomic<bool> _closed{false};
+    std::atomic<long long> _push_wait_ns{0};
+    Stats _stats; // Writer thread only until close()
+    std::chrono::steady_clock::time_point _start;
+    std::thread _thread;
+};
+
+/**
+ * @brief
+ * Puts buffers finished out of order back into index order before they reach an AsyncWriter.
+ * @details
+ * Buffer i is held until buffers 0..i-1 have been put, then it and any held successors are
+ * passed to the writer. At most window buffers are held: a producer with index >= next + window
+ * waits until the buffers before it are written. Producers must claim indices in increasing
+ * order (as ForPool does), otherwise the producer of the next index can be the one waiting.
+ */
+class ReorderBuffer {
+  public:
+    /**
+     * @brief
+     * Waiting and occupancy of a reorder buffer.
+     */
+    struct Stats {
+        size_t max_held = 0; /**< Most buffers held at once */
+        double wait = 0; /**< Seconds producers waited for the window, summed over threads */
+    };
+
+    /**
+     * @param writer Receives buffers in index order
+     * @param window Maximum number of buffers held, at least 1
+     */
+    ReorderBuffer(AsyncWriter &writer, size_t window) :
+    _writer(writer), _slots(window ? window : 1), _ready(_slots.size(), false) {}
+
+    /**
+     * @brief
+     * Submit buffer index. Returns once it is held or written.
+     * @param index Position of the buffer in the output, each index put exactly once
+     * @param buf formatted output, moved from
+     */
+    void put(size_t index, std::string &&buf) {
+        std::unique_lock<std::mutex> lock(_mut);
+        if (index >= _next + _slots.size()) {
+            const auto start = std::chrono::steady_clock::now();
+            _cv.wait(lock, [&] { return index < _next + _slots.size(); });
+            _stats.wait += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        const size_t slot = index % _slots.size();
+        _slots[slot].swap(buf);
+        _ready[slot] = true;
+        if (++_held > _stats.max_held) _stats.max_held = _held;
+        if (index != _next) return;
+
+        // Writer takes buffers in the order pushed, so drain under the lock
+        size_t s;
+        while (_ready[s = _next % _slots.size()]) {
+            _ready[s] = false;
+            _writer.push(std::move(_slots[s]));
+            _slots[s].clear();
+            --_held;
+            ++_next;
+        }
+        _cv.notify_all();
+    }
+
+    /**
+     * @return Number of buffers written so far.
+     */
+    size_t written() const {
+        std::lock_guard<std::mutex> lock(_mut);
+        return _next;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(_mut);
+        return _stats;
+    }
+
+  private:
+    AsyncWriter &_writer;
+    std::vector<std::string> _slots;
+    std::vector<bool> _ready;
+    size_t _next = 0, _held = 0;
+    Stats _stats;
+    mutable std::mutex _mut;
+    std::condition_variable _cv;
+};
+}
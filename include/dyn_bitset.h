@@ -107,6 +107,29 @@ class dyn_bitset {
         _bitset[bit / core_size][bit % core_size] = val;
     }
 
+    /**
+     * @brief
+     * Resize to len bits, all set to val. Existing storage is reused.
+     * @param len bitset length
+     * @param val true/false
+     */
+    void assign(size_t len, bool val = false) {
+        _bitset.resize((len / core_size) + 1);
+        if (val) set();
+        else reset();
+        _right_pad = (_bitset.size() * core_size) - len;
+    }
+
+    /**
+     * @brief
+     * Overwrite a whole block of core_size bits.
+     * @param block block index, bits [block * core_size, (block + 1) * core_size)
+     * @param bits block value
+     */
+    void set_block(const size_t block, const std::bitset<core_size> &bits) {
+        _bitset[block] = bits;
+    }
+
     /**
      * @return true if any bits are set
      */
@@ -272,11 +295,11 @@ class dyn_bitset {
      * @return number of bits set.
      */
     size_t count() const {
+        if (_bitset.empty()) return 0;
         size_t count = 0;
-        for (size_t i = 0; i < size(); ++i) {
-            if (at(i)) ++count;
-        }
-        return count;
+        for (const auto &b : _bitset) count += b.count();
+        // set() also sets the padding
+        return count - (_bitset.back() >> (core_size - _right_pad)).count();
     }
 
 
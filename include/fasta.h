@@ -8,6 +8,7 @@
  *
  * @details
  * An index is created for the opened file if it does not exist.
+ * A 2-bit reference written by ifasta::write_2bit can be opened in place of a FASTA.
  *
  * @copyright
  * Distributed under the MIT Software License.
@@ -22,8 +23,11 @@
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
+#include <unordered_map>
 
 #include "utils.h"
+#include "htspool.h"
+#include "htslib/bgzf.h"
 #include "htslib/faidx.h"
 
 
@@ -122,6 +126,17 @@ namespace vargas {
    * Provides an interface for a FASTA File. An index is built if one does not
    * already exist.
    * @details
+   * A 2-bit reference file is memory mapped read only instead. Bases are packed
+   * four per byte, with N-runs and soft-masked (lowercase) runs stored as tables.\n
+   * 2-bit file format (little endian):\n
+   * @code{.txt}
+   * "V2B1"
+   * <packed bases of each sequence>
+   * <u32 number of sequences>
+   * for each sequence: <u32 name len> <name> <u32 len> <u64 data offset>
+   *                    <u32 n N-runs> (<u32 beg> <u32 len>)* <u32 n mask runs> (<u32 beg> <u32 len>)*
+   * <u64 offset of number of sequences>
+   * @endcode
    * Usage:\n
    * @code{.cpp}
    * #include "fasta.h"
@@ -132,6 +147,9 @@ namespace vargas {
    *
    * std::string chr22 = in.seq("22"); // All of chromosome 22
    * std::string chr22_0_1000 = in.subseq("22", 0, 1000); // subsequence of a record
+   *
+   * in.write_2bit("hs37d5.2bit");
+   * Vargas::ifasta tb("hs37d5.2bit"); // Same interface, no index
    * @endcode
    */
   class ifasta {
@@ -157,21 +175,31 @@ namespace vargas {
        * @brief
        * Close any opened file and flush any outputs.
        */
-      void close() {
-          if (_index != nullptr) {
-              fai_destroy(_index);
-          }
-          _index = nullptr;
-      }
+      void close();
 
       /**
        * @brief
-       * Open a specified FASTA file and make an index.
+       * Open a specified FASTA file and make an index, or map a 2-bit reference.
        * @param file_name filename
        * @return -1 on index build error, -2 on open error, 0 otherwise
        */
       int open(const std::string &file_name);
 
+      /**
+       * @brief
+       * Write all sequences of the open file as a 2-bit reference.
+       * @param file_name output file
+       * @throws std::invalid_argument No file loaded or error writing
+       */
+      void write_2bit(const std::string &file_name) const;
+
+      /**
+       * @return true if the open file is a 2-bit reference
+       */
+      bool is_2bit() const {
+          return _map != nullptr;
+      }
+
       /**
        * @return opened file name.
        */
@@ -186,7 +214,7 @@ namespace vargas {
        * @return number of sequences in the FASTA file
        */
       size_t num_seq() const {
-          return faidx_nseq(_index);
+          return is_2bit() ? _tb_seqs.size() : faidx_nseq(_index);
       }
 
       /**
@@ -196,7 +224,7 @@ namespace vargas {
        * @return sequence
        */
       std::string seq(const std::string &name) const {
-          return std::string(subseq(name, 0, faidx_seq_len(_index, name.c_str())));
+          return subseq(name, 0, seq_len(name));
       }
 
       /**
@@ -210,14 +238,47 @@ namespace vargas {
        */
       std::string subseq(const std::string &name, pos_t beg, pos_t end) const;
 
+      /**
+       * @brief
+       * Read only view of a range of resident bases.
+       */
+      struct base_view {
+          const rg::Base *first, *last;
+          const rg::Base *begin() const { return first; }
+          const rg::Base *end() const { return last; }
+          size_t size() const { return last - first; }
+      };
+
+      /**
+       * @brief
+       * Keep a range of a sequence in memory, encoded as rg::Base. subseq and subseq_num
+       * calls within the range are then served without touching the file.
+       * Replaces any previously loaded range.
+       * @param name sequence name
+       * @param beg beginning index, inclusive
+       * @param end ending index, inclusive. 0 for the end of the sequence.
+       */
+      void load(const std::string &name, pos_t beg = 0, pos_t end = 0);
+
+      /**
+       * @brief
+       * Encoded subsequence, 0 based indexing. If the range is not resident, the whole
+       * sequence is loaded first.
+       * @param name Name of sequence to extract from
+       * @param beg beginning index, inclusive
+       * @param end ending index, inclusive
+       * @return View of the resident bases, valid until the next load.
+       */
+      base_view subseq_num(const std::string &name, pos_t beg, pos_t end);
+
       /**
        * @brief
        * Return sequence length
        * @param name sequence name
        * @return sequence length
        */
-      size_t seq_len(const std::string& name) {
-          return faidx_seq_len(_index, name.c_str());
+      size_t seq_len(const std::string& name) const {
+          return is_2bit() ? _tb_seq(name).len : faidx_seq_len(_index, name.c_str());
       }
 
       /**
@@ -252,7 +313,7 @@ namespace vargas {
        * @return true if FASTA index loaded
        */
       bool good() const {
-          return _index != nullptr;
+          return _index != nullptr || is_2bit();
       }
 
       /**
@@ -371,10 +432,128 @@ namespace vargas {
       }
 
     private:
+      /**
+       * @return true if [beg, end] of name is resident
+       */
+      bool _is_resident(const std::string &name, pos_t beg, pos_t end) const {
+          return !_resident_name.empty() && name == _resident_name && beg >= _resident_beg && end >= beg
+                 && end - _resident_beg < _resident.size();
+      }
+
+      /**
+       * @brief
+       * Sequence record of a mapped 2-bit file.
+       */
+      struct twobit_seq {
+          std::string name;
+          pos_t len;
+          const uint8_t *data; // Packed bases, 4 per byte
+          std::vector<std::pair<pos_t, pos_t>> nruns, masks; // <beg, len>, sorted
+      };
+
+      /**
+       * @throws std::invalid_argument sequence does not exist
+       */
+      const twobit_seq &_tb_seq(const std::string &name) const;
+
+      /**
+       * @brief
+       * Decode [beg, end] of a 2-bit sequence, N-runs included.
+       */
+      void _tb_decode(const twobit_seq &s, pos_t beg, pos_t end, rg::Base *out) const;
+
+      int _open_2bit(const std::string &file_name);
+
       friend class iterator;
       std::vector<std::string> _seq_names;
       std::string _file_name;
       faidx_t *_index = nullptr;
+
+      const uint8_t *_map = nullptr; // Mapped 2-bit file
+      size_t _map_len = 0;
+      std::vector<twobit_seq> _tb_seqs;
+      std::unordered_map<std::string, size_t> _tb_names;
+
+      std::vector<rg::Base> _resident; // Encoded bases of the loaded range
+      std::string _resident_name;
+      pos_t _resident_beg = 0;
+  };
+
+  /**
+   * @brief
+   * Streaming reader of FASTA and FASTQ reads.
+   * @details
+   * Input is read through BGZF, so plain, gzip and bgzip files (and stdin) are accepted.
+   * Records are parsed from a fixed size buffer as in kseq: sequences may span several
+   * lines in both formats, and FASTA and FASTQ records may be mixed.
+   * Usage:\n
+   * @code{.cpp}
+   * #include "fasta.h"
+   *
+   * vargas::ifastx in("reads.fq.gz");
+   * std::string name, seq, qual;
+   * while (in.next(name, seq, qual)) {
+   *     // qual is empty for FASTA records
+   * }
+   * @endcode
+   */
+  class ifastx {
+    public:
+      /**
+       * @param file file name, empty or "-" for stdin
+       * @throws std::invalid_argument if the file cannot be opened
+       */
+      explicit ifastx(const std::string &file = "");
+
+      ~ifastx() {
+          close();
+      }
+
+      ifastx(const ifastx &) = delete;
+      ifastx &operator=(const ifastx &) = delete;
+
+      void close();
+
+      /**
+       * @brief
+       * Decompress BGZF input with a shared htslib thread pool. Has no effect on plain gzip.
+       * @param pool Pool to attach, nullptr for single threaded decoding.
+       */
+      void set_thread_pool(std::shared_ptr<rg::HtsPool> pool);
+
+      /**
+       * @brief
+       * Read the next record. Strings are overwritten, so their storage is reused.
+       * @param name read name, up to the first whitespace
+       * @param seq sequence
+       * @param qual quality string, empty for FASTA records
+       * @return false at the end of the input
+       * @throws std::runtime_error Truncated record or read error
+       */
+      bool next(std::string &name, std::string &seq, std::string &qual);
+
+    private:
+      bool _fill();
+
+      int _getc() {
+          if (_beg == _end && !_fill()) return -1;
+          return (unsigned char) _buf[_beg++];
+      }
+
+      /**
+       * @brief
+       * Append the rest of the line to s, without the line ending.
+       * @return false at the end of the input with nothing read
+       */
+      bool _getline(std::string &s);
+
+      BGZF *_fp = nullptr;
+      std::shared_ptr<rg::HtsPool> _pool;
+      std::vector<char> _buf;
+      size_t _beg = 0, _end = 0;
+      bool _eof = false;
+      int _last = 0; // Header char of the next record once it has been read
+      std::string _line;
   };
 
 }
@@ -266,6 +266,15 @@ namespace vargas {
            */
           void set_seq(const std::vector<rg::Base> &seq) { this->_seq = seq; }
 
+          /**
+           * @brief
+           * Set the sequence from a range of encoded bases.
+           * @param first beginning of range
+           * @param last end of range
+           */
+          template<typename Iter>
+          void set_seq(Iter first, Iter last) { _seq.assign(first, last); }
+
           /**
            * @brief
            * Sets the node as a reference node, and sets all bits in the population.
@@ -863,7 +872,7 @@ namespace vargas {
 
       /**
        * @param fafile FASTA file
-       * @param varfile VCF or BCF file.
+       * @param varfile VCF or BCF file, or a variant cache.
        */
       GraphFactory(std::string fafile, std::string const &varfile) : _fa_file(std::move(fafile)) {
           open_bcf(varfile);
@@ -913,6 +922,30 @@ namespace vargas {
           _vf->assume_contig_chr();
       }
 
+      /**
+       * @brief
+       * Decompress the variant file with a shared htslib thread pool.
+       * @param pool
+       */
+      void set_thread_pool(std::shared_ptr<rg::HtsPool> pool) {
+          if (!_vf) throw std::invalid_argument("No variant file opened.");
+          _vf->set_thread_pool(std::move(pool));
+      }
+
+      /**
+       * @return Number of variant records decoded by the last build.
+       */
+      size_t num_decoded() const {
+          return _num_decoded;
+      }
+
+      /**
+       * @return Seconds spent reading and decoding variant records in the last build.
+       */
+      double decode_time() const {
+          return _decode_time;
+      }
+
       /**
        * Open the given file
        * @param file_name
@@ -987,8 +1020,10 @@ namespace vargas {
 
     private:
       std::string _fa_file;
-      std::unique_ptr<VCF> _vf;
+      std::unique_ptr<VarFile> _vf;
       ifasta _fa;
+      size_t _num_decoded = 0;
+      double _decode_time = 0;
 
   };
 
@@ -103,6 +103,15 @@ namespace vargas {
                   std::string sample_filter="", size_t limvar=0);
 
 
+      /**
+       * @brief
+       * Decode a VCF/BCF into a variant cache, which can later be used in place of the VCF.
+       * @param vcf VCF/BCF filename
+       * @param cache Output cache filename
+       * @return Number of records in the cache
+       */
+      size_t write_cache(const std::string &vcf, const std::string &cache);
+
       /**
        * @brief
        * Write graphs to a file. Graphs are consumed while written.
@@ -178,6 +187,16 @@ namespace vargas {
           _assume_contig = true;
       }
 
+      /**
+       * @brief
+       * Decompress variant files with a pool of htslib threads.
+       * @param n Number of threads, 0 to decode on the calling thread.
+       */
+      void set_io_threads(int n) {
+          if (n > 0) _io_pool = std::make_shared<rg::HtsPool>(n);
+          else _io_pool.reset();
+      }
+
       /**
        * Print construction/writing progress.
        * @return
@@ -204,6 +223,7 @@ namespace vargas {
       std::map<std::string, std::shared_ptr<vargas::Graph>> _graphs; // Map label to a graph
       coordinate_resolver _resolver;
       std::map<std::string, std::string> _aux;
+      std::shared_ptr<rg::HtsPool> _io_pool;
       bool _assume_contig = false;
       bool _print = false;
   };
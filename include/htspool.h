@@ -0,0 +1,30 @@
+#pragma once
+#include "htslib/hts.h"
+#include "htslib/thread_pool.h"
+
+namespace rg {
+/**
+ * @brief
+ * Shared htslib thread pool. Several htsFiles can decompress/compress BGZF blocks
+ * on the same set of threads, so readers opened one after another do not each spawn threads.
+ */
+struct HtsPool {
+    htsThreadPool p_;
+    int nthreads_;
+    HtsPool(int nthreads): p_{nthreads > 0 ? hts_tpool_init(nthreads) : nullptr, 0}, nthreads_(nthreads) {}
+    HtsPool(const HtsPool &) = delete;
+    HtsPool(HtsPool &&) = delete;
+    int threads() const { return p_.pool ? nthreads_ : 0; }
+    /**
+     * @brief
+     * Attach the pool to an open file.
+     * @return true if the file is now using the pool.
+     */
+    bool attach(htsFile *fp) {
+        return p_.pool && fp && hts_set_thread_pool(fp, &p_) == 0;
+    }
+    ~HtsPool() {
+        if (p_.pool) hts_tpool_destroy(p_.pool);
+    }
+};
+}
@@ -54,6 +54,14 @@ int profile(int argc, char *argv[]);
  */
 int convert_main(int argc, char **argv);
 
+/**
+ * @brief
+ * Merge the outputs of a sharded alignment in input order.
+ * @param argc CL arg count
+ * @param argv CL args
+ */
+int merge_main(int argc, char *argv[]);
+
 /**
  * @brief
  * Query sequence files
@@ -68,6 +76,7 @@ void profile_help(const cxxopts::Options &opts);
 void sim_help(const cxxopts::Options &opts);
 void define_help(const cxxopts::Options &opts);
 void convert_help(const cxxopts::Options &opts);
+void merge_help(const cxxopts::Options &opts);
 void query_help(const cxxopts::Options &opts);
 
 #endif //VARGAS_MAIN_H
\ No newline at end of file
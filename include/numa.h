@@ -0,0 +1,146 @@
+#pragma once
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <sched.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace rg {
+/**
+ * @brief
+ * NUMA nodes of the host and the CPUs of each, read from sysfs.
+ * @details
+ * Only CPUs the process may run on are kept, and nodes without any are dropped, so a
+ * process restricted to one socket sees one node.
+ */
+class NumaTopology {
+  public:
+    NumaTopology() = default;
+
+    /**
+     * @param root directory holding node<N>/cpulist files
+     * @return nodes found under root, none if it is missing
+     */
+    static NumaTopology detect(const std::string &root = "/sys/devices/system/node") {
+        NumaTopology ret;
+        DIR *dir = opendir(root.c_str());
+        if (!dir) return ret;
+        std::vector<int> ids;
+        while (const dirent *e = readdir(dir)) {
+            const std::string name = e->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4) continue;
+            if (name.find_first_not_of("0123456789", 4) != std::string::npos) continue;
+            ids.push_back(std::stoi(name.substr(4)));
+        }
+        closedir(dir);
+        std::sort(ids.begin(), ids.end());
+
+        const std::vector<int> allowed = allowed_cpus();
+        for (const int id : ids) {
+            std::ifstream in(root + "/node" + std::to_string(id) + "/cpulist");
+            std::string list;
+            if (!std::getline(in, list)) continue;
+            std::vector<int> cpus;
+            for (const int c : parse_cpulist(list)) {
+                if (allowed.empty() || std::binary_search(allowed.begin(), allowed.end(), c)) cpus.push_back(c);
+            }
+            if (cpus.empty()) continue;
+            ret._ids.push_back(id);
+            ret._cpus.push_back(std::move(cpus));
+        }
+        return ret;
+    }
+
+    /**
+     * @param list CPU list in sysfs format, e.g. "0-3,8-11"
+     * @return CPUs in the list, in order
+     * @throws std::invalid_argument if the list is malformed
+     */
+    static std::vector<int> parse_cpulist(const std::string &list) {
+        std::vector<int> ret;
+        size_t pos = 0;
+        while (pos < list.size() && list[pos] != '\n') {
+            size_t end = list.find_first_of(",\n", pos);
+            if (end == std::string::npos) end = list.size();
+            const std::string range = list.substr(pos, end - pos);
+            const size_t dash = range.find('-');
+            try {
+                const int lo = std::stoi(range.substr(0, dash));
+                const int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+                if (hi < lo) throw std::invalid_argument(range);
+                for (int c = lo; c <= hi; ++c) ret.push_back(c);
+            } catch (std::logic_error &) {
+                throw std::invalid_argument("Invalid CPU list \"" + list + "\".");
+            }
+            pos = end + (end < list.size() && list[end] == ',');
+        }
+        return ret;
+    }
+
+    /**
+     * @return CPUs the calling thread may run on, sorted. Empty if unknown.
+     */
+    static std::vector<int> allowed_cpus() {
+        std::vector<int> ret;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) return ret;
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &set)) ret.push_back(c);
+        }
+#endif
+        return ret;
+    }
+
+    /**
+     * @return Number of nodes
+     */
+    size_t size() const {
+        return _cpus.size();
+    }
+
+    /**
+     * @param node node index, 0 to size()
+     * @return sysfs ID of node
+     */
+    int id(size_t node) const {
+        return _ids.at(node);
+    }
+
+    /**
+     * @param node node index, 0 to size()
+     * @return CPUs of node
+     */
+    const std::vector<int> &cpus(size_t node) const {
+        return _cpus.at(node);
+    }
+
+    /**
+     * @brief
+     * Restrict the calling thread to the CPUs of node.
+     * @param node node index, 0 to size()
+     * @return false if the affinity could not be set
+     */
+    bool pin(size_t node) const {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (const int c : _cpus.at(node)) {
+            if (c < CPU_SETSIZE) CPU_SET(c, &set);
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        (void) node;
+        return false;
+#endif
+    }
+
+  private:
+    std::vector<int> _ids;
+    std::vector<std::vector<int>> _cpus;
+};
+}
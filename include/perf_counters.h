@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace rg {
+/**
+ * @brief
+ * Hardware cache references and misses of the calling thread, from perf_event_open.
+ * @details
+ * Counters only count the thread that created them, in user space. They are unavailable
+ * outside Linux, in most containers, and when kernel.perf_event_paranoid forbids them;
+ * ok() is then false and read() returns zeros.
+ */
+class CacheCounter {
+  public:
+    /**
+     * @brief
+     * Counts of a counter.
+     */
+    struct Counts {
+        uint64_t references = 0, misses = 0;
+
+        Counts operator-(const Counts &o) const {
+            Counts ret;
+            ret.references = references - o.references;
+            ret.misses = misses - o.misses;
+            return ret;
+        }
+
+        Counts &operator+=(const Counts &o) {
+            references += o.references;
+            misses += o.misses;
+            return *this;
+        }
+    };
+
+    /**
+     * @brief
+     * Start counting the calling thread.
+     */
+    CacheCounter() {
+#ifdef __linux__
+        _refs = _open(PERF_COUNT_HW_CACHE_REFERENCES);
+        _misses = _open(PERF_COUNT_HW_CACHE_MISSES);
+        if (_refs < 0 || _misses < 0) _close();
+#endif
+    }
+
+    CacheCounter(const CacheCounter &) = delete;
+
+    ~CacheCounter() {
+        _close();
+    }
+
+    /**
+     * @return true if the counters are open
+     */
+    bool ok() const {
+        return _refs >= 0;
+    }
+
+    /**
+     * @return Counts since construction
+     */
+    Counts read() const {
+        Counts ret;
+#ifdef __linux__
+        if (!ok()) return ret;
+        if (::read(_refs, &ret.references, sizeof(uint64_t)) != sizeof(uint64_t)) ret.references = 0;
+        if (::read(_misses, &ret.misses, sizeof(uint64_t)) != sizeof(uint64_t)) ret.misses = 0;
+#endif
+        return ret;
+    }
+
+  private:
+#ifdef __linux__
+    static int _open(uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+
+    void _close() {
+#ifdef __linux__
+        if (_refs >= 0) close(_refs);
+        if (_misses >= 0) close(_misses);
+#endif
+        _refs = _misses = -1;
+    }
+
+    int _refs = -1, _misses = -1;
+};
+}
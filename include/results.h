@@ -0,0 +1,239 @@
+/**
+ * @file
+ *
+ * @brief
+ * Compact columnar output of alignment scores.
+ *
+ * @details
+ * With --msonly or --maxonly only a few integers per read are meaningful, so writing full
+ * SAM text is mostly SEQ, QUAL and tag names. A results file (.vres) keeps the score tags
+ * of each read as integer columns, and the read names in a dictionary. Files are written
+ * through osam, and exported with vargas convert.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ */
+
+#ifndef VARGAS_RESULTS_H
+#define VARGAS_RESULTS_H
+
+#include "sam.h"
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace vargas {
+
+  /**
+   * @brief
+   * One block of reads of a results file, decoded into columns.
+   * @details
+   * Block layout, in host byte order:
+   * @code{.txt}
+   * uint32 number of reads N
+   * for each column: uint8 width W, int64 base, N values of W bytes
+   * uint32 length of names, N NUL terminated read names
+   * @endcode
+   * Each value is stored as its offset from base. The largest W byte value marks a missing value.
+   * A width of 0 means every value is base, so a constant or absent column takes no space.
+   */
+  struct ResultsBlock {
+      enum Col {FLAG, RNAME, SCORE, MAX_POS, MAX_COUNT, SUB_SCORE, SUB_POS, SUB_COUNT, SUB_STRAND, SUB_SEQ,
+          READ_GROUP, NUM_COLS};
+
+      static constexpr int64_t NONE = std::numeric_limits<int64_t>::min(); /**< Missing value */
+
+      /**
+       * @return number of reads
+       */
+      size_t size() const {
+          return name_end.size();
+      }
+
+      /**
+       * @return name of read i
+       */
+      rg::StrRef name(size_t i) const {
+          const size_t beg = i ? name_end[i - 1] + 1 : 0;
+          return rg::StrRef(names.data() + beg, names.data() + name_end[i]);
+      }
+
+      /**
+       * @brief
+       * Remove all reads.
+       */
+      void clear() {
+          for (auto &c : cols) c.clear();
+          names.clear();
+          name_end.clear();
+      }
+
+      /**
+       * Values of each column. RNAME and SUB_SEQ are indices into the contigs of the file,
+       * READ_GROUP into the read groups, SUB_STRAND is 0 for forward and 1 for reverse.
+       */
+      std::array<std::vector<int64_t>, NUM_COLS> cols;
+      std::string names; /**< Read names, NUL separated */
+      std::vector<uint32_t> name_end; /**< End of each name in names */
+  };
+
+  /**
+   * @brief
+   * Encodes aligned records into results file blocks.
+   * @details
+   * File layout, in host byte order:
+   * @code{.txt}
+   * "VRS1"
+   * uint32 length, SAM header text
+   * uint32 number of contigs, NUL terminated contig names
+   * uint32 number of read groups, NUL terminated read group IDs
+   * blocks until the end of the file
+   * @endcode
+   * Contigs are taken from the @SQ lines, and read groups from the @RG lines of the header.
+   * Names not in the header are stored as missing.
+   */
+  class ResultsFormat {
+    public:
+      /**
+       * @param hdr header of the records
+       */
+      explicit ResultsFormat(const SAM::Header &hdr);
+
+      /**
+       * @return file header, written before the first block
+       */
+      std::string header() const;
+
+      /**
+       * @brief
+       * Append one block holding records to out. Safe to call from several threads.
+       * @param records aligned records
+       * @param out appended to
+       */
+      void append_block(const std::vector<SAM::Record> &records, std::string &out) const;
+
+      /**
+       * @brief
+       * Append one block holding the pointed to records to out. Safe to call from several threads.
+       */
+      void append_block(const std::vector<const SAM::Record *> &records, std::string &out) const;
+
+      /**
+       * @param file_name output file name
+       * @return true if the file name has the .vres extension
+       */
+      static bool is_results(const std::string &file_name);
+
+    private:
+      int64_t _index(const std::unordered_map<std::string, int64_t> &dict, const std::string &name) const;
+
+      std::string _hdr_text;
+      std::vector<std::string> _contigs, _read_groups;
+      std::unordered_map<std::string, int64_t> _contig_index, _rg_index;
+  };
+
+  /**
+   * @brief
+   * Reads the blocks of a results file.
+   */
+  class ResultsReader {
+    public:
+      /**
+       * @param file_name results file
+       * @throws std::invalid_argument if the file cannot be opened or is not a results file
+       */
+      explicit ResultsReader(const std::string &file_name);
+
+      /**
+       * @param file_name any file
+       * @return true if the file starts with the results file magic
+       */
+      static bool is_results(const std::string &file_name);
+
+      /**
+       * @return SAM header the file was written with
+       */
+      const SAM::Header &header() const {
+          return _hdr;
+      }
+
+      /**
+       * @return contig names, indexed by RNAME and SUB_SEQ values
+       */
+      const std::vector<std::string> &contigs() const {
+          return _contigs;
+      }
+
+      /**
+       * @return read group IDs, indexed by READ_GROUP values
+       */
+      const std::vector<std::string> &read_groups() const {
+          return _read_groups;
+      }
+
+      /**
+       * @brief
+       * Decode the next block.
+       * @param block replaced with the reads of the block
+       * @return false at the end of the file
+       * @throws std::runtime_error if the file is truncated
+       */
+      bool next(ResultsBlock &block);
+
+    private:
+      void _read(void *dst, size_t n);
+
+      std::ifstream _in;
+      SAM::Header _hdr;
+      std::vector<std::string> _contigs, _read_groups;
+      std::vector<char> _buf;
+  };
+
+  /**
+   * @brief
+   * A fixed list of tags extracted from results blocks, the counterpart of SAM::Projection.
+   * @details
+   * Supported tags are QNAME, FLAG, RNAME, RG, the alignment tags (AS, mp, mc, ss, sp, sc, st, su),
+   * and RG: prefixed read group tags. Other tags are always missing.
+   */
+  class ResultsProjection {
+    public:
+      /**
+       * @param tags tags to extract, in output order
+       * @param reader file the blocks are read from
+       */
+      ResultsProjection(const std::vector<std::string> &tags, const ResultsReader &reader);
+
+      /**
+       * @brief
+       * Append the tags of read i as a line. Missing tags are written as "*".
+       * @param block block of the read
+       * @param i read index
+       * @param out appended to, including the newline
+       * @param missing element i is set to true if tag i is missing, and left as is otherwise
+       * @param tsv tab separated values instead of quoted, comma separated values
+       */
+      void append_row(const ResultsBlock &block, size_t i, std::string &out, std::vector<char> &missing,
+                      bool tsv = false) const;
+
+    private:
+      enum Kind : char {NAME, COLUMN, READ_GROUP_TAG, NONE};
+      struct Column {
+          Kind kind;
+          ResultsBlock::Col col;
+          size_t rg; // Index into _rg_values
+      };
+
+      std::vector<Column> _cols;
+      const std::vector<std::string> &_contigs, &_read_groups;
+      std::vector<std::vector<std::pair<bool, std::string>>> _rg_values; // [read group][RG: tag]
+  };
+}
+
+#endif //VARGAS_RESULTS_H
@@ -16,6 +16,11 @@
 #define VARGAS_SAM_H
 
 #include "utils.h"
+#include "htspool.h"
+#include "htslib/sam.h"
+#include <array>
+#include <fstream>
+#include <memory>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -47,15 +52,35 @@ namespace vargas {
       /**
        * @param s Tokenize s into a cigar
        */
-      void parse(const std::string &s);
+      void parse(const std::string &s) {
+          parse(rg::StrRef(s));
+      }
+
+      /**
+       * @param s Tokenize s into a cigar
+       * @throws std::invalid_argument if an operation length is not a number
+       */
+      void parse(rg::StrRef s);
 
       std::string to_string() const {
-          if (_cigar.empty()) return "*";
-          std::ostringstream ss;
+          std::string ret;
+          append_to(ret);
+          return ret;
+      }
+
+      /**
+       * @brief
+       * Append the cigar string to out, "*" if empty.
+       */
+      void append_to(std::string &out) const {
+          if (_cigar.empty()) {
+              out += '*';
+              return;
+          }
           for (const auto &t : _cigar) {
-              ss << t.first << t.second;
+              rg::append_int(out, t.first);
+              out += t.second;
           }
-          return ss.str();
       }
 
       /*
@@ -67,6 +92,16 @@ namespace vargas {
 
       size_t size() const { return _cigar.size(); }
 
+      void clear() { _cigar.clear(); }
+
+      /**
+       * @brief
+       * Append an operation.
+       * @param len Number of bases
+       * @param op Operator, one of CIGAR_OPERATORS
+       */
+      void push_back(size_t len, char op) { _cigar.emplace_back(len, op); }
+
       typename std::vector<std::pair<size_t, char>>::const_iterator begin() const {
           return _cigar.cbegin();
       }
@@ -130,17 +165,92 @@ namespace vargas {
        * Represents optional data fields for any Header or Record type row.
        */
       struct Optional {
-          std::unordered_map<std::string, std::string> aux;
-          /**< Map the two char tag to value */
-          std::unordered_map<std::string, char> aux_fmt; /**< Map the two char tag to format */
+          /**
+           * @brief
+           * One tag. Integers and reals set from code are kept native and only formatted on output.
+           */
+          struct Field {
+              enum class Kind : char {INT, REAL, TEXT};
+
+              char tag[2]; /**< Tag, second char is 0 for single char tags */
+              char fmt; /**< SAM type: A, i, f, Z, H or B */
+              Kind kind;
+              uint8_t prefix_len;
+              char prefix[6]; /**< "\tTAG:FMT:", written ahead of the value */
+              union {
+                  long long i;
+                  double f;
+              };
+              std::string text; /**< Value if kind is TEXT */
+
+              /**
+               * @return true if this is tag t
+               */
+              bool is(const char *t, size_t len) const {
+                  return len && len <= 2 && tag[0] == t[0] && tag[1] == (len == 2 ? t[1] : '\0');
+              }
+
+              /**
+               * @return Value formatted for SAM
+               */
+              std::string value() const;
+
+              /**
+               * @brief
+               * Append "TAG:FMT:VALUE" to out.
+               */
+              void append_to(std::string &out) const {
+                  out.append(prefix + 1, prefix_len - 1);
+                  append_value(out);
+              }
+
+              /**
+               * @brief
+               * Append the value formatted for SAM to out.
+               */
+              void append_value(std::string &out) const;
+
+              /**
+               * @brief
+               * Set the type and rebuild the prefix.
+               */
+              void set_type(char f, Kind k) {
+                  fmt = f;
+                  kind = k;
+                  prefix_len = 0;
+                  prefix[prefix_len++] = '\t';
+                  prefix[prefix_len++] = tag[0];
+                  if (tag[1]) prefix[prefix_len++] = tag[1];
+                  prefix[prefix_len++] = ':';
+                  prefix[prefix_len++] = fmt;
+                  prefix[prefix_len++] = ':';
+              }
+          };
 
           /**
            * @brief
            * Clear all tags.
            */
           void clear() {
-              aux.clear();
-              aux_fmt.clear();
+              _n = 0;
+              _overflow.clear();
+          }
+
+          /**
+           * @return Number of tags.
+           */
+          size_t size() const {
+              return _n + _overflow.size();
+          }
+
+          /**
+           * @brief
+           * Call f(const Field &) for each tag, in the order they were first set.
+           */
+          template<typename F>
+          void for_each(F f) const {
+              for (uint8_t i = 0; i < _n; ++i) f(_inline[i]);
+              for (const auto &fd : _overflow) f(fd);
           }
 
           /**
@@ -149,21 +259,96 @@ namespace vargas {
            * Y is the format, Z is the value. If Y is not provided, assume string.
            * @param a aux field
            */
-          void add(std::string a);
+          void add(const std::string &a);
+
+          /**
+           * @brief
+           * Set a tag from its SAM text.
+           * @param tag 1 or 2 character tag
+           * @param fmt SAM type
+           * @param val value text. Integers are parsed, other types are kept as text.
+           */
+          void set_text(rg::StrRef tag, char fmt, rg::StrRef val);
 
           template<typename T>
-          void set(const std::string &tag, const T &val) {
-              char fmt_tag = 'Z'; // Default string type
-              if (std::is_floating_point<T>::value) fmt_tag = 'f';
-              else if (std::is_integral<T>::value) fmt_tag = 'i';
-              aux[tag] = rg::to_string(val);
-              aux_fmt[tag] = fmt_tag;
+          typename std::enable_if<std::is_integral<T>::value>::type
+          set(const std::string &tag, const T &val) {
+              Field &f = _field(tag);
+              f.set_type('i', Field::Kind::INT);
+              f.i = val;
           }
 
           template<typename T>
-          bool get(const std::string &tag, T &val) const {
-              if (aux.count(tag) == 0) return false;
-              rg::from_string(aux.at(tag), val);
+          typename std::enable_if<std::is_floating_point<T>::value>::type
+          set(const std::string &tag, const T &val) {
+              Field &f = _field(tag);
+              f.set_type('f', Field::Kind::REAL);
+              f.f = val;
+          }
+
+          void set(const std::string &tag, const std::string &val) {
+              Field &f = _field(tag);
+              f.set_type('Z', Field::Kind::TEXT);
+              f.text = val;
+          }
+
+          void set(const std::string &tag, const char *val) {
+              set(tag, std::string(val));
+          }
+
+          /**
+           * @param tag tag to find
+           * @return field, nullptr if not present
+           */
+          const Field *find(const std::string &tag) const {
+              return const_cast<Optional *>(this)->_find(tag.data(), tag.length());
+          }
+
+          /**
+           * @brief
+           * Remove a tag, keeping the order of the others.
+           * @param tag tag to remove
+           * @return false if the tag is not present
+           */
+          bool erase(const std::string &tag) {
+              for (uint8_t i = 0; i < _n; ++i) {
+                  if (!_inline[i].is(tag.data(), tag.length())) continue;
+                  for (uint8_t j = i + 1; j < _n; ++j) _inline[j - 1] = std::move(_inline[j]);
+                  if (_overflow.empty()) --_n;
+                  else {
+                      _inline[_n - 1] = std::move(_overflow.front());
+                      _overflow.erase(_overflow.begin());
+                  }
+                  return true;
+              }
+              for (auto f = _overflow.begin(); f != _overflow.end(); ++f) {
+                  if (!f->is(tag.data(), tag.length())) continue;
+                  _overflow.erase(f);
+                  return true;
+              }
+              return false;
+          }
+
+          /**
+           * @brief
+           * Get a tag. Numbers set natively are converted directly, text is parsed.
+           * @return false if the tag is not present
+           */
+          template<typename T>
+          typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+          get(const std::string &tag, T &val) const {
+              const Field *f = find(tag);
+              if (!f) return false;
+              if (f->kind == Field::Kind::INT) val = T(f->i);
+              else if (f->kind == Field::Kind::REAL) val = T(f->f);
+              else rg::from_string(f->text, val);
+              return true;
+          }
+
+          bool get(const std::string &tag, std::string &val) const {
+              const Field *f = find(tag);
+              if (!f) return false;
+              val = f->value();
               return true;
           }
 
@@ -175,6 +360,52 @@ namespace vargas {
            */
           std::string to_string() const;
 
+          /**
+           * @brief
+           * Append each tag as "\tTAG:FMT:VALUE" to out.
+           */
+          void append_to(std::string &out) const {
+              for_each([&out](const Field &f) {
+                  out.append(f.prefix, f.prefix_len);
+                  f.append_value(out);
+              });
+          }
+
+        private:
+          static constexpr uint8_t INLINE_FIELDS = 8;
+
+          Field *_find(const char *tag, size_t len) {
+              for (uint8_t i = 0; i < _n; ++i) if (_inline[i].is(tag, len)) return _inline + i;
+              for (auto &f : _overflow) if (f.is(tag, len)) return &f;
+              return nullptr;
+          }
+
+          /**
+           * @brief
+           * Existing field for tag, or a new one after the last.
+           * @throws std::invalid_argument if the tag is not 1 or 2 characters
+           */
+          Field &_field(rg::StrRef tag) {
+              Field *f = _find(tag.ptr, tag.len);
+              if (f) return *f;
+              if (tag.len == 0 || tag.len > 2) throw std::invalid_argument("Invalid aux tag: " + tag.str());
+              if (_n < INLINE_FIELDS) f = _inline + _n++;
+              else {
+                  _overflow.emplace_back();
+                  f = &_overflow.back();
+              }
+              f->tag[0] = tag[0];
+              f->tag[1] = tag.len == 2 ? tag[1] : '\0';
+              return *f;
+          }
+
+          Field &_field(const std::string &tag) {
+              return _field(rg::StrRef(tag));
+          }
+
+          Field _inline[INLINE_FIELDS];
+          uint8_t _n = 0;
+          std::vector<Field> _overflow;
       };
 
       /**
@@ -583,14 +814,26 @@ namespace vargas {
            * Output the record in single line format
            * @return single line string
            */
-          std::string to_string() const;
+          std::string to_string() const {
+              std::string ret;
+              append_to(ret);
+              return ret;
+          }
+
+          /**
+           * @brief
+           * Append the record in single line format to out, without a newline.
+           * Formats directly into out so a reused buffer does not allocate per record.
+           * @param out string to append to
+           */
+          void append_to(std::string &out) const;
 
           /**
            * @brief
            * Parse the line and populate fields.
            * @throws std::invalid_argument if record has incorrect number of fields
            */
-          void parse(std::string line);
+          void parse(const std::string &line);
 
           /**
            * @brief
@@ -619,6 +862,24 @@ namespace vargas {
               parse(std::move(line));
           }
 
+          /**
+           * @brief
+           * Populate fields from a BAM record.
+           * @param h header the record was read with, resolves reference IDs
+           * @param b BAM record
+           * @throws std::invalid_argument if an aux field has an unknown type
+           */
+          void from_bam(const bam_hdr_t *h, const bam1_t *b);
+
+          /**
+           * @brief
+           * Encode the record into a BAM record. Integer tags use the smallest type that holds the value.
+           * @param h output header, reference names not in the header are written as unmapped (*)
+           * @param b BAM record to fill
+           * @throws std::invalid_argument if an aux field is malformed
+           */
+          void to_bam(const bam_hdr_t *h, bam1_t *b) const;
+
           /**
            * @brief
            * Get a tag from the associated header read group.
@@ -674,9 +935,133 @@ namespace vargas {
 
       };
 
+      /**
+       * @brief
+       * Columns of one SAM text line, referencing the line instead of copying it.
+       * @details
+       * parse() only finds the tabs. Numbers and aux tags are decoded on request, so a
+       * reader that uses a few columns never builds the rest. Views are valid while the
+       * line's buffer is.
+       */
+      struct RecordView {
+          enum Col {QNAME, FLAG, RNAME, POS, MAPQ, CIGAR, RNEXT, PNEXT, TLEN, SEQ, QUAL};
+
+          std::array<rg::StrRef, 11> cols; /**< Mandatory columns */
+          rg::StrRef aux; /**< Optional fields, tab separated */
+
+          /**
+           * @brief
+           * Split a line into columns.
+           * @param beg line start
+           * @param end line end, excluding the newline
+           * @return false if the line has fewer than 11 columns
+           */
+          bool parse(const char *beg, const char *end);
+
+          /**
+           * @param c numeric column
+           * @return value of the column
+           * @throws std::invalid_argument if the column is not an integer
+           */
+          int integer(Col c) const {
+              int v;
+              if (!rg::parse_int(cols[c], v))
+                  throw std::invalid_argument("Invalid integer column in SAM record " + cols[QNAME].str());
+              return v;
+          }
+
+          /**
+           * @brief
+           * Find an optional field.
+           * @param tag two character tag
+           * @param val value of the tag
+           * @param fmt type of the tag, 'Z' if the field has no type
+           * @return true if the tag is present
+           */
+          bool aux_get(const char *tag, rg::StrRef &val, char &fmt) const;
+
+          /**
+           * @brief
+           * Same lookup as Record::get: RG: prefixed tags from the read group, then required columns,
+           * then optional fields.
+           * @return true if tag was found and val updated
+           */
+          bool get(const Header &hdr, const std::string &tag, std::string &val) const;
+
+          /**
+           * @brief
+           * Build a full record.
+           * @throws std::invalid_argument if a numeric column or aux field is malformed
+           */
+          void to_record(Record &r) const;
+      };
+
+      /**
+       * @brief
+       * A fixed list of tags extracted from RecordViews, for exporting columns.
+       * @details
+       * Tags are resolved once against the header, with the same precedence as Record::get:
+       * RG: prefixed tags from the read group, then required columns, then optional fields.
+       * Extracting a record only splits the columns it needs and makes no allocations beyond
+       * the output. A projection is read only after construction and can be shared between threads.
+       */
+      class Projection {
+        public:
+          /**
+           * @param tags tags to extract, in output order
+           * @param hdr header of the records, used to resolve RG: tags
+           */
+          Projection(const std::vector<std::string> &tags, const Header &hdr);
+
+          /**
+           * @return number of tags
+           */
+          size_t size() const {
+              return _cols.size();
+          }
+
+          /**
+           * @brief
+           * Append the tags of a record as a line of quoted, comma separated values.
+           * Missing tags are written as "*".
+           * @param view record
+           * @param out appended to, including the newline
+           * @param missing element i is set to true if tag i is missing, and left as is otherwise.
+           * Resized to size().
+           * @param tsv tab separated values instead
+           */
+          void append_row(const RecordView &view, std::string &out, std::vector<char> &missing,
+                          bool tsv = false) const;
+
+        private:
+          enum Kind : char {REQUIRED, AUX, READ_GROUP, NONE};
+          struct Column {
+              Kind kind;
+              RecordView::Col col;
+              char tag[2];
+              size_t rg; // Index into the values of a read group
+          };
+
+          bool _value(const RecordView &view, const Column &c, rg::StrRef &val) const;
+
+          std::vector<Column> _cols;
+          bool _use_rg = false;
+          // Read group ID, sorted, and the value of each RG: column, empty if absent
+          std::vector<std::pair<std::string, std::vector<std::pair<bool, std::string>>>> _groups;
+      };
+
+      /**
+       * @brief
+       * htslib format of a file, from its extension.
+       * @param file_name file name
+       * @return 'b' for .bam, 'c' for .cram, 0 for SAM text
+       */
+      static char hts_format(const std::string &file_name);
+
     protected:
       bool _use_stdio = false;
       SAM::Header _hdr;
+      std::shared_ptr<rg::HtsPool> _pool;
   };
 
 
@@ -702,6 +1087,10 @@ namespace vargas {
           _pprec = std::move(o._pprec);
           _hdr = std::move(o._hdr);
           _use_stdio = o._use_stdio;
+          _pool = std::move(o._pool);
+          std::swap(_hts, o._hts);
+          std::swap(_hts_hdr, o._hts_hdr);
+          std::swap(_bam, o._bam);
       }
 
       ~isam() {
@@ -717,8 +1106,8 @@ namespace vargas {
 
       /**
        * @brief
-       * Close any open file and open the given file.
-       * @param file_name SAM file to open
+       * Close any open file and open the given file. .bam and .cram files are read with htslib.
+       * @param file_name SAM, BAM or CRAM file to open
        * @throws std::invalid_argument if file cannot be opened
        */
       void open(std::string file_name);
@@ -727,17 +1116,23 @@ namespace vargas {
        * @brief
        * Clear data and close any open handles.
        */
-      void close() {
-          in.close();
-          _hdr = SAM::Header();
-          _pprec = SAM::Record();
-      }
+      void close();
 
       /**
        * @return true if file is open.
        */
       bool good() const {
-          return in.good() || _use_stdio || !_buff.empty();
+          return in.good() || _use_stdio || _hts || !_buff.empty();
+      }
+
+      /**
+       * @brief
+       * Decompress BAM/CRAM input with a shared htslib thread pool. Has no effect on SAM text.
+       * @param pool Pool to attach, nullptr for single threaded decoding.
+       */
+      void set_thread_pool(std::shared_ptr<rg::HtsPool> pool) {
+          _pool = std::move(pool);
+          if (_pool && _hts) _pool->attach(_hts);
       }
 
       /**
@@ -752,19 +1147,27 @@ namespace vargas {
 
       /**
        * @brief
-       * Push a record onto the SAM buffer.
+       * Push a record onto the SAM buffer. Buffered records are read before the file,
+       * last pushed first.
        * @param rec Record
        */
       void push(const SAM::Record &rec) {
           _buff.push_back(rec);
       }
 
+      void push(SAM::Record &&rec) {
+          _buff.push_back(std::move(rec));
+      }
+
       /**
        * @brief
-       * Load the rest of the records in the file and keep a subset of them.
-       * @param n Number of records to keep.
+       * Read the rest of the records in the file and keep a uniform random subset of them,
+       * in file order. Only n records are held while reading.
+       * @param n Number of records to keep, 0 for all.
+       * @param seed RNG seed
+       * @throws std::invalid_argument No records available
        */
-      void subset(size_t n);
+      void subset(size_t n, uint64_t seed = std::random_device()());
 
       /**
        * @brief
@@ -784,13 +1187,73 @@ namespace vargas {
       }
 
     private:
+      void _open_hts(const std::string &file_name);
+
       std::string _curr_line;
       std::ifstream in;
       std::vector<Record> _buff;
 
       SAM::Record _pprec;
+
+      // BAM/CRAM input
+      htsFile *_hts = nullptr;
+      bam_hdr_t *_hts_hdr = nullptr;
+      bam1_t *_bam = nullptr;
   };
 
+  /**
+   * @brief
+   * Reads SAM text in large blocks and splits records in place.
+   * @details
+   * The block buffer is reused between batches and serves as the storage for all records
+   * of a batch: next() fills RecordViews that point into it, no per-record allocation is made.
+   * Views are valid until the following call to next(). Only SAM text is supported, use isam for BAM/CRAM.
+   */
+  class SAMBatchReader {
+    public:
+      /**
+       * @param file_name SAM file, empty for stdin
+       * @param block_size initial buffer size in bytes. Grows to fit the longest line.
+       * @throws std::invalid_argument if the file cannot be opened
+       */
+      explicit SAMBatchReader(const std::string &file_name, size_t block_size = 1 << 22);
+
+      /**
+       * @return header of the file
+       */
+      SAM::Header &header() {
+          return _hdr;
+      }
+
+      /**
+       * @brief
+       * Split the next records of the file.
+       * @param views replaced with up to max_records records. Fewer are returned when the buffer is
+       * exhausted, not only at the end of the file.
+       * @param max_records maximum number of records
+       * @return number of records, 0 at the end of the file
+       * @throws std::invalid_argument if a line has fewer than 11 columns
+       */
+      size_t next(std::vector<SAM::RecordView> &views, size_t max_records);
+
+    private:
+      /**
+       * @brief
+       * Get the next line. If pinned, the buffer is not moved, and false is returned when it
+       * is exhausted before the end of the file.
+       */
+      bool _line(rg::StrRef &line, bool pinned);
+
+      std::ifstream _file;
+      std::istream *_in;
+      std::vector<char> _buf;
+      size_t _beg = 0, _end = 0; // Unread data
+      bool _eof = false;
+      SAM::Header _hdr;
+  };
+
+  class ResultsFormat;
+
   /**
  * @brief
  * Provides an interface to write a SAM file.
@@ -825,6 +1288,19 @@ namespace vargas {
           open(std::move(file_name));
       }
 
+      /**
+       * @brief
+       * Create a SAM, BAM or CRAM file, compressing BAM/CRAM with a shared htslib thread pool.
+       * @param file_name file to write
+       * @param hdr SAM::Header of the file
+       * @param pool htslib threads, nullptr to compress on the writing thread
+       */
+      osam(std::string file_name, const SAM::Header &hdr, std::shared_ptr<rg::HtsPool> pool) {
+          _hdr = hdr;
+          _pool = std::move(pool);
+          open(std::move(file_name));
+      }
+
       ~osam() {
           close();
       }
@@ -834,7 +1310,9 @@ namespace vargas {
        * Open a new file.
        * @details
        * Any added alignments are flushed to the previous file (if any). The header
-       * is written to the new file.
+       * is written to the new file. .bam and .cram files are written with htslib.
+       * CRAM output does not reference a FASTA, sequences are stored in full.
+       * .vres files are written in the columnar results format, see ResultsFormat.
        * @param file_name file to open
        * @throws std::invalid_argument if file cannot be opened
        */
@@ -844,30 +1322,40 @@ namespace vargas {
        * @brief
        * Flush any data, and close the output file.
        */
-      void close() {
-          if (out.is_open()) {
-              out.close();
-          }
-      }
+      void close();
 
       /**
        * @return true of output open.
        */
       bool good() const {
-          return out.good() || _use_stdio;
+          return out.good() || _use_stdio || _hts;
       }
 
       /**
        * @brief
-       * Writes a record.
+       * Writes a record. Output is buffered until close().
        * @param r record to add
        * @throws std::invalid_argument if no output file open
+       * @throws std::runtime_error on a BAM/CRAM write error
        */
-      void add_record(const SAM::Record &r) {
-          if (!good()) throw std::invalid_argument("No valid file open.");
-          (_use_stdio ? std::cout : out) << r.to_string() << '\n' << std::flush;
+      void add_record(const SAM::Record &r);
+
+      /**
+       * @return encoder of a results file, nullptr for SAM/BAM/CRAM output
+       */
+      const ResultsFormat *results() const {
+          return _results.get();
       }
 
+      /**
+       * @brief
+       * Write preformatted, newline terminated records, or results blocks for a results file.
+       * @param buf records
+       * @throws std::invalid_argument if no output file open
+       * @throws std::runtime_error if a record cannot be encoded as BAM/CRAM
+       */
+      void write(const std::string &buf);
+
       /**
        * @param rec write record to output
        * @return SAM::osam
@@ -878,7 +1366,16 @@ namespace vargas {
       }
 
     private:
+      void _open_hts(const std::string &file_name, char fmt);
+
       std::ofstream out;
+
+      // BAM/CRAM output
+      htsFile *_hts = nullptr;
+      bam_hdr_t *_hts_hdr = nullptr;
+      bam1_t *_bam = nullptr;
+      std::shared_ptr<ResultsFormat> _results;
+      std::string _line; // Scratch for write() and add_record()
   };
 
 }
@@ -0,0 +1,247 @@
+#pragma once
+#include "threadpool.h"
+#include "perf_counters.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rg {
+/**
+ * @brief
+ * Runs tasks on a ForPool, most expensive first.
+ * @details
+ * Each task has a group (e.g. its subgraph) and an estimated amount of work in units (e.g.
+ * read bases times graph length). The seconds per unit of a group are measured as its tasks
+ * finish, and kept across runs, so groups that are slower than their size suggests move
+ * forward. Tasks are handed out in one of three orders:
+ * - INDEX: in index order.
+ * - COST: the remaining task with the largest estimated time, so long tasks start early and
+ *   short ones fill the tail.
+ * - AFFINITY: a thread keeps taking tasks of one group, largest first, until the group runs
+ *   out. It then joins the group with the most estimated time left per thread working on it.
+ *   Threads touch fewer graphs, which keeps more of each in cache.
+ *
+ * ForPool steals work between threads either way. The time each thread spent in tasks,
+ * the number of times a thread changed group, and the cache misses of the tasks (where
+ * perf counters are available) are recorded for the timing report.
+ */
+class TaskScheduler {
+  public:
+    enum class Order {INDEX, COST, AFFINITY};
+
+    /**
+     * @brief
+     * Time spent by each thread.
+     */
+    struct Stats {
+        std::vector<double> busy; /**< Seconds each thread spent in tasks */
+        double wall = 0; /**< Seconds spent in run() */
+        size_t tasks = 0;
+        size_t switches = 0; /**< Tasks that ran on a thread whose previous task had another group */
+        bool counted = false; /**< Cache counters were available on every thread */
+        CacheCounter::Counts cache; /**< Summed over tasks */
+    };
+
+    /**
+     * @param threads Number of threads of the ForPool tasks are run on
+     */
+    explicit TaskScheduler(size_t threads) {
+        if (threads == 0) threads = 1;
+        _stats.busy.resize(threads, 0);
+        _counters.resize(threads);
+        _last_group.resize(threads, NO_GROUP);
+        _thread_queue.resize(threads, NO_GROUP);
+    }
+
+    TaskScheduler(const TaskScheduler &) = delete;
+
+    /**
+     * @brief
+     * Call func(data, i, thread) once for each task i, and return when all are done.
+     * @param fp pool to run on
+     * @param groups group of each task, tasks of a group share a measured cost per unit
+     * @param units estimated work of each task
+     * @param order order tasks are handed out in. INDEX is needed to write them through a ReorderBuffer.
+     * @param func task body
+     * @param data passed to func
+     */
+    void run(ForPool &fp, const std::vector<std::string> &groups, const std::vector<double> &units, Order order,
+             void (*func)(void *, long, int), void *data) {
+        const auto start = std::chrono::steady_clock::now();
+        _func = func;
+        _data = data;
+        _order = order;
+        _next = 0;
+        _queues.clear();
+        _queue_group.clear();
+        _queue_units.clear();
+        _queue_threads.clear();
+        std::fill(_thread_queue.begin(), _thread_queue.end(), NO_GROUP);
+        _task_group.resize(groups.size());
+        _task_units.assign(units.begin(), units.begin() + groups.size());
+        std::unordered_map<size_t, size_t> queue_of; // Group id to queue
+        for (size_t i = 0; i < groups.size(); ++i) {
+            auto g = _group_ids.emplace(groups[i], _rates.size());
+            if (g.second) _rates.emplace_back(0, 0);
+            _task_group[i] = g.first->second;
+            auto q = queue_of.emplace(g.first->second, _queues.size());
+            if (q.second) {
+                _queues.emplace_back();
+                _queue_group.push_back(g.first->second);
+                _queue_units.push_back(0);
+                _queue_threads.push_back(0);
+            }
+            _queues[q.first->second].emplace_back(units[i], i);
+            _queue_units[q.first->second] += units[i];
+        }
+        // Largest at the back. Equal tasks keep index order.
+        for (auto &q : _queues) {
+            std::sort(q.begin(), q.end(), [](const std::pair<double, size_t> &a, const std::pair<double, size_t> &b) {
+                return a.first < b.first || (a.first == b.first && a.second > b.second);
+            });
+        }
+        fp.forpool(&TaskScheduler::_body, this, groups.size());
+        _stats.wall += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        _stats.tasks += groups.size();
+    }
+
+    /**
+     * @param group task group
+     * @return Measured seconds per unit of group, or of all groups if none of its tasks finished yet.
+     * 0 before any task finished.
+     */
+    double rate(const std::string &group) const {
+        std::lock_guard<std::mutex> lock(_mut);
+        const auto g = _group_ids.find(group);
+        if (g == _group_ids.end() || _rates[g->second].second == 0) return _mean_rate();
+        return _rates[g->second].first / _rates[g->second].second;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(_mut);
+        Stats ret = _stats;
+        ret.counted = _stats.tasks > 0;
+        for (const auto &c : _counters) {
+            if (c && !c->ok()) ret.counted = false;
+        }
+        return ret;
+    }
+
+  private:
+    enum : size_t {NO_GROUP = size_t(-1)};
+
+    static void _body(void *data, long, int tid) {
+        TaskScheduler &s = *static_cast<TaskScheduler *>(data);
+        const size_t i = s._pop(tid);
+        auto &counter = s._counters.at(tid); // Only used by this thread
+        if (!counter) counter.reset(new CacheCounter);
+        const auto before = counter->read();
+        const auto start = std::chrono::steady_clock::now();
+        s._func(s._data, i, tid);
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto cache = counter->read() - before;
+
+        std::lock_guard<std::mutex> lock(s._mut);
+        s._stats.busy.at(tid) += secs;
+        s._stats.cache += cache;
+        auto &r = s._rates[s._task_group[i]];
+        r.first += secs;
+        r.second += s._task_units[i];
+    }
+
+    size_t _pop(int tid) {
+        std::lock_guard<std::mutex> lock(_mut);
+        size_t i;
+        if (_order == Order::INDEX) i = _next++;
+        else {
+            const size_t q = _order == Order::AFFINITY ? _affine_queue(tid) : _largest_queue();
+            i = _queues[q].back().second;
+            _queue_units[q] -= _queues[q].back().first;
+            _queues[q].pop_back();
+        }
+        if (_last_group[tid] != NO_GROUP && _last_group[tid] != _task_group[i]) ++_stats.switches;
+        _last_group[tid] = _task_group[i];
+        return i;
+    }
+
+    /**
+     * Queue holding the task with the largest estimated time.
+     */
+    size_t _largest_queue() const {
+        size_t best = 0;
+        double best_cost = -1;
+        for (size_t q = 0; q < _queues.size(); ++q) {
+            if (_queues[q].empty()) continue;
+            const double cost = _queues[q].back().first * _rate(_queue_group[q]);
+            if (cost > best_cost) {
+                best_cost = cost;
+                best = q;
+            }
+        }
+        return best;
+    }
+
+    /**
+     * The queue of thread tid, or the one with the most estimated time left per thread.
+     */
+    size_t _affine_queue(int tid) {
+        size_t &cur = _thread_queue[tid];
+        if (cur != NO_GROUP && !_queues[cur].empty()) return cur;
+        if (cur != NO_GROUP) --_queue_threads[cur];
+        size_t best = 0;
+        double best_cost = -1;
+        for (size_t q = 0; q < _queues.size(); ++q) {
+            if (_queues[q].empty()) continue;
+            const double cost = _queue_units[q] * _rate(_queue_group[q]) / (1 + _queue_threads[q]);
+            if (cost > best_cost) {
+                best_cost = cost;
+                best = q;
+            }
+        }
+        cur = best;
+        ++_queue_threads[best];
+        return best;
+    }
+
+    double _mean_rate() const {
+        double secs = 0, units = 0;
+        for (const auto &r : _rates) {
+            secs += r.first;
+            units += r.second;
+        }
+        return units > 0 ? secs / units : 0;
+    }
+
+    double _rate(size_t group) const {
+        const auto &r = _rates[group];
+        if (r.second > 0) return r.first / r.second;
+        const double mean = _mean_rate();
+        return mean > 0 ? mean : 1;
+    }
+
+    void (*_func)(void *, long, int) = nullptr;
+    void *_data = nullptr;
+    Order _order = Order::COST;
+    size_t _next = 0;
+
+    mutable std::mutex _mut;
+    std::unordered_map<std::string, size_t> _group_ids;
+    std::vector<std::pair<double, double>> _rates; // Seconds and units finished per group, kept across runs
+    std::vector<std::vector<std::pair<double, size_t>>> _queues; // Units and index of remaining tasks
+    std::vector<size_t> _queue_group;
+    std::vector<double> _queue_units; // Units left in each queue
+    std::vector<size_t> _queue_threads; // Threads taking tasks from each queue
+    std::vector<size_t> _thread_queue; // Queue each thread takes tasks from
+    std::vector<size_t> _last_group; // Group of the previous task of each thread, kept across runs
+    std::vector<size_t> _task_group;
+    std::vector<double> _task_units;
+    std::vector<std::unique_ptr<CacheCounter>> _counters; // Per thread, opened by that thread
+    Stats _stats;
+};
+}
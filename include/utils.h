@@ -43,6 +43,7 @@
 #endif
 
 #include <array>
+#include <cstring>
 #include <vector>
 #include <fstream>
 #include <algorithm>
@@ -306,6 +307,68 @@ print(", ".join(map(str, map(ord, lut))))
   }
 
 
+  /**
+   * @brief
+   * Uniform sample of n items from a stream of unknown length, in one pass (Algorithm R).
+   * @details
+   * Only n items are held. Kept items are returned in the order they were added.
+   * @tparam T item type
+   */
+  template<typename T>
+  class Reservoir {
+    public:
+      /**
+       * @param n Number of items to keep
+       * @param seed RNG seed, the same seed and input give the same sample
+       */
+      Reservoir(size_t n, uint64_t seed) : _n(n), _rng(seed) {
+          _items.reserve(n);
+      }
+
+      /**
+       * @brief
+       * Offer the next item. It is moved from only if it is kept.
+       * @return true if the item was kept
+       */
+      bool add(T &&item) {
+          const size_t i = _seen++;
+          if (i < _n) {
+              _items.emplace_back(i, std::move(item));
+              return true;
+          }
+          const size_t j = std::uniform_int_distribution<size_t>(0, i)(_rng);
+          if (j >= _n) return false;
+          _items[j] = std::make_pair(i, std::move(item));
+          return true;
+      }
+
+      /**
+       * @return Number of items offered so far.
+       */
+      size_t seen() const {
+          return _seen;
+      }
+
+      /**
+       * @brief
+       * Take the sample, in input order. The reservoir is left empty.
+       */
+      std::vector<T> take() {
+          std::sort(_items.begin(), _items.end(),
+                    [](const std::pair<size_t, T> &a, const std::pair<size_t, T> &b) { return a.first < b.first; });
+          std::vector<T> ret;
+          ret.reserve(_items.size());
+          for (auto &i : _items) ret.push_back(std::move(i.second));
+          _items.clear();
+          return ret;
+      }
+
+    private:
+      size_t _n, _seen = 0;
+      std::mt19937_64 _rng;
+      std::vector<std::pair<size_t, T>> _items; // <input index, item>
+  };
+
   /**
    * @brief
    * Date in format:
@@ -352,6 +415,94 @@ print(", ".join(map(str, map(ord, lut))))
   }
 
 
+  /**
+   * @brief
+   * Non-owning view of a character range, valid while the underlying buffer is.
+   */
+  struct StrRef {
+      StrRef() = default;
+      StrRef(const char *p, size_t n) : ptr(p), len(n) {}
+      StrRef(const char *b, const char *e) : ptr(b), len(e - b) {}
+      explicit StrRef(const std::string &s) : ptr(s.data()), len(s.length()) {}
+
+      const char *begin() const { return ptr; }
+      const char *end() const { return ptr + len; }
+      size_t size() const { return len; }
+      bool empty() const { return len == 0; }
+      char operator[](size_t i) const { return ptr[i]; }
+
+      bool operator==(const StrRef &o) const {
+          return len == o.len && std::equal(ptr, ptr + len, o.ptr);
+      }
+      bool operator==(const char *s) const {
+          return operator==(StrRef(s, std::strlen(s)));
+      }
+      bool operator!=(const StrRef &o) const { return !operator==(o); }
+      bool operator!=(const char *s) const { return !operator==(s); }
+
+      std::string str() const { return std::string(ptr, len); }
+
+      const char *ptr = nullptr;
+      size_t len = 0;
+  };
+
+  /**
+   * @brief
+   * Parse a whole range as a decimal integer, without allocating.
+   * @param s digits with an optional leading sign
+   * @param ret parsed value
+   * @return false if s is empty or has a non-digit character
+   */
+  template<typename T>
+  __RG_STRONG_INLINE__
+  bool parse_int(StrRef s, T &ret) {
+      const char *p = s.begin(), *e = s.end();
+      const bool neg = p != e && *p == '-';
+      if (p != e && (*p == '-' || *p == '+')) ++p;
+      if (p == e) return false;
+      T v = 0;
+      for (; p != e; ++p) {
+          const unsigned d = unsigned(*p) - '0';
+          if (d > 9) return false;
+          v = v * 10 + T(d);
+      }
+      ret = neg ? T(0) - v : v;
+      return true;
+  }
+
+  /**
+   * @brief
+   * Append the decimal form of an integer, two digits at a time and without a temporary string.
+   * @param out string to append to
+   * @param val integer
+   */
+  template<typename T>
+  __RG_STRONG_INLINE__
+  typename std::enable_if<std::is_integral<T>::value>::type
+  append_int(std::string &out, T val) {
+      static const char pairs[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+      "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+      typedef typename std::make_unsigned<T>::type U;
+      const bool neg = val < 0;
+      U v = neg ? U(0) - U(val) : U(val);
+      char buf[24];
+      char *p = buf + sizeof(buf);
+      while (v >= 100) {
+          const unsigned d = unsigned(v % 100) * 2;
+          v /= 100;
+          *--p = pairs[d + 1];
+          *--p = pairs[d];
+      }
+      if (v >= 10) {
+          *--p = pairs[v * 2 + 1];
+          *--p = pairs[v * 2];
+      } else *--p = char('0' + v);
+      if (neg) *--p = '-';
+      out.append(p, buf + sizeof(buf) - p);
+  }
+
   /**
    * @brief
    * Wrapper around std::to_string that allows transparent usage with to_string(std::string)
@@ -8,7 +8,9 @@
  * Both file types are handled transparently by htslib. The records
  * are parsed to substitute in copy number variations, and skip
  * records outside of a defined range. A subset of individuals can be
- * defined using create_ingroup.
+ * defined using create_ingroup. If the file has a CSI (BCF) or tabix (bgzipped VCF)
+ * index, region restricted reads seek directly to the region. kSNP (HISAT SNP) files
+ * are read natively with the reference alleles taken from the FASTA.
  *
  * @copyright
  * Distributed under the MIT Software License.
@@ -22,8 +24,11 @@
 
 #include "dyn_bitset.h"
 #include "utils.h"
+#include "htspool.h"
+#include "fasta.h"
 #include "htslib/vcfutils.h"
 #include "htslib/hts.h"
+#include "htslib/tbx.h"
 
 #include <string>
 #include <cstdio>
@@ -36,6 +41,8 @@
 #include <set>
 #include <unordered_map>
 #include <map>
+#include <memory>
+#include <fstream>
 
 namespace vargas {
 
@@ -71,6 +78,247 @@ namespace vargas {
       max; /**< Max position, inclusive. */
   };
 
+  /**
+   * @brief
+   * Common interface to sources of variant records, e.g. a VCF/BCF file or a variant cache.
+   * @details
+   * Records are streamed with next(), subject to a region, a record limit and an ingroup
+   * of samples. Populations have one bit per ingroup haplotype.
+   */
+  class VarFile {
+    public:
+
+      typedef dyn_bitset<64> Population;
+
+      virtual ~VarFile() = default;
+
+      /**
+       * @brief
+       * Check if the file is properly loaded.
+       * @return true if file is open and has a valid header.
+       */
+      virtual bool good() const = 0;
+
+      /**
+       * @brief
+       * Load the next record, subject to region and sample set restrictions.
+       * @return false on read error or if outside restriction range.
+       */
+      virtual bool next() = 0;
+
+      /**
+       * @brief
+       * Get a list of sequences in the file.
+       * @return vector of sequence names
+       */
+      virtual std::vector<std::string> seq_names() const = 0;
+
+      /**
+       * @brief
+       * counts each haplotype as distinct. num_haplotypes() = ingroup().size() * 2
+       * @return Number of haplotypes in the ingroup.
+       */
+      virtual size_t num_haplotypes() const = 0;
+
+      /**
+       * @brief
+       * Get the allele frequencies of the ref and alt alleles.
+       * @details
+       * If INFO/AF has a value for every alt and the ingroup is all samples, INFO/AF is used and
+       * the ref freq is computed with 1-sum(alt_frequencies). Otherwise the frequencies are the
+       * fraction of called ingroup haplotypes in each allele's population.
+       * The vector belongs to the reader and is valid until the next record.
+       * @return const ref to vector of frequencies
+       */
+      const std::vector<float> &frequencies() const {
+          return _allele_freqs;
+      }
+
+      /**
+       * @return INFO/AF values of the current record, one per alt allele if present.
+       */
+      const std::vector<float> &info_af() const {
+          return _info_af;
+      }
+
+      /**
+       * @brief
+       * Decompress the file with a shared htslib thread pool. No-op for sources that are not htslib backed.
+       * @param pool Pool to attach, nullptr for single threaded decoding.
+       */
+      virtual void set_thread_pool(std::shared_ptr<rg::HtsPool>) {}
+
+      virtual void set_region(const Region &region) { _region = region; }
+      const Region &region() const { return _region; }
+
+      /**
+       * @brief
+       * Get a vector of sample names.
+       * @return vector of samples
+       */
+      const std::vector<std::string> &samples() const {
+          return _samples;
+      }
+
+      /**
+       * @brief
+       * Create a random subset of the samples.
+       * @param percent of samples to keep.
+       */
+      void create_ingroup(int percent);
+
+      /**
+       * @brief
+       * Include only the provided sample names in the Graph.
+       * @param samples vector of sample names
+       */
+      void create_ingroup(const std::vector<std::string> &samples) {
+          _ingroup = samples;
+          _apply_ingroup_filter();
+      }
+
+      /**
+       * @return Samples in the ingroup.
+       */
+      const std::vector<std::string> &ingroup() const {
+          return _ingroup;
+      }
+
+      /**
+       * Limit the number of variants to first num records.
+       * @param num
+       */
+      void limit_num_variants(size_t num) {
+          _limit = num;
+      }
+
+      /**
+       * @brief
+       * Assume that all variants for a given contig will appear consecutively in the file.
+       */
+      void assume_contig_chr() {
+          _assume_contig = true;
+      }
+
+      /**
+       * @return Number of records decoded from the file, including those outside of the region.
+       */
+      size_t num_decoded() const {
+          return _num_decoded;
+      }
+
+      /**
+       * @brief
+       * File name of the variant source.
+       * @return file name
+       */
+      std::string file() const {
+          return _file_name;
+      }
+
+      /**
+       * @brief
+       * Reference allele of the current record.
+       * @return reference allele
+       */
+      std::string ref() const {
+          return _alleles[0];
+      }
+
+      /**
+       * @brief
+       * List of all the alleles in the current record.
+       * @details
+       * The first is the reference. Allele copy number variant tags are converted,
+       * whereas other tags are substituted for the reference.
+       * @return vector of alleles
+       */
+      const std::vector<std::string> &alleles() const {
+          return _alleles;
+      }
+
+      /**
+       * @brief
+       * 0 based position, i.e. the VCF pos - 1.
+       * @return position.
+       */
+      pos_t pos() const {
+          return _pos;
+      }
+
+      /**
+       * @brief
+       * Return the population set that has the allele.
+       * @details
+       * The returned vector has the same size as number of genotypes (samples * 2).
+       * When true, that individual/phase has that allele.
+       * @param allele allele to get the population of
+       * @return Population of individuals that have the allele
+       */
+      const Population allele_pop(const std::string allele) const {
+          auto a = std::find(_alleles.begin(), _alleles.end(), allele);
+          if (a == _alleles.end()) return Population(0);
+          return _allele_pops[a - _alleles.begin()];
+      }
+
+      /**
+       * @brief
+       * Return the population set that has the allele at index idx of alleles().
+       * Alleles with identical sequences share a population.
+       * @param idx allele index, 0 is the reference
+       * @return Population of individuals that have the allele
+       */
+      const Population &allele_pop(unsigned idx) const {
+          return _allele_pops.at(idx);
+      }
+
+      /**
+       * @brief
+       * Check if an allele has the same sequence as an allele with a lower index,
+       * e.g. a substituted tag that became the reference.
+       * @param idx allele index
+       * @return true if the allele is a repeat of an earlier allele.
+       */
+      bool is_duplicate(unsigned idx) const {
+          return _allele_canon.at(idx) != idx;
+      }
+
+    protected:
+
+      /**
+       * @brief
+       * Applies the contents of _ingroup. The filter impacts all following records.
+       */
+      virtual void _apply_ingroup_filter() = 0;
+
+      /**
+       * @brief
+       * Point each allele of _alleles to the first allele with the same sequence.
+       */
+      void _find_duplicates();
+
+      /**
+       * @brief
+       * Fill _allele_freqs for the current record from _info_af or the allele populations.
+       */
+      void _compute_frequencies();
+
+      std::string _file_name;
+      Region _region;
+      pos_t _pos = 0;
+
+      std::vector<std::string> _alleles;
+      std::vector<unsigned> _allele_canon; // Index of the first allele with the same sequence
+      std::vector<Population> _allele_pops; // Indexed by allele
+      std::vector<float> _info_af, _allele_freqs;
+      std::vector<size_t> _allele_counts;
+      std::vector<std::string> _samples;
+      std::vector<std::string> _ingroup; // subset of _samples
+
+      size_t _limit = 0, _counter = 0, _num_decoded = 0;
+      bool _assume_contig = false, _entered_contig = false;
+  };
+
 /**
  * @brief
  * Provides an interface to a VCF/BCF file. Core processing
@@ -108,17 +356,16 @@ namespace vargas {
  *
  * @endcode
  */
-  class VCF {
+  class VCF : public VarFile {
     public:
 
-      typedef dyn_bitset<64> Population;
-
       VCF() {}
 
       /**
        * @param file VCF/BCF File name
        */
-      VCF(std::string file) : _file_name(file) {
+      VCF(std::string file) {
+          _file_name = file;
           _init();
       }
 
@@ -128,11 +375,13 @@ namespace vargas {
        * @param min Min position, 0 indexed
        * @param max Max position, 0 indexed, inclusive
        */
-      VCF(std::string file, std::string chr, pos_t min, pos_t max) : _file_name(file), _region(chr, min, max) {
+      VCF(std::string file, std::string chr, pos_t min, pos_t max) {
+          _file_name = file;
+          _region = Region(chr, min, max);
           _init();
       }
 
-      ~VCF() {
+      ~VCF() override {
           close();
       }
 
@@ -257,8 +506,23 @@ namespace vargas {
 
       void close();
 
-      bool good() {
-          return _header && _bcf;
+      /**
+       * @brief
+       * Decompress the file with a shared htslib thread pool.
+       * @param pool Pool to attach, nullptr for single threaded decoding.
+       */
+      void set_thread_pool(std::shared_ptr<rg::HtsPool> pool) override {
+          _pool = std::move(pool);
+          if (_pool && _bcf) _pool->attach(_bcf);
+      }
+
+      /**
+       * @brief
+       * Region queries use an index rather than a linear scan.
+       * @return true if a CSI or tabix index was loaded with the file.
+       */
+      bool indexed() const {
+          return _idx || _tbx;
       }
 
       /**
@@ -276,7 +540,7 @@ namespace vargas {
        * Get a list of sequences in the VCF file.
        * @return vector of sequence names
        */
-      std::vector<std::string> seq_names() const;
+      std::vector<std::string> seq_names() const override;
 
       /**
        * @brief
@@ -284,16 +548,7 @@ namespace vargas {
        * @return Number of samples the VCF has. Each sample represents two genotypes.
        */
        //TODO assumes diploid
-      size_t num_haplotypes() const;
-
-      /**
-       * @brief
-       * Get a vector of sample names.
-       * @return vector of samples
-       */
-      const std::vector<std::string> &samples() const {
-          return _samples;
-      }
+      size_t num_haplotypes() const override;
 
       /**
        * @brief
@@ -301,7 +556,7 @@ namespace vargas {
        * subject to sample set restrictions.
        * @return false on read error or if outside restriction range.
        */
-      bool next();
+      bool next() override;
 
       /**
        * @brief
@@ -313,55 +568,25 @@ namespace vargas {
           _load_shared();
       }
 
-      /**
-       * @brief
-       * Reference allele of the current record.
-       * @return reference allele
-       */
-      std::string ref() const {
-          return _alleles[0];
-      }
-
-      /**
-       * @brief
-       * List of all the alleles in the current record.
-       * @details
-       * The first is the reference. Allele copy number variant tags are converted,
-       * whereas other tags are substituted for the reference.
-       * @return vector of alleles
-       */
-      const std::vector<std::string> &alleles() const {
-          return _alleles;
-      }
-
-      /**
-       * @brief
-       * 0 based position, i.e. the VCF pos - 1.
-       * @return position.
-       */
-      pos_t pos() const {
-          return _curr_rec->pos;
-      }
-
       /**
        * @brief
        * Get a list of alleles for all samples (subject to sample set restriction).
        * @details
        * Consecutive alleles represent phasing, e.g. all odd indexes are one phase,
-       * all even indexes are the other. Call will unpack the full record.
+       * all even indexes are the other.
        * Explicit copy number variations are replaced, other ambiguous types are replaced.
-       * A map is also built, mapping each allele to the subpopulation that has it.
+       * Missing genotypes are ".". The strings are only built when requested, allele
+       * populations are decoded directly from the GT values by next().
        * @return Vector of alleles, ordered by sample.
        */
       const std::vector<std::string> &gen_genotypes();
 
       /**
-       * @brief
-       * Get the allele frequencies of the ref and alt alleles.
-       * The ref freq is computed with 1-sum(alt_frequencies).
-       * @return const ref to vector of frequencies
+       * @return Index of the current record's contig in seq_names().
        */
-      const std::vector<float> &frequencies() const;
+      int contig_id() const {
+          return _curr_rec->rid;
+      }
 
       /**
        * @brief
@@ -389,125 +614,302 @@ namespace vargas {
 
       /**
        * @brief
-       * Return the population set that has the allele.
-       * @details
-       * The returned vector has the same size as number of genotypes (samples * 2).
-       * When true, that individual/phase has that allele.
-       * @param allele allele to get the population of
-       * @return Population of individuals that have the allele
+       * Check if the file is properly loaded.
+       * @return true if file is open and has a valid header.
        */
-      const Population allele_pop(const std::string allele) const {
-          if (_genotype_indivs.count(allele)) return _genotype_indivs.at(allele);
-          else return Population(0);
+      bool good() const override {
+          return _header && _bcf;
       }
 
+      void set_region(const Region &region) override;
+
+    protected:
+
       /**
        * @brief
-       * Check if the file is properly loaded.
-       * @return true if file is open and has a valid header.
+       * Open the provided file and load the header.
+       * @return -1 on file open error, -2 on header read error.
        */
-      bool good() const {
-          return _header && _bcf;
-      }
+      int _init();
 
       /**
        * @brief
-       * File name of VCF/BCF file.
-       * @return file name
+       * Loads the list of alleles for the current record.
        */
-      std::string file() const {
-          return _file_name;
-      }
+      void _load_shared();
 
+      /**
+       * @brief
+       * Decode GT values of the current record into per-allele populations.
+       */
+      void _decode_genotypes();
 
       /**
        * @brief
-       * Create a random subset of the samples.
-       * @param percent of samples to keep.
+       * Applies the contents of _ingroup to the header. The filter
+       * impacts all following unpacks.
        */
-      void create_ingroup(int percent);
+      void _apply_ingroup_filter() override;
 
       /**
        * @brief
-       * Include only the provided sample names in the Graph.
-       * @param samples vector of sample names
+       * Load the CSI (BCF) or tabix (bgzipped VCF) index if one exists next to the file.
        */
-      void create_ingroup(const std::vector<std::string> &samples) {
-          _ingroup = samples;
-          _apply_ingroup_filter();
-      }
+      void _load_index();
 
       /**
-       * @return string passed to htslib for ingroup filtering.
+       * @brief
+       * Create an index iterator over the current region. If there is no index, or the
+       * region has no contig, reads fall back to a linear scan.
        */
-      const std::vector<std::string> &ingroup() const {
-          return _ingroup;
-      }
+      void _seek_region();
 
-      void set_region(const Region &region);
-      const Region &region() const { return _region; }
+      /**
+       * @brief
+       * Read the next record, either through the region iterator or sequentially.
+       * @return 0 on success, negative on EOF or error.
+       */
+      int _read_record();
+
+
+    private:
+      htsFile *_bcf = nullptr;
+      bcf_hdr_t *_header = nullptr;
+      bcf1_t *_curr_rec = bcf_init();
+
+      hts_idx_t *_idx = nullptr; // BCF CSI index
+      tbx_t *_tbx = nullptr; // bgzipped VCF tabix index
+      hts_itr_t *_itr = nullptr; // Iterator over _region
+      kstring_t _line = {0, 0, nullptr}; // Text line buffer for tabix reads
+      bool _seeked = false, _region_absent = false;
+
+      int32_t *_gt = nullptr; // GT values of the current record, restricted to _ingroup
+      int _gt_cap = 0, _gt_n = 0;
+      float *_af = nullptr; // INFO/AF values of the current record
+      int _af_cap = 0;
+      std::vector<uint64_t> _gt_words; // Per allele bits of the block being decoded
+      std::vector<std::string> _genotypes; // Built on request from _gt
+      bool _genotypes_valid = false;
+      char *_ingroup_cstr = nullptr;
+
+      std::shared_ptr<rg::HtsPool> _pool;
+
+  };
+
+  /**
+   * @brief
+   * Pre-decoded variant cache (.vvc) written from a VCF/BCF file.
+   * @details
+   * Stores the position, alleles, INFO/AF and per-allele population bitsets of every record
+   * for all samples, so graphs with different regions, limits and sample filters can be
+   * built without inflating and parsing the VCF again. Sample filters are applied by
+   * compacting the stored population words under a haplotype mask. \n
+   * File layout (little endian):
+   * @code{.txt}
+   * "VVC1"
+   * <u32 num samples> [<u32 len> <name>]...
+   * <u32 num contigs> [<u32 len> <name>]...
+   * [<u32 contig id> <u32 pos> <u32 payload len> <payload>]...
+   * [<u64 first record offset> <u8 contiguous>]... one per contig
+   * <u64 contig table offset>
+   *
+   * payload: <u16 num alleles> <u16 num AF> [<u32 len> <allele>]... [<f32 AF>]...
+   *          [<u64 population word>]... for each allele that is not a duplicate
+   * @endcode
+   */
+  class VarCache : public VarFile {
+    public:
+
+      VarCache() = default;
 
       /**
-       * Limit the number of variants to first num records.
-       * @param num
+       * @param file Variant cache file name
        */
-      void limit_num_variants(size_t num) {
-          _limit = num;
+      explicit VarCache(std::string file) {
+          open(file);
       }
 
       /**
        * @brief
-       * Assume that all variants for a given contig will appear consecutively in the file.
+       * Open a cache and load the sample and contig tables.
+       * @param file filename
+       * @throws std::invalid_argument if the file is not a variant cache.
        */
-      void assume_contig_chr() {
-          _assume_contig = true;
+      void open(std::string file);
+
+      /**
+       * @brief
+       * Check the magic number of a file.
+       * @param file filename
+       * @return true if the file is a variant cache.
+       */
+      static bool is_cache(const std::string &file);
+
+      /**
+       * @brief
+       * Write all records of a VCF to a cache. The VCF should be freshly opened, all samples are stored.
+       * @param vcf Variant file to read
+       * @param file Output cache filename
+       * @return Number of records written
+       */
+      static size_t create(VCF &vcf, const std::string &file);
+
+      bool good() const override {
+          return _in.good() && _table_offset > 0;
+      }
+
+      bool next() override;
+
+      std::vector<std::string> seq_names() const override {
+          return _contigs;
+      }
+
+      size_t num_haplotypes() const override {
+          return _num_kept;
+      }
+
+      void set_region(const Region &region) override {
+          _region = region;
+          _seeked = false;
       }
 
     protected:
 
+      void _apply_ingroup_filter() override;
+
       /**
        * @brief
-       * Open the provided file and load the header.
-       * @return -1 on file open error, -2 on header read error.
+       * Position the stream at the first record of the region's contig.
        */
-      int _init();
+      void _seek_region();
 
       /**
        * @brief
-       * Loads the list of alleles for the current record.
+       * Compact stored population words to the ingroup haplotypes.
+       * @param words population words for all haplotypes
+       * @param pop Population to fill
        */
-      void _load_shared();
+      void _load_pop(const uint64_t *words, Population &pop) const;
+
+    private:
+      std::ifstream _in;
+      std::vector<std::string> _contigs;
+      std::vector<uint64_t> _contig_offsets; // First record of each contig
+      std::vector<unsigned char> _contig_contiguous;
+      uint64_t _data_offset = 0, _table_offset = 0, _offset = 0; // First record, contig table, next record
+      int _region_contig = -1;
+      size_t _num_words = 0; // Population words per allele
+      std::vector<uint64_t> _mask; // Ingroup haplotypes
+      size_t _num_kept = 0;
+      std::vector<char> _payload;
+      std::vector<uint64_t> _words;
+      bool _seeked = false;
+  };
+
+  /**
+   * @brief
+   * Streaming reader for kSNP (HISAT SNP) files.
+   * @details
+   * Each line is tab delimited: <ID> <type> <chr> <pos> <alt>, with 0 based positions.
+   * Type is one of single (alt is the base), deletion (alt is the deleted length) or
+   * insertion (alt is the inserted sequence). Reference alleles are taken from the FASTA,
+   * indels are anchored to the preceding base as in VCF. Consecutive lines whose replaced
+   * reference ranges overlap, including after anchoring, are merged into one record, so the
+   * file should be sorted by chr and position (sort -k3,3 -k4,4n). There are no samples: every allele is given a single haplotype
+   * population, and alt frequencies are 0.
+   */
+  class KSNP : public VarFile {
+    public:
+
+      KSNP() = default;
+
+      /**
+       * @param file kSNP file name
+       * @param reference FASTA of the reference the positions refer to
+       */
+      KSNP(std::string file, std::string reference) {
+          open(file, reference);
+      }
 
       /**
        * @brief
-       * Applies the contents of _ingroup to the header. The filter
-       * impacts all following unpacks.
+       * Open a kSNP file.
+       * @param file kSNP file name
+       * @param reference FASTA of the reference the positions refer to
+       * @throws std::invalid_argument if either file cannot be opened.
        */
-      void _apply_ingroup_filter();
+      void open(std::string file, std::string reference);
 
+      /**
+       * @brief
+       * Check the file extension.
+       * @param file filename
+       * @return true if the file name ends in .snp or .ksnp
+       */
+      static bool is_ksnp(const std::string &file);
 
-    private:
-      std::string _file_name; // VCF/BCF file name
-      Region _region;
+      bool good() const override {
+          return _in.is_open() && _ref.good();
+      }
 
-      htsFile *_bcf = nullptr;
-      bcf_hdr_t *_header = nullptr;
-      bcf1_t *_curr_rec = bcf_init();
+      bool next() override;
 
-      std::vector<std::string> _genotypes; // restricted to _ingroup
-      std::unordered_map<std::string, Population> _genotype_indivs;
-      std::vector<std::string> _alleles;
-      std::vector<std::string> _samples;
-      std::vector<std::string> _ingroup; // subset of _samples
-      char *_ingroup_cstr = nullptr;
+      std::vector<std::string> seq_names() const override {
+          return _ref.sequence_names();
+      }
+
+      size_t num_haplotypes() const override {
+          return 0;
+      }
+
+      void set_region(const Region &region) override {
+          _region = region;
+          _rewind = true;
+      }
 
-      size_t _limit, _counter;
+    protected:
 
-      bool _assume_contig, _entered_contig;
+      void _apply_ingroup_filter() override {}
 
+    private:
+      /**
+       * @brief
+       * A parsed line, as a replacement of ref_len bases at start by alt.
+       */
+      struct edit {
+          std::string chr;
+          pos_t raw; /**< Position in the file, before anchoring */
+          pos_t start, ref_len;
+          std::string alt;
+      };
+
+      /**
+       * @brief
+       * Parse the next line into _pending.
+       * @return false at the end of the file
+       */
+      bool _read_line();
+
+      std::ifstream _in;
+      ifasta _ref;
+      std::string _line;
+      edit _pending;
+      bool _has_pending = false, _rewind = false;
+      std::vector<edit> _group; // Lines of the current record
+      pos_t _start = 0, _end = 0; // Reference range replaced by the group
+      std::string _loaded; // Contig resident in _ref
   };
 
-  inline std::ostream &operator<<(std::ostream &os, const VCF &vcf) {
+  /**
+   * @brief
+   * Open a variant source, picking the reader from the file contents.
+   * @param file VCF/BCF file, variant cache or kSNP file. Empty for no variants.
+   * @param reference Reference FASTA, required for kSNP files.
+   * @return Variant file reader
+   */
+  std::unique_ptr<VarFile> open_varfile(const std::string &file, const std::string &reference = "");
+
+  inline std::ostream &operator<<(std::ostream &os, const VarFile &vcf) {
       os << "POS: " << vcf.pos() << " REF: " << vcf.ref() << " ALTS: ";
       for (const auto &al : vcf.alleles()) os << al << ' ';
       return os;
@@ -17,7 +17,17 @@
 #include "alignment.h"
 #include "sim.h"
 #include "threadpool.h"
-#include <mutex>
+#include "async_writer.h"
+#include "task_scheduler.h"
+#include "results.h"
+
+#include <atomic>
+#include <iomanip>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using rg::Deleter;
 
@@ -30,26 +40,31 @@ int align_main(int argc, char *argv[]) {
     }
 
     // Load parameters
-    unsigned match, npenalty, threads, chunk_size, subsample;
-    std::string read_file, gdf, align_targets, out_file, pgid, mismatch, rdg, rfg;
-    bool end_to_end = false, fwdonly = false, p64=false, msonly=false, maxonly=false, notraceback=false;
+    unsigned match, npenalty, threads, chunk_size, subsample, reorder_window, seed;
+    int max_inflight, io_threads;
+    std::string read_file, gdf, align_targets, out_file, pgid, mismatch, rdg, rfg, split, schedule, shard_spec;
+    bool end_to_end = false, fwdonly = false, p64=false, msonly=false, maxonly=false, notraceback=false, stream=false,
+         ordered=false, numa=false;
 
     cxxopts::Options opts("vargas align", "Align reads to a graph.");
     try {
         opts.add_options("Input")
         ("g,gdef", "<str> *Graph definition file.", cxxopts::value(gdf))
-        ("U,reads", "<str> *Unpaired reads in SAM, FASTQ, or FASTA format.", cxxopts::value(read_file));
+        ("U,reads", "<str> *Unpaired reads in SAM, BAM, CRAM, FASTQ, or FASTA format. Comma separated for several files.", cxxopts::value(read_file));
 
         opts.add_options("Optional")
-        ("S,sam", "<str> Output file.", cxxopts::value(out_file))
+        ("S,sam", "<str> Output file. .bam or .cram to write BAM/CRAM, .vres for a results file.", cxxopts::value(out_file))
+        ("split", "<file|rg> Write one output per input file or read group. '%' in -S is replaced with the file name or RG ID.", cxxopts::value(split))
         ("msonly", "Only report max score. Improves speed.", cxxopts::value(msonly)->implicit_value("1"))
         ("maxonly", "Only report max score, location, and count. Improves speed.", cxxopts::value(maxonly)->implicit_value("1"))
         ("phred64", "Qualities are Phred+64, not Phred+33.", cxxopts::value(p64)->implicit_value("1"))
         ("p,subsample", "<N> Sample N random reads, 0 for all.", cxxopts::value(subsample)->default_value("0"))
+        ("seed", "<N> Random seed for -p. (default: random)", cxxopts::value(seed))
         ("a,alignto", "<str> Target graph, or SAM Read Group -> graph mapping.\"(RG:ID:<group>,<target_graph>;)+|<graph>\"", cxxopts::value(align_targets))
         ("s,assess", "[ID] Use score profile from a previous alignment.", cxxopts::value(pgid)->implicit_value("."))
         ("f,forward", "Only align to forward strand.", cxxopts::value(fwdonly))
-        ("notraceback", "If graph contains no variants, do not compute traceback", cxxopts::value(notraceback)->implicit_value("1"));
+        ("notraceback", "If graph contains no variants, do not compute traceback", cxxopts::value(notraceback)->implicit_value("1"))
+        ("shard", "<i/N> Only align reads i, i+N, i+2N... of each input. Combine the outputs with vargas merge.", cxxopts::value(shard_spec));
 
         opts.add_options("Scoring")
         ("ete", "End to end alignment.", cxxopts::value(end_to_end))
@@ -61,7 +76,14 @@ int align_main(int argc, char *argv[]) {
 
         opts.add_options("Threading")
         ("j,threads", "<N> Number of threads.", cxxopts::value(threads)->default_value("1"))
-        ("u,chunk", "<N> Partition into tasks of max size N.", cxxopts::value(chunk_size)->default_value("64"));
+        ("u,chunk", "<N> Partition into tasks of max size N.", cxxopts::value(chunk_size)->default_value("64"))
+        ("schedule", "<affinity|cost> Keep threads on one subgraph, or always take the largest task.", cxxopts::value(schedule)->default_value("affinity"))
+        ("ordered", "Write records in input order.", cxxopts::value(ordered)->implicit_value("1"))
+        ("reorder-window", "<N> Tasks held to restore order with --ordered, 0 for 4 per thread.", cxxopts::value(reorder_window)->default_value("0"))
+        ("stream", "Align reads while reading them, with bounded memory.", cxxopts::value(stream)->implicit_value("1"))
+        ("max-inflight", "<N> Read batches held in memory with --stream.", cxxopts::value(max_inflight)->default_value("3"))
+        ("io-threads", "<N> Threads for BAM/CRAM compression and decompression.", cxxopts::value(io_threads)->default_value("0"))
+        ("numa", "Pin threads to NUMA nodes, with a copy of the graph on each node.", cxxopts::value(numa)->implicit_value("1"));
 
         opts.add_options()("h,help", "Display this message.");
 
@@ -84,17 +106,22 @@ int align_main(int argc, char *argv[]) {
         align_help(opts);
         throw std::invalid_argument("No read file provided.");
     }
-    ReadFmt format = read_fmt(read_file);
+    std::vector<std::string> read_files = rg::split(read_file, ',');
+    if (read_files.empty()) read_files.push_back(read_file);
+    const size_t num_files = read_files.size();
+    std::vector<ReadFmt> formats;
+    for (const auto &f : read_files) formats.push_back(read_fmt(f));
+    const bool sam_inputs = std::all_of(formats.begin(), formats.end(), [](ReadFmt f) { return f == ReadFmt::SAM; });
 
     if (chunk_size < vargas::Aligner::read_capacity() || chunk_size % vargas::Aligner::read_capacity() != 0) {
         std::cerr << "[warn] Chunk size is not a multiple of SIMD vector length: "
                   << vargas::Aligner::read_capacity() << std::endl;
     }
 
-    if (opts.count("assess") && format != ReadFmt::SAM) {
+    if (opts.count("assess") && !sam_inputs) {
         throw std::invalid_argument("Assess is only available for SAM inputs.");
     }
-    if (!align_targets.empty() && format != ReadFmt::SAM) {
+    if (!align_targets.empty() && !sam_inputs) {
         throw std::invalid_argument("Alignment targets only available for SAM inputs.");
     }
 
@@ -102,16 +129,90 @@ int align_main(int argc, char *argv[]) {
         throw std::invalid_argument("At most one of msonly and maxonly can be specified.");
     }
 
-    vargas::isam reads;
-    if (format == ReadFmt::FASTQ) {
-        load_fast(read_file, true, reads, p64);
-    } else if (format == ReadFmt::FASTA) {
-        load_fast(read_file, false, reads, p64);
-    } else {
-        reads.open(read_file);
+    if (max_inflight < 1) {
+        throw std::invalid_argument("--max-inflight should be at least 1.");
+    }
+
+    if (schedule != "affinity" && schedule != "cost") {
+        throw std::invalid_argument("--schedule should be affinity or cost, got \"" + schedule + "\".");
+    }
+    const bool affinity = schedule == "affinity";
+
+    AlignOutput::Split split_mode = AlignOutput::Split::NONE;
+    if (opts.count("split")) {
+        if (split == "file") split_mode = AlignOutput::Split::FILE;
+        else if (split == "rg") split_mode = AlignOutput::Split::READ_GROUP;
+        else throw std::invalid_argument("--split should be file or rg, got \"" + split + "\".");
+        if (out_file.find('%') == std::string::npos)
+            throw std::invalid_argument("--split needs an output name containing '%', e.g. -S out_%.sam");
+        if (ordered) throw std::invalid_argument("--ordered cannot be used with --split.");
+    }
+
+    Shard shard;
+    if (opts.count("shard")) {
+        shard = Shard::parse(shard_spec);
+        if (vargas::ResultsFormat::is_results(out_file)) {
+            throw std::invalid_argument("--shard needs SAM, BAM, or CRAM output to be merged.");
+        }
+        if (subsample) throw std::invalid_argument("--shard cannot be used with -p.");
+        // Merge restores the read order of one input per output
+        if (num_files > 1 && split_mode != AlignOutput::Split::FILE) {
+            throw std::invalid_argument("--shard with several inputs needs --split file.");
+        }
+        // The streaming pipeline writes each shard in read order, so merge never holds a whole output
+        stream = true;
+    }
+
+    std::shared_ptr<rg::HtsPool> io_pool;
+    if (io_threads > 0) io_pool = std::make_shared<rg::HtsPool>(io_threads);
+
+    // Only the sample is held, so it is aligned from memory even with --stream
+    if (subsample) stream = false;
+    if (subsample && !opts.count("seed")) seed = std::random_device()();
+
+    std::vector<std::unique_ptr<ReadStream>> read_streams;
+    std::vector<std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>>> file_tasks(num_files);
+    std::vector<vargas::SAM::Header> headers(num_files);
+    size_t read_len = 0;
+    for (size_t f = 0; f < num_files; ++f) {
+        std::string file = read_files[f];
+        const ReadFmt format = formats[f];
+        if (num_files > 1) std::cerr << "Input \"" << file << "\":\n";
+        if (stream) {
+            read_streams.emplace_back(new ReadStream(file, format, p64));
+            read_streams.back()->set_thread_pool(io_pool);
+            read_streams.back()->set_shard(shard);
+            auto &hdr = read_streams.back()->header();
+            if (!hdr.read_groups.count(UNGROUPED_READGROUP)) {
+                hdr.add(vargas::SAM::Header::ReadGroup("@RG\tID:" + std::string(UNGROUPED_READGROUP)));
+            }
+            headers[f] = hdr;
+            continue;
+        }
+
+        vargas::isam reads;
+        reads.set_thread_pool(io_pool);
+        if (subsample) {
+            ReadStream input(file, format, p64);
+            input.set_thread_pool(io_pool);
+            const size_t total = sample_reads(input, subsample, seed, reads);
+            std::cerr << "Sampled " << std::min<size_t>(subsample, total) << " of " << total << " reads (seed "
+                      << seed << ").\n";
+        } else if (threads > 1 && load_parallel(file, format, reads, p64, threads)) {
+            // Uncompressed SAM/FASTQ parsed on all threads
+        } else if (format == ReadFmt::FASTQ) {
+            load_fast(file, true, reads, p64);
+        } else if (format == ReadFmt::FASTA) {
+            load_fast(file, false, reads, p64);
+        } else {
+            reads.open(file);
+        }
+        if (!subsample) reads.subset(0);
+        size_t file_read_len;
+        file_tasks[f] = create_tasks(reads, align_targets, chunk_size, file_read_len);
+        read_len = std::max(read_len, file_read_len);
+        headers[f] = reads.header();
     }
-    reads.subset(subsample);
-    auto &reads_hdr = reads.header();
 
     vargas::ScoreProfile prof;
     {
@@ -151,7 +252,7 @@ int align_main(int argc, char *argv[]) {
 
     if (pgid == ".") {
         bool check = false;
-        for (const auto &i : reads.header().programs) {
+        for (const auto &i : headers[0].programs) {
             if (std::find(vargas::supported_pgid.begin(), vargas::supported_pgid.end(), i.first)
             != vargas::supported_pgid.end()) {
                 pgid = i.first;
@@ -164,7 +265,7 @@ int align_main(int argc, char *argv[]) {
         std::cerr << "Using profile for: " << pgid << "\n";
     } else if (pgid.length()) {
         try {
-            prof = vargas::program_profile(reads_hdr.programs.at(pgid).command_line);
+            prof = vargas::program_profile(headers[0].programs.at(pgid).command_line);
         } catch (std::exception &e) {
             throw std::invalid_argument("Unrecognized PG ID: " + pgid);
         }
@@ -178,36 +279,56 @@ int align_main(int argc, char *argv[]) {
     pg.id = "VA";
     pg.version = __DATE__;
     std::replace_if(pg.version.begin(), pg.version.end(), isspace, ' '); // rm tabs
-    const auto assigned_pgid = reads_hdr.add(pg);
+    for (auto &hdr : headers) hdr.programs[hdr.add(pg)].aux.set(ALIGN_SAM_PG_GDF, gdf);
 
-    size_t read_len;
-    auto task_list = create_tasks(reads, align_targets, chunk_size, read_len);
+    // Interleave the tasks of the inputs so they share the threads throughout the run
+    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> task_list;
+    std::vector<size_t> task_file;
+    if (stream) {
+        // Aligners are rebuilt if longer reads are found
+        read_len = 100;
+    } else {
+        bool more = true;
+        for (size_t i = 0; more; ++i) {
+            more = false;
+            for (size_t f = 0; f < num_files; ++f) {
+                if (i >= file_tasks[f].size()) continue;
+                task_list.push_back(std::move(file_tasks[f][i]));
+                task_file.push_back(f);
+                more = true;
+            }
+        }
+        file_tasks.clear();
 
-    const size_t num_tasks = task_list.size();
-    if (num_tasks < threads) {
-        std::cerr << "[warn] Number of threads is greater than number of tasks. Try decreasing -u.\n";
-    }
+        const size_t num_tasks = task_list.size();
+        if (num_tasks < threads) {
+            std::cerr << "[warn] Number of threads is greater than number of tasks. Try decreasing -u.\n";
+        }
 
-    threads = threads ? threads > task_list.size() ? task_list.size() : threads
-                      : 1;
+        threads = threads ? threads > task_list.size() ? task_list.size() : threads
+                          : 1;
+    }
+    if (!threads) threads = 1;
 
-    int bias = 255 - (read_len * match);
-    const bool use_wide = (bias < 0) or (end_to_end and (static_cast<signed long long>(prof.ref_gopen + (prof.ref_gext * (read_len - 1))) > bias || read_len * prof.mismatch_max > bias));
+    const bool use_wide = use_wide_aligner(prof, read_len);
     if (use_wide) {
         std::cerr << "Score range: " << read_len * match << " to -" << std::min(prof.ref_gopen + (prof.ref_gext * (read_len - 1)), read_len * prof.mismatch_max) <<
         ". Using 16-bit aligner (" << vargas::WordAligner::read_capacity() << " reads/vector).\n";
     }
     std::cerr << "Scoring profile: " << prof.to_string() << "\n";
-
-    std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> aligners(threads);
-    for (size_t k = 0; k < threads; ++k) {
-        aligners[k] = make_aligner(prof, read_len, use_wide, msonly, maxonly);
-    }
-
+    if (ordered && !reorder_window) reorder_window = 4 * threads;
 
     std::cerr << "\nLoading \"" << gdf << "\"...\n";
     auto start_time = std::chrono::steady_clock::now();
-    vargas::GraphMan gm(gdf);
+    std::unique_ptr<NumaPlacement> numa_place;
+    std::unique_ptr<vargas::GraphMan> own_gm;
+    if (numa) {
+        const auto topo = rg::NumaTopology::detect();
+        if (topo.size() > 1) numa_place.reset(new NumaPlacement(topo, threads, gdf));
+        else std::cerr << "[warn] --numa: " << topo.size() << " NUMA node(s) available, threads are not pinned.\n";
+    }
+    if (!numa_place) own_gm.reset(new vargas::GraphMan(gdf));
+    vargas::GraphMan &gm = numa_place ? numa_place->graph(0) : *own_gm;
     if (gm.labels().size() != 1 && maxonly) {
         std::cerr << "[warn] With --maxonly, max score position and count may be incorrect because the genome is a graph." << std::endl;
     }
@@ -215,32 +336,291 @@ int align_main(int argc, char *argv[]) {
         throw std::invalid_argument("Cannot calculate 2nd-max score when the genome is a graph. Use --msonly or --maxonly.");
     }
     std::cerr << rg::chrono_duration(start_time) << "s.\n";
+    if (numa_place) numa_place->report();
+
+    // With --numa each aligner is allocated by the thread that uses it
+    std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> aligners(threads);
+    auto build_aligner = [&](int k) { aligners[k] = make_aligner(prof, read_len, use_wide, msonly, maxonly); };
+    if (numa_place) numa_place->for_each_thread(build_aligner);
+    else for (size_t k = 0; k < threads; ++k) build_aligner(k);
 
     if (out_file.length()) std::cerr << "Writing to \"" << (out_file.empty() ? "stdout" : out_file) << "\".\n";
-    reads_hdr.programs[assigned_pgid].aux.set(ALIGN_SAM_PG_GDF, gdf);
-    vargas::osam aligns_out(out_file, reads_hdr);
+    if (split_mode == AlignOutput::Split::NONE) {
+        // One output holds the read groups and contigs of every input
+        for (size_t f = 1; f < num_files; ++f) {
+            headers[0].read_groups.insert(headers[f].read_groups.begin(), headers[f].read_groups.end());
+            headers[0].sequences.insert(headers[f].sequences.begin(), headers[f].sequences.end());
+        }
+        headers.resize(1);
+    }
+    for (auto &hdr : headers) {
+        if (vargas::SAM::hts_format(out_file) && hdr.sequences.empty()) add_contig_lines(gm, hdr);
+        if (vargas::ResultsFormat::is_results(out_file)) add_contig_lines(gm, hdr); // Contig dictionary
+    }
+
+    std::unique_ptr<vargas::osam> aligns_out;
+    std::unique_ptr<AlignOutput> out;
+    if (split_mode == AlignOutput::Split::NONE) {
+        aligns_out.reset(new vargas::osam(out_file, headers[0], io_pool));
+        // Stream output is written in input order without a reorder window
+        out.reset(new AlignOutput(*aligns_out, ordered && !stream ? reorder_window : 0));
+    } else {
+        out.reset(new AlignOutput(split_mode, out_file, read_files, headers, io_pool));
+    }
+
     char phred_offset = opts.count("phred64") ? 64 : 33;
-    align(gm, task_list, aligns_out, aligners, fwdonly, msonly, maxonly, notraceback, phred_offset);
+    if (stream) {
+        std::vector<ReadStream *> inputs;
+        for (auto &rs : read_streams) inputs.push_back(rs.get());
+        align_stream(gm, inputs, align_targets, *out, aligners, prof, read_len, chunk_size, max_inflight,
+                     fwdonly, msonly, maxonly, notraceback, phred_offset, numa_place.get(), affinity);
+    } else {
+        align(gm, task_list, *out, aligners, fwdonly, msonly, maxonly, notraceback, phred_offset,
+              num_files > 1 ? &task_file : nullptr, numa_place.get(), affinity);
+    }
 
     return 0;
 }
 
+void add_contig_lines(const vargas::GraphMan &gm, vargas::SAM::Header &hdr) {
+    const auto &offsets = gm.resolver()._contig_offsets;
+    if (offsets.empty()) return;
+    // Positions in (offset, next offset] belong to a contig, the last one ends with the base graph
+    const unsigned end = gm.at("base")->rbegin()->end_pos() + 1;
+    for (auto o = offsets.begin(); o != offsets.end(); ++o) {
+        const auto next = std::next(o);
+        vargas::SAM::Header::Sequence sq;
+        sq.name = o->second;
+        sq.len = (next == offsets.end() ? end : next->first) - o->first;
+        if (!hdr.sequences.count(sq.name)) hdr.add(sq);
+    }
+}
+
+/**
+ * @brief
+ * ForPool body of NumaPlacement::for_each_thread.
+ */
+struct each_thread_helper {
+    const std::function<void(int)> &f;
+    std::atomic<size_t> started;
+    size_t threads;
+};
+
+static void each_thread_body(void *data, long, int tid) {
+    each_thread_helper &help(*(each_thread_helper *) data);
+    // Hold every worker until all have started, so each runs exactly one index
+    help.started.fetch_add(1);
+    while (help.started.load() < help.threads) std::this_thread::yield();
+    help.f(tid);
+}
+
+NumaPlacement::NumaPlacement(const rg::NumaTopology &topo, size_t threads, const std::string &gdf) : _topo(topo) {
+    if (topo.size() == 0) throw std::invalid_argument("No NUMA nodes to place threads on.");
+    if (threads == 0) threads = 1;
+    for (size_t t = 0; t < threads; ++t) _thread_node.push_back(t * topo.size() / threads);
+    _replicas.resize(topo.size());
+    _pool.reset(new rg::ForPool(threads));
+
+    // A single thread runs inline on the calling thread, which would stay pinned after the run
+    const bool pin = threads > 1;
+    std::vector<char> pinned(threads, !pin);
+    std::vector<std::string> errors(threads);
+    for_each_thread([&](int tid) {
+        const size_t node = _thread_node[tid];
+        if (pin) pinned[tid] = _topo.pin(node);
+        if (tid > 0 && _thread_node[tid - 1] == node) return;
+        // The first thread of the node allocates its replica
+        try {
+            _replicas[node].reset(new vargas::GraphMan(gdf));
+        } catch (std::exception &e) {
+            errors[tid] = e.what();
+        }
+    });
+    for (const auto &e : errors) {
+        if (!e.empty()) throw std::invalid_argument(e);
+    }
+    const auto unpinned = std::count(pinned.begin(), pinned.end(), 0);
+    if (unpinned) std::cerr << "[warn] " << unpinned << " thread(s) could not be pinned to their NUMA node.\n";
+}
+
+NumaPlacement::~NumaPlacement() = default;
+
+void NumaPlacement::for_each_thread(const std::function<void(int)> &f) {
+    each_thread_helper help{f, {0}, _thread_node.size()};
+    _pool->forpool(&each_thread_body, (void *) &help, _thread_node.size());
+}
+
+void NumaPlacement::report() const {
+    std::cerr << "NUMA: " << _thread_node.size() << " thread(s) on";
+    for (size_t n = 0; n < _topo.size(); ++n) {
+        const auto count = std::count(_thread_node.begin(), _thread_node.end(), n);
+        if (count) std::cerr << " node " << _topo.id(n) << " (" << count << ")";
+    }
+    std::cerr << ", one graph copy per node.\n";
+}
+
 struct align_helper {
     vargas::GraphMan &gm;
     std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list;
-    vargas::osam &out;
+    AlignOutput *out; // nullptr to leave the aligned records in task_list
+    const std::vector<size_t> *task_file; // Input file of each task, nullptr for file 0
+    NumaPlacement *numa; // Node local graphs, nullptr to use gm
     const std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners;
     bool fwdonly, msonly, maxonly, notraceback;
     char phred_offset;
-    std::mutex &mut;
 };
 
+/**
+ * @brief
+ * Print how much of the run the writer thread spent writing, and how long workers waited on it.
+ */
+static void writer_report(const rg::AsyncWriter::Stats &s) {
+    std::cerr << "Output: " << s.bytes / double(1 << 20) << " MB in " << s.writes << " writes from "
+              << s.buffers << " buffers. Writer busy " << s.busy << "s of " << s.wall << "s ("
+              << int(100 * s.busy / std::max(s.wall, 1e-9)) << "%), workers waited " << s.push_wait
+              << "s on a full queue.\n";
+}
+
+/**
+ * @brief
+ * Output file name for a split output, '%' replaced with key.
+ */
+static std::string split_name(const std::string &pattern, std::string key) {
+    std::replace(key.begin(), key.end(), '/', '_');
+    std::string ret = pattern;
+    ret.replace(ret.find('%'), 1, key);
+    return ret;
+}
+
+/**
+ * @brief
+ * File name without directory and extensions, "stdin" if empty.
+ */
+static std::string file_stem(const std::string &file) {
+    if (file.empty()) return "stdin";
+    std::string ret = file.substr(file.find_last_of('/') + 1);
+    if (rg::ends_with(ret, ".gz")) ret.resize(ret.length() - 3);
+    const size_t dot = ret.find_last_of('.');
+    if (dot != std::string::npos && dot > 0) ret.resize(dot);
+    return ret;
+}
+
+AlignOutput::AlignOutput(vargas::osam &out, size_t reorder_window) :
+_split(Split::NONE), _reorder_window(reorder_window) {
+    _outputs.emplace_back(new output);
+    _outputs[0]->sam = &out;
+    _outputs[0]->writer.reset(new rg::AsyncWriter([&out](const std::string &buf) { out.write(buf); }));
+    if (reorder_window) _reorder.reset(new rg::ReorderBuffer(*_outputs[0]->writer, reorder_window));
+}
+
+AlignOutput::AlignOutput(Split split, const std::string &pattern, const std::vector<std::string> &inputs,
+                         const std::vector<vargas::SAM::Header> &headers, std::shared_ptr<rg::HtsPool> pool) :
+_split(split), _pattern(pattern), _headers(headers), _pool(std::move(pool)) {
+    if (split == Split::NONE) throw std::invalid_argument("Split outputs need a split mode.");
+    if (pattern.find('%') == std::string::npos)
+        throw std::invalid_argument("Split output name \"" + pattern + "\" has no '%'.");
+    if (split != Split::FILE) return;
+    std::vector<std::string> names;
+    for (const auto &in : inputs) {
+        names.push_back(split_name(pattern, file_stem(in)));
+        if (std::count(names.begin(), names.end(), names.back()) > 1)
+            throw std::invalid_argument("Two inputs are written to \"" + names.back() + "\".");
+    }
+    for (size_t i = 0; i < names.size(); ++i) _open(names[i], headers.at(i));
+}
+
+AlignOutput::output &AlignOutput::_open(const std::string &name, const vargas::SAM::Header &hdr) {
+    _outputs.emplace_back(new output);
+    output &o = *_outputs.back();
+    o.file.reset(new vargas::osam(name, hdr, _pool));
+    o.sam = o.file.get();
+    vargas::osam *sam = o.sam;
+    o.writer.reset(new rg::AsyncWriter([sam](const std::string &buf) { sam->write(buf); }));
+    return o;
+}
+
+void AlignOutput::_push(output &out, size_t index, std::vector<const vargas::SAM::Record *> &records) {
+    std::string buf;
+    if (const auto *results = out.sam->results()) results->append_block(records, buf);
+    else {
+        for (const auto *r : records) {
+            r->append_to(buf);
+            buf += '\n';
+        }
+    }
+    if (_reorder) _reorder->put(index, std::move(buf));
+    else out.writer->push(std::move(buf));
+}
+
+void AlignOutput::push(size_t index, size_t file, const std::vector<vargas::SAM::Record> &records) {
+    if (_split != Split::READ_GROUP) {
+        std::vector<const vargas::SAM::Record *> ptrs(records.size());
+        for (size_t i = 0; i < records.size(); ++i) ptrs[i] = &records[i];
+        _push(*_outputs.at(_split == Split::FILE ? file : 0), index, ptrs);
+        return;
+    }
+
+    // Group by read group, then open any new outputs under one lock
+    std::map<std::string, std::vector<const vargas::SAM::Record *>> groups;
+    std::string id;
+    for (const auto &r : records) {
+        if (!r.aux.get("RG", id)) id = UNGROUPED_READGROUP;
+        groups[id].push_back(&r);
+    }
+    std::vector<output *> outs;
+    {
+        std::lock_guard<std::mutex> lock(_mut);
+        for (const auto &g : groups) {
+            auto f = _rg_outputs.find(g.first);
+            if (f == _rg_outputs.end()) {
+                vargas::SAM::Header hdr = _headers.at(file);
+                const auto rg = hdr.read_groups.find(g.first);
+                if (rg != hdr.read_groups.end()) {
+                    const auto keep = *rg;
+                    hdr.read_groups.clear();
+                    hdr.read_groups.insert(keep);
+                }
+                f = _rg_outputs.emplace(g.first, &_open(split_name(_pattern, g.first), hdr)).first;
+            }
+            outs.push_back(f->second);
+        }
+    }
+    size_t i = 0;
+    for (auto &g : groups) _push(*outs[i++], index, g.second);
+}
+
+void AlignOutput::close() {
+    for (auto &o : _outputs) {
+        o->writer->close();
+        if (o->file) o->file->close();
+    }
+}
+
+void AlignOutput::report() const {
+    rg::AsyncWriter::Stats total;
+    for (const auto &o : _outputs) {
+        const auto s = o->writer->stats();
+        total.buffers += s.buffers;
+        total.bytes += s.bytes;
+        total.writes += s.writes;
+        total.push_wait += s.push_wait;
+        total.busy += s.busy;
+        total.wall = std::max(total.wall, s.wall);
+    }
+    if (_outputs.size() > 1) std::cerr << _outputs.size() << " outputs, writer times summed. ";
+    writer_report(total);
+    if (_reorder) {
+        const auto rs = _reorder->stats();
+        std::cerr << "Reorder: held at most " << rs.max_held << " of " << _reorder_window
+                  << " tasks, workers waited " << rs.wait << "s for earlier tasks.\n";
+    }
+}
+
 void align_helper_func(void *data, long index, int tid) {
     align_helper &help(*(align_helper *)data);
     auto &aligners = help.aligners;
-    auto &out = help.out;
     auto &task_list = help.task_list;
-    auto &gm = help.gm;
+    auto &gm = help.numa ? help.numa->graph(tid) : help.gm;
     auto fwdonly = help.fwdonly;
     auto msonly = help.msonly;
     auto maxonly = help.maxonly;
@@ -286,11 +666,11 @@ void align_helper_func(void *data, long index, int tid) {
 
             if (not_graph & !notraceback) {
                 int nodeID = gm.nodeID_from_contig(rec.ref_name);
-                vargas::Graph::nodemap_t _node_map = *(subgraph->node_map());
+                const vargas::Graph::Node &ref_node = subgraph->node_map()->at(nodeID);
                 //TODO upper-bound the length of reference slice needed based on the score or scoring function
                 int ref_len = 2*rec.seq.length() < abs.second ? 2*rec.seq.length() : abs.second ;
                 int ref_start = abs.second-ref_len;
-                auto ref_iter = std::next(_node_map[nodeID].begin(),ref_start); //TODO this is linear time I think?
+                auto ref_iter = std::next(ref_node.begin(), ref_start);
 
                 // Allocate the three DP score matrixes: M (match) D (deletion) I (insertion), initialize with zero
                 std::vector<std::vector<int>> M;
@@ -537,10 +917,7 @@ void align_helper_func(void *data, long index, int tid) {
         }
     }
 
-    {
-        std::lock_guard<std::mutex> lock(help.mut);
-        for (const auto & j : task_list.at(index).second) out.add_record(j);
-    }
+    if (help.out) help.out->push(index, help.task_file ? help.task_file->at(index) : 0, task_list.at(index).second);
 }
 
 #if !NDEBUG
@@ -548,22 +925,254 @@ void align_helper_func(void *data, long index, int tid) {
 #define at operator[]
 #endif
 
+/**
+ * @brief
+ * Run the tasks of help on fp in the given order. The work of a task is its read bases times
+ * the length of its subgraph.
+ */
+static void run_tasks(rg::TaskScheduler &sched, rg::ForPool &fp, align_helper &help, rg::TaskScheduler::Order order) {
+    std::unordered_map<std::string, double> graph_len;
+    std::vector<std::string> groups;
+    std::vector<double> units;
+    groups.reserve(help.task_list.size());
+    units.reserve(help.task_list.size());
+    for (const auto &task : help.task_list) {
+        auto g = graph_len.find(task.first);
+        if (g == graph_len.end()) {
+            g = graph_len.emplace(task.first, help.gm.at(task.first)->statistics().total_length).first;
+        }
+        size_t bases = 0;
+        for (const auto &r : task.second) bases += r.seq.length();
+        groups.push_back(task.first);
+        units.push_back(bases * g->second);
+    }
+    sched.run(fp, groups, units, order, &align_helper_func, (void *) &help);
+}
+
+/**
+ * @brief
+ * Print the time each thread spent aligning, and idle while others finished their tasks.
+ * Subgraph switches and cache misses show how well threads stayed on one graph.
+ */
+static void scheduler_report(const rg::TaskScheduler::Stats &s) {
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(2) << "Threads busy/idle (s):";
+    for (size_t t = 0; t < s.busy.size(); ++t) ss << " " << s.busy[t] << "/" << std::max(s.wall - s.busy[t], 0.0);
+    ss << ", " << s.tasks << " tasks, " << s.switches << " subgraph switches.\n";
+    if (s.counted) {
+        ss << "Cache misses: " << s.cache.misses << " of " << s.cache.references << " references ("
+           << 100.0 * s.cache.misses / std::max<uint64_t>(s.cache.references, 1) << "%).\n";
+    } else {
+        ss << "Cache misses: perf counters unavailable.\n";
+    }
+    std::cerr << ss.str();
+}
+
 void align(vargas::GraphMan &gm,
            std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
-           vargas::osam &out,
+           AlignOutput &out,
            const std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners,
-           bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset) {
-    std::cerr << "Aligning... " << std::flush;
-    rg::ForPool fp(aligners.size());
+           bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+           const std::vector<size_t> *task_file, NumaPlacement *numa, bool affinity) {
+    std::cerr << "Aligning" << (out.ordered() ? " in order" : "") << "... " << std::flush;
+    std::unique_ptr<rg::ForPool> own_pool(numa ? nullptr : new rg::ForPool(aligners.size()));
+    rg::ForPool &fp = numa ? numa->pool() : *own_pool;
+    rg::TaskScheduler sched(aligners.size());
     auto start_time = std::chrono::steady_clock::now();
 
-    const auto num_tasks = task_list.size();
-    std::mutex mut;
-    align_helper help{gm, task_list, out, aligners, fwdonly, msonly, maxonly, notraceback, phred_offset, mut};
-    fp.forpool(&align_helper_func, (void *)&help, num_tasks);
+    align_helper help{gm, task_list, &out, task_file, numa, aligners, fwdonly, msonly, maxonly, notraceback, phred_offset};
+    // A reorder window needs tasks in index order
+    run_tasks(sched, fp, help, out.ordered() ? rg::TaskScheduler::Order::INDEX
+                               : affinity ? rg::TaskScheduler::Order::AFFINITY : rg::TaskScheduler::Order::COST);
+    out.close();
 
     std::cerr << rg::chrono_duration(start_time) << "s.\n";
+    scheduler_report(sched.stats());
+    out.report();
+}
+
+struct stream_batch {
+    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> tasks;
+    size_t num_reads = 0, read_len = 0, file = 0;
+};
 
+struct stream_helper {
+    vargas::GraphMan &gm;
+    const std::vector<ReadStream *> &reads;
+    AlignOutput &out;
+    std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners;
+    const vargas::ScoreProfile &prof;
+    rg::ForPool &fp;
+    rg::TaskScheduler &sched; // Keeps measured subgraph costs across batches
+    NumaPlacement *numa;
+    rg::TaskScheduler::Order order;
+    std::unordered_map<std::string, std::vector<std::string>> targets; // RG ID to target graphs
+    std::vector<std::string> default_targets; // Targets of every read group
+    size_t read_len, chunk_size, batch_size;
+    bool fwdonly, msonly, maxonly, notraceback;
+    char phred_offset;
+    size_t num_reads, num_batches, num_tasks;
+    size_t next_file; // Input the next batch is read from
+    std::vector<bool> done; // Inputs at their end
+};
+
+/**
+ * @brief
+ * kt_pipeline step function. Step 0 reads a batch, step 1 aligns it, step 2 writes it.
+ * Each step processes batches in input order. Batches are read from each input in turn.
+ */
+static void *stream_step(void *data, int step, void *in) {
+    stream_helper &help(*(stream_helper *) data);
+
+    if (step == 0) {
+        std::unique_ptr<stream_batch> batch(new stream_batch);
+        const size_t num_files = help.reads.size();
+        size_t f = 0;
+        while (f < num_files && help.done[help.next_file]) {
+            help.next_file = (help.next_file + 1) % num_files;
+            ++f;
+        }
+        if (f == num_files) return nullptr;
+        batch->file = help.next_file;
+        help.next_file = (help.next_file + 1) % num_files;
+        ReadStream &reads = *help.reads[batch->file];
+        std::map<std::string, size_t> open_task; // Target graph to the task being filled
+        vargas::SAM::Record rec;
+        std::string read_group;
+        while (batch->num_reads < help.batch_size && reads.next(rec)) {
+            ++batch->num_reads;
+            batch->read_len = std::max(batch->read_len, rec.seq.length());
+            if (!rec.aux.get("RG", read_group)) {
+                read_group = UNGROUPED_READGROUP;
+                rec.aux.set("RG", UNGROUPED_READGROUP);
+            }
+            const auto t = help.targets.find(read_group);
+            const auto &targets = t == help.targets.end() ? help.default_targets : t->second;
+            for (size_t i = 0; i < targets.size(); ++i) {
+                const auto &target = targets[i];
+                auto f = open_task.find(target);
+                if (f == open_task.end() || batch->tasks[f->second].second.size() >= help.chunk_size) {
+                    open_task[target] = batch->tasks.size();
+                    batch->tasks.emplace_back(target, std::vector<vargas::SAM::Record>());
+                    batch->tasks.back().second.reserve(help.chunk_size);
+                    f = open_task.find(target);
+                }
+                // The last target takes the record itself
+                if (i + 1 == targets.size()) batch->tasks[f->second].second.push_back(std::move(rec));
+                else batch->tasks[f->second].second.push_back(rec);
+            }
+        }
+        if (batch->num_reads < help.batch_size) help.done[batch->file] = true;
+        if (batch->num_reads == 0) return stream_step(data, step, in);
+        return batch.release();
+    }
+
+    stream_batch *batch = (stream_batch *) in;
+    if (step == 1) {
+        if (batch->read_len > help.read_len) {
+            help.read_len = batch->read_len;
+            auto rebuild = [&help](int k) {
+                help.aligners[k] = make_aligner(help.prof, help.read_len, use_wide_aligner(help.prof, help.read_len),
+                                                help.msonly, help.maxonly);
+            };
+            if (help.numa) help.numa->for_each_thread(rebuild);
+            else for (size_t k = 0; k < help.aligners.size(); ++k) rebuild(k);
+        }
+        align_helper ah{help.gm, batch->tasks, nullptr, nullptr, help.numa, help.aligners, help.fwdonly, help.msonly,
+                        help.maxonly, help.notraceback, help.phred_offset};
+        run_tasks(help.sched, help.fp, ah, help.order);
+        return batch;
+    }
+
+    if (!help.reads[batch->file]->shard().all()) {
+        // Merge needs each shard in read order, but the tasks of a batch are grouped by target
+        std::vector<std::pair<size_t, vargas::SAM::Record *>> by_index;
+        for (auto &task : batch->tasks) {
+            for (auto &rec : task.second) {
+                size_t index = 0;
+                rec.aux.get(ALIGN_SAM_READ_INDEX_TAG, index);
+                by_index.emplace_back(index, &rec);
+            }
+        }
+        std::stable_sort(by_index.begin(), by_index.end(),
+                         [](const std::pair<size_t, vargas::SAM::Record *> &a,
+                            const std::pair<size_t, vargas::SAM::Record *> &b) { return a.first < b.first; });
+        std::vector<vargas::SAM::Record> records;
+        records.reserve(by_index.size());
+        for (const auto &r : by_index) records.push_back(std::move(*r.second));
+        help.out.push(help.num_tasks++, batch->file, records);
+    } else {
+        // Tasks are written in input order, so a reorder window passes them straight through
+        for (const auto &task : batch->tasks) help.out.push(help.num_tasks++, batch->file, task.second);
+    }
+    help.num_reads += batch->num_reads;
+    ++help.num_batches;
+    delete batch;
+    return nullptr;
+}
+
+size_t align_stream(vargas::GraphMan &gm, const std::vector<ReadStream *> &reads, std::string align_targets,
+                    AlignOutput &out,
+                    std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners,
+                    const vargas::ScoreProfile &prof, size_t read_len, size_t chunk_size, int max_inflight,
+                    bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+                    NumaPlacement *numa, bool affinity) {
+    std::unique_ptr<rg::ForPool> own_pool(numa ? nullptr : new rg::ForPool(aligners.size()));
+    rg::ForPool &fp = numa ? numa->pool() : *own_pool;
+    rg::TaskScheduler sched(aligners.size());
+    stream_helper help{gm, reads, out, aligners, prof, fp, sched, numa,
+                       affinity ? rg::TaskScheduler::Order::AFFINITY : rg::TaskScheduler::Order::COST, {}, {}, read_len, chunk_size,
+                       chunk_size * aligners.size() * 4, fwdonly, msonly, maxonly, notraceback, phred_offset, 0, 0,
+                       0, 0, std::vector<bool>(reads.size(), false)};
+
+    // Map read groups to targets. Without explicit pairs every read group aligns to one graph.
+    std::vector<std::string> alignment_pairs;
+    if (align_targets.length() != 0) {
+        std::replace(align_targets.begin(), align_targets.end(), '\n', ';');
+        alignment_pairs = rg::split(align_targets, ';');
+    }
+    if (alignment_pairs.empty()) help.default_targets.emplace_back("base");
+    else if (alignment_pairs.size() == 1 && rg::split(alignment_pairs[0], ',').size() == 1) {
+        help.default_targets.push_back(alignment_pairs[0]);
+    } else {
+        std::string tag, val, target_val;
+        for (const std::string &p : alignment_pairs) {
+            auto pair = rg::split(p, ',');
+            if (pair.size() != 2)
+                throw std::invalid_argument("Malformed alignment pair \"" + p + "\".");
+            if (pair[0].substr(0, 2) != "RG")
+                throw std::invalid_argument(R"(Expected a read group tag 'RG:xx:', got ")" + pair[0] + "\"");
+            if (pair[0].at(2) != ':')
+                throw std::invalid_argument("Expected source format Read_group_tag:value in \"" + pair[0] + "\".");
+            tag = pair[0].substr(3, 2);
+            target_val = pair[0].substr(6);
+            for (ReadStream *rs : reads) {
+                for (const auto &rg_pair : rs->header().read_groups) {
+                    if (tag == "ID") val = rg_pair.second.id;
+                    else if (rg_pair.second.aux.get(tag, val));
+                    else continue;
+                    if (val != target_val) continue;
+                    auto &targets = help.targets[rg_pair.first];
+                    // Inputs may share a read group
+                    if (std::find(targets.begin(), targets.end(), pair[1]) == targets.end())
+                        targets.push_back(pair[1]);
+                }
+            }
+        }
+        // Read groups without a target have no default, and are not aligned
+    }
+
+    std::cerr << "Aligning (streaming, " << aligners.size() << " threads, " << max_inflight
+              << " batches of " << help.batch_size << " reads)... " << std::flush;
+    auto start_time = std::chrono::steady_clock::now();
+    kt_pipeline(max_inflight, &stream_step, &help, 3);
+    out.close();
+    std::cerr << rg::chrono_duration(start_time) << "s.\n"
+              << help.num_reads << "\tReads in " << help.num_batches << " batch(es).\n"
+              << help.read_len << "\tMax read length.\n";
+    scheduler_report(sched.stats());
+    out.report();
+    return help.num_reads;
 }
 
 std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>>
@@ -708,36 +1317,292 @@ make_aligner(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide, b
     return ret;
 }
 
-void load_fast(std::string &file, const bool fastq, vargas::isam &ret, bool p64) {
-    std::string input;
-    if (file.empty()) {
-        std::stringstream ss;
-        ss << std::cin.rdbuf();
-        input = ss.str();
+bool use_wide_aligner(const vargas::ScoreProfile &prof, size_t read_len) {
+    const int bias = 255 - (read_len * prof.match);
+    return (bias < 0) or (prof.end_to_end and (static_cast<signed long long>(prof.ref_gopen + (prof.ref_gext * (read_len - 1))) > bias
+                                               || read_len * prof.mismatch_max > bias));
+}
+
+Shard Shard::parse(const std::string &spec) {
+    const auto sp = rg::split(spec, '/');
+    Shard ret;
+    try {
+        if (sp.size() != 2 || sp[0].find_first_not_of("0123456789") != std::string::npos ||
+            sp[1].find_first_not_of("0123456789") != std::string::npos) throw std::invalid_argument(spec);
+        ret.index = std::stoul(sp[0]);
+        ret.count = std::stoul(sp[1]);
+    } catch (std::logic_error &) {
+        throw std::invalid_argument("Invalid shard \"" + spec + "\", expected i/N.");
+    }
+    if (ret.count == 0 || ret.index >= ret.count) {
+        throw std::invalid_argument("Invalid shard \"" + spec + "\", i should be from 0 to N-1.");
+    }
+    return ret;
+}
+
+bool Shard::take_option(std::string &cl, Shard &shard) {
+    const std::string opt = "--shard";
+    for (size_t pos = cl.find(opt); pos != std::string::npos; pos = cl.find(opt, pos + 1)) {
+        if (pos > 0 && cl[pos - 1] != ' ') continue;
+        size_t beg = pos + opt.length();
+        if (beg >= cl.length() || (cl[beg] != ' ' && cl[beg] != '=')) continue;
+        beg = cl.find_first_not_of(" =", beg);
+        if (beg == std::string::npos) return false;
+        size_t end = cl.find(' ', beg);
+        if (end == std::string::npos) end = cl.length();
+        shard = parse(cl.substr(beg, end - beg));
+        const size_t next = cl.find_first_not_of(' ', end);
+        cl.erase(pos, next == std::string::npos ? std::string::npos : next - pos);
+        return true;
+    }
+    return false;
+}
+
+ReadStream::ReadStream(const std::string &file, ReadFmt fmt, bool p64) : _fmt(fmt), _p64(p64) {
+    if (fmt == ReadFmt::SAM && vargas::SAM::hts_format(file)) {
+        _sam.open(file);
+    } else if (fmt == ReadFmt::SAM) {
+        _batch.reset(new vargas::SAMBatchReader(file));
     } else {
-        std::ifstream in(file);
-        if (!in.good()) throw std::invalid_argument("Unable to open file \"" + file + "\"");
-        std::stringstream ss;
-        ss << in.rdbuf();
-        input = ss.str();
+        _fastx.reset(new vargas::ifastx(file));
     }
-    const auto lines = rg::split(input, '\n');
+}
+
+bool ReadStream::next(vargas::SAM::Record &rec) {
+    if (_shard.all()) return _read(rec, true);
+    for (;;) {
+        const size_t index = _records++;
+        const bool keep = _shard.keep(index);
+        if (!_read(rec, keep)) return false;
+        if (!keep) continue;
+        rec.aux.set(ALIGN_SAM_READ_INDEX_TAG, index);
+        return true;
+    }
+}
 
+bool ReadStream::_read(vargas::SAM::Record &rec, bool convert) {
+    if (_batch) {
+        if (_view == _views.size()) {
+            _view = 0; // Also at the end, where _views is left empty
+            if (!_batch->next(_views, 4096)) return false;
+        }
+        if (convert) _views[_view].to_record(rec);
+        ++_view;
+        return true;
+    }
+    if (_fmt == ReadFmt::SAM) {
+        if (_first) {
+            // isam holds the first record once opened
+            _first = false;
+            rec = _sam.record();
+            return rec.seq.length() > 0;
+        }
+        if (!_sam.next()) return false;
+        rec = _sam.record();
+        return true;
+    }
+
+    return next_fast(*_fastx, rec, _p64);
+}
+
+bool next_fast(vargas::ifastx &in, vargas::SAM::Record &rec, bool p64) {
+    rec = vargas::SAM::Record();
+    if (!in.next(rec.query_name, rec.seq, rec.qual)) return false;
+    if (rec.qual.empty()) rec.qual = "*";
+    else if (p64) std::transform(rec.qual.begin(), rec.qual.end(), rec.qual.begin(), [](char c){return c-31;});
+    return true;
+}
+
+size_t sample_reads(ReadStream &reads, size_t n, uint64_t seed, vargas::isam &ret) {
+    rg::Reservoir<vargas::SAM::Record> sample(n, seed);
+    vargas::SAM::Record rec;
+    while (reads.next(rec)) sample.add(std::move(rec));
+    if (sample.seen() == 0) throw std::invalid_argument("No records available.");
+    auto kept = sample.take();
+    ret.header() = reads.header();
+    // isam pops its buffer from the back
+    for (auto r = kept.rbegin(); r != kept.rend(); ++r) ret.push(std::move(*r));
+    ret.next();
+    return sample.seen();
+}
+
+void load_fast(std::string &file, const bool, vargas::isam &ret, bool p64) {
+    vargas::ifastx in(file);
+    std::vector<vargas::SAM::Record> records;
+    vargas::SAM::Record rec;
+    while (next_fast(in, rec, p64)) records.push_back(std::move(rec));
+    // isam pops its buffer from the back
+    for (auto r = records.rbegin(); r != records.rend(); ++r) ret.push(std::move(*r));
+    ret.next();
+}
+
+/**
+ * @brief
+ * Read only map of a regular file.
+ */
+struct mapped_file {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    explicit mapped_file(const std::string &file) {
+        const int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED) {
+                madvise(m, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char *>(m);
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+
+    ~mapped_file() {
+        if (data) munmap(const_cast<char *>(data), size);
+    }
+};
+
+/**
+ * @return Start of the line after p, or end.
+ */
+static const char *next_line(const char *p, const char *end) {
+    const char *nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    return nl ? nl + 1 : end;
+}
+
+/**
+ * @return [p, line end) without the newline or a trailing '\r'.
+ */
+static rg::StrRef line_at(const char *p, const char *end) {
+    const char *nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    if (!nl) nl = end;
+    if (nl != p && nl[-1] == '\r') --nl;
+    return rg::StrRef(p, nl);
+}
+
+struct parse_helper {
+    const char *beg, *end; // Records, after any SAM header
+    size_t block_size;
+    bool fastq, p64;
+    std::vector<std::vector<vargas::SAM::Record>> blocks;
+    std::vector<std::string> errors; // Per block, non empty if the block could not be parsed
+    std::atomic<bool> failed{false};
+
+    /**
+     * @brief
+     * First record at or after the start of block i. A quality line can start with '@',
+     * but it is never followed two lines later by a '+' line.
+     */
+    const char *block_start(size_t i) const {
+        if (i == 0) return beg;
+        if (i * block_size >= size_t(end - beg)) return end;
+        const char *p = next_line(beg + i * block_size - 1, end);
+        if (!fastq) return p;
+        for (; p < end; p = next_line(p, end)) {
+            if (*p != '@') continue;
+            const char *plus = next_line(next_line(p, end), end);
+            if (plus < end && *plus == '+') return p;
+        }
+        return end;
+    }
+};
+
+/**
+ * @brief
+ * ForPool body, parse block i of a parse_helper.
+ */
+static void parse_block(void *data, long i, int) {
+    parse_helper &help = *(parse_helper *) data;
+    if (help.failed.load(std::memory_order_relaxed)) return;
+    const char *p = help.block_start(i), *e = help.block_start(i + 1);
+    auto &out = help.blocks[i];
     try {
-        for (unsigned i = 0; i < lines.size(); i += (fastq ? 4 : 2)) {
-            vargas::SAM::Record rec;
-            rec.query_name = std::string(lines.at(i).begin() + 1,
-                                         std::find_if(lines.at(i).begin() + 1, lines.at(i).end(), isspace));
-            rec.seq = lines.at(i + 1);
-            if (fastq) rec.qual = lines.at(i + 3);
-            if (p64) std::transform(rec.qual.begin(), rec.qual.end(), rec.qual.begin(), [](char c){return c-31;});
+        vargas::SAM::RecordView view;
+        while (p < e) {
+            const rg::StrRef l = line_at(p, help.end);
+            p = next_line(p, help.end);
+            if (l.empty()) continue;
+            out.emplace_back();
+            vargas::SAM::Record &rec = out.back();
+            if (!help.fastq) {
+                if (!view.parse(l.begin(), l.end())) throw std::invalid_argument("Invalid SAM record: " + l.str());
+                view.to_record(rec);
+                continue;
+            }
+            // Exactly four lines per record, otherwise leave it to the sequential reader
+            const rg::StrRef seq = line_at(p, help.end);
+            const char *plus = next_line(p, help.end), *q = next_line(plus, help.end);
+            const rg::StrRef qual = line_at(q, help.end);
+            p = next_line(q, help.end);
+            if (l[0] != '@' || plus == help.end || *plus != '+' || qual.size() != seq.size() || seq.empty()) {
+                help.errors[i] = "Invalid FASTA/Q file.";
+                help.failed = true;
+                return;
+            }
+            rec.query_name.assign(l.begin() + 1, std::find_if(l.begin() + 1, l.end(), isspace));
+            rec.seq.assign(seq.begin(), seq.end());
+            rec.qual.assign(qual.begin(), qual.end());
+            if (help.p64) std::transform(rec.qual.begin(), rec.qual.end(), rec.qual.begin(), [](char c){return c-31;});
+        }
+    } catch (std::exception &ex) {
+        help.errors[i] = ex.what();
+        help.failed = true;
+    }
+}
 
-            ret.push(rec);
+bool load_parallel(const std::string &file, ReadFmt fmt, vargas::isam &ret, bool p64, int threads,
+                   size_t block_size) {
+    if (fmt == ReadFmt::FASTA || file.empty() || vargas::SAM::hts_format(file)) return false;
+    mapped_file map(file);
+    if (!map.data) return false;
+    if (map.size >= 2 && uint8_t(map.data[0]) == 0x1f && uint8_t(map.data[1]) == 0x8b) return false; // gzip
+
+    parse_helper help;
+    help.beg = map.data;
+    help.end = map.data + map.size;
+    help.fastq = fmt == ReadFmt::FASTQ;
+    help.p64 = p64;
+
+    std::string hdr;
+    if (!help.fastq) {
+        while (help.beg < help.end && *help.beg == '@') {
+            const rg::StrRef l = line_at(help.beg, help.end);
+            hdr.append(l.begin(), l.end());
+            hdr += '\n';
+            help.beg = next_line(help.beg, help.end);
         }
-    } catch (std::exception &e) {
-        throw std::runtime_error("Invalid FASTA/Q file.");
+    }
+
+    // Several blocks per thread to even out the work
+    const size_t len = help.end - help.beg;
+    help.block_size = block_size ? block_size : std::max<size_t>(1 << 20, len / (threads * 8) + 1);
+    const size_t nblocks = len ? (len + help.block_size - 1) / help.block_size : 0;
+    help.blocks.resize(nblocks);
+    help.errors.resize(nblocks);
+    {
+        rg::ForPool fp(threads);
+        fp.forpool(&parse_block, (void *) &help, nblocks);
+    }
+    if (help.failed) {
+        for (const auto &err : help.errors) {
+            if (err.empty()) continue;
+            if (help.fastq) return false; // Not 4 line FASTQ
+            throw std::invalid_argument(err);
+        }
+    }
+
+    if (hdr.length()) ret.header() << hdr;
+    // isam pops its buffer from the back
+    for (auto b = help.blocks.rbegin(); b != help.blocks.rend(); ++b) {
+        for (auto r = b->rbegin(); r != b->rend(); ++r) ret.push(std::move(*r));
+        std::vector<vargas::SAM::Record>().swap(*b);
     }
     ret.next();
+    return true;
 }
 
 void align_help(const cxxopts::Options &opts) {
@@ -749,17 +1614,41 @@ void align_help(const cxxopts::Options &opts) {
 }
 
 ReadFmt read_fmt(const std::string& filename) {
-    std::ifstream in(filename);
-    if (!in.good()) throw std::invalid_argument("Invalid read file: " + filename);
-
+    if (vargas::SAM::hts_format(filename)) return ReadFmt::SAM;
+    // Read through BGZF so compressed FASTA/Q is detected by its content
+    BGZF *in = bgzf_open(filename.c_str(), "r");
+    if (!in) throw std::invalid_argument("Invalid read file: " + filename);
+    kstring_t ks = {0, 0, nullptr};
     std::string line;
-    if (!std::getline(in, line)) throw std::invalid_argument("Empty Read File."); // @SAM or fasta/q name
-    if (line.substr(0,3) == "@HD") return ReadFmt::SAM;
-    if (!std::getline(in, line)) throw std::invalid_argument("Invalid Read File."); // SAM comment/header, or read
-    if (!std::getline(in, line)) return ReadFmt::FASTA; // Single record fasta, or SAM line, or +, or name
-    if (!line.empty() && line[0] == '+') return ReadFmt::FASTQ;
-    if (!line.empty() && (line[0] == '>' || line[0] == '@')) return ReadFmt::FASTA;
-    return ReadFmt::SAM;
+    const auto getline = [&]() {
+        if (bgzf_getline(in, '\n', &ks) < 0) return false;
+        line.assign(ks.s, ks.l);
+        return true;
+    };
+
+    ReadFmt ret = ReadFmt::SAM;
+    try {
+        if (!getline()) throw std::invalid_argument("Empty Read File."); // @SAM or fasta/q name
+        if (line.empty() || (line[0] != '>' && line[0] != '@')) ret = ReadFmt::SAM; // SAM without a header
+        else if (line.substr(0, 3) == "@HD" || (line.length() > 3 && line[0] == '@' && line[3] == '\t')) {
+            ret = ReadFmt::SAM; // SAM header line
+        } else {
+            // Sequence lines up to a '+' line in FASTQ, or the next record in FASTA
+            ret = ReadFmt::FASTA;
+            while (getline()) {
+                if (line.empty()) continue;
+                if (line[0] == '+') ret = ReadFmt::FASTQ;
+                if (line[0] == '+' || line[0] == '>' || line[0] == '@') break;
+            }
+        }
+    } catch (...) {
+        free(ks.s);
+        bgzf_close(in);
+        throw;
+    }
+    free(ks.s);
+    bgzf_close(in);
+    return ret;
 }
 
 TEST_SUITE("System");
@@ -789,12 +1678,476 @@ TEST_CASE ("Load FASTA") {
     vargas::isam ss;
     load_fast(tmpfq, false, ss);
 
-    CHECK(ss.record().query_name == "x");
-    CHECK(ss.record().seq == "GGGGGTTTTT");
-    ss.next();
-
     CHECK(ss.record().query_name == "name");
     CHECK(ss.record().seq == "AAAAACCCCC");
+    ss.next();
+
+    CHECK(ss.record().query_name == "x");
+    CHECK(ss.record().seq == "GGGGGTTTTT");
     CHECK_FALSE(ss.next());
     remove(tmpfq.c_str());
 }
+TEST_CASE ("Stream reads") {
+    std::string tmpfq = "tmp_fastq.va";
+    vargas::SAM::Record rec;
+    {
+        std::ofstream o(tmpfq);
+        o << "@a desc\nAAAAACCCCC\n+\n!!!!!!!!!!\n@b\nGGGGG\n+b\n#####\n";
+    }
+    {
+        ReadStream rs(tmpfq, ReadFmt::FASTQ, false);
+        REQUIRE(rs.next(rec));
+        CHECK(rec.query_name == "a");
+        CHECK(rec.seq == "AAAAACCCCC");
+        CHECK(rec.qual == "!!!!!!!!!!");
+        REQUIRE(rs.next(rec));
+        CHECK(rec.query_name == "b");
+        CHECK(rec.qual == "#####");
+        CHECK_FALSE(rs.next(rec));
+    }
+    {
+        std::ofstream o(tmpfq);
+        o << ">a desc\nAAAAA\nCCCCC\n\n>b\nGGGGGTTTTT";
+    }
+    {
+        ReadStream rs(tmpfq, ReadFmt::FASTA, false);
+        REQUIRE(rs.next(rec));
+        CHECK(rec.query_name == "a");
+        CHECK(rec.seq == "AAAAACCCCC");
+        REQUIRE(rs.next(rec));
+        CHECK(rec.query_name == "b");
+        CHECK(rec.seq == "GGGGGTTTTT");
+        CHECK(rec.qual == "*");
+        CHECK_FALSE(rs.next(rec));
+    }
+    {
+        const std::string fq = "@a\nACGT\nAC\n+\nIIII\nII\n@b\nGG\n+\nhh\n";
+        BGZF *gz = bgzf_open(tmpfq.c_str(), "w");
+        REQUIRE(gz);
+        bgzf_write(gz, fq.data(), fq.size());
+        bgzf_close(gz);
+    }
+    {
+        CHECK(read_fmt(tmpfq) == ReadFmt::FASTQ);
+        ReadStream rs(tmpfq, ReadFmt::FASTQ, true);
+        REQUIRE(rs.next(rec));
+        CHECK(rec.query_name == "a");
+        CHECK(rec.seq == "ACGTAC");
+        CHECK(rec.qual == "******");
+        REQUIRE(rs.next(rec));
+        CHECK(rec.qual == "II");
+        CHECK_FALSE(rs.next(rec));
+    }
+    remove(tmpfq.c_str());
+}
+
+TEST_CASE ("Parallel load") {
+    std::string tmp = "tmp_par.va";
+    // Block sizes down to a few bytes put boundaries inside records and on '@' quality lines
+    SUBCASE("FASTQ") {
+        {
+            std::ofstream o(tmp);
+            for (int i = 0; i < 200; ++i) {
+                o << "@r" << i << " desc\n" << std::string(1 + i % 7, "ACGT"[i % 4]) << "\n+\n"
+                  << std::string(1 + i % 7, i % 3 ? '@' : 'I') << "\n";
+            }
+        }
+        for (size_t block : {0, 3, 17, 64, 1000}) {
+            vargas::isam seq, par;
+            load_fast(tmp, true, seq);
+            REQUIRE(load_parallel(tmp, ReadFmt::FASTQ, par, false, 4, block));
+            size_t n = 0;
+            do {
+                ++n;
+                CHECK(par.record().query_name == seq.record().query_name);
+                CHECK(par.record().seq == seq.record().seq);
+                CHECK(par.record().qual == seq.record().qual);
+                seq.next();
+            } while (par.next());
+            CHECK(n == 200);
+        }
+    }
+
+    SUBCASE("Multi-line FASTQ falls back") {
+        {
+            std::ofstream o(tmp);
+            o << "@a\nAC\nGT\n+\nII\nII\n";
+        }
+        vargas::isam par;
+        CHECK_FALSE(load_parallel(tmp, ReadFmt::FASTQ, par, false, 2, 4));
+    }
+
+    SUBCASE("SAM") {
+        {
+            std::ofstream o(tmp);
+            o << "@HD\tVN:1.0\n@RG\tID:g1\tSM:s\n";
+            for (int i = 0; i < 100; ++i) {
+                o << "r" << i << "\t0\t*\t" << i << "\t255\t*\t*\t0\t0\tACGT\t*\tRG:Z:g1\n";
+            }
+        }
+        vargas::isam par;
+        REQUIRE(load_parallel(tmp, ReadFmt::SAM, par, false, 4, 50));
+        CHECK(par.header().read_groups.count("g1") == 1);
+        int n = 0;
+        do {
+            CHECK(par.record().query_name == "r" + std::to_string(n));
+            CHECK(par.record().pos == n);
+            ++n;
+        } while (par.next());
+        CHECK(n == 100);
+    }
+    remove(tmp.c_str());
+}
+
+TEST_CASE ("Shard") {
+    CHECK(Shard::parse("2/3").index == 2);
+    CHECK(Shard::parse("2/3").count == 3);
+    CHECK_THROWS(Shard::parse("3/3"));
+    CHECK_THROWS(Shard::parse("0/0"));
+    CHECK_THROWS(Shard::parse("1"));
+    CHECK_THROWS(Shard::parse("-1/2"));
+    CHECK_THROWS(Shard::parse("a/2"));
+
+    SUBCASE("Command line") {
+        Shard shard;
+        std::string cl = "vargas align -g g.gdef --shard 1/4 -U r.fq ";
+        REQUIRE(Shard::take_option(cl, shard));
+        CHECK(cl == "vargas align -g g.gdef -U r.fq ");
+        CHECK(shard.index == 1);
+        CHECK(shard.count == 4);
+        cl = "vargas align --shard=3/4";
+        REQUIRE(Shard::take_option(cl, shard));
+        CHECK(cl == "vargas align ");
+        CHECK(shard.index == 3);
+        cl = "vargas align --shards 1/2 -S x--shard ";
+        CHECK_FALSE(Shard::take_option(cl, shard));
+    }
+
+    SUBCASE("Reads") {
+        std::string tmp = "tmp_shard.va";
+        {
+            std::ofstream o(tmp);
+            for (int i = 0; i < 100; ++i) o << "@r" << i << "\nACGT\n+\nIIII\n";
+        }
+        ReadStream stream(tmp, ReadFmt::FASTQ, false);
+        stream.set_shard(Shard::parse("1/3"));
+        vargas::SAM::Record rec;
+        std::vector<int> names;
+        int index = -1;
+        while (stream.next(rec)) {
+            names.push_back(std::stoi(rec.query_name.substr(1)));
+            REQUIRE(rec.aux.get(ALIGN_SAM_READ_INDEX_TAG, index));
+            CHECK(index == names.back());
+        }
+        REQUIRE(names.size() == 33);
+        CHECK(names.front() == 1);
+        CHECK(names.back() == 97);
+
+        remove(tmp.c_str());
+    }
+}
+
+TEST_CASE ("Sample reads") {
+    std::string tmp = "tmp_sample.va";
+    {
+        std::ofstream o(tmp);
+        for (int i = 0; i < 100; ++i) o << "@r" << i << "\nACGT\n+\nIIII\n";
+    }
+    std::vector<std::string> first;
+    for (int rep = 0; rep < 2; ++rep) {
+        ReadStream rs(tmp, ReadFmt::FASTQ, false);
+        vargas::isam sample;
+        CHECK(sample_reads(rs, 10, 3, sample) == 100);
+        std::vector<std::string> names;
+        do { names.push_back(sample.record().query_name); } while (sample.next());
+        CHECK(names.size() == 10);
+        // Input order
+        for (size_t i = 1; i < names.size(); ++i) CHECK(std::stoi(names[i - 1].substr(1)) < std::stoi(names[i].substr(1)));
+        if (rep == 0) first = names;
+        else CHECK(names == first);
+    }
+    remove(tmp.c_str());
+}
+
+TEST_CASE ("Async writer") {
+    std::string out;
+    std::vector<std::thread> threads;
+    {
+        rg::AsyncWriter writer([&out](const std::string &buf) { out += buf; }, 4, 64);
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&writer, t]() {
+                for (int i = 0; i < 1000; ++i) writer.push(std::to_string(t) + ":" + std::to_string(i) + "\n");
+            });
+        }
+        for (auto &t : threads) t.join();
+        writer.close();
+        CHECK(writer.stats().buffers == 4000);
+        CHECK(writer.stats().bytes == out.size());
+    }
+    auto lines = rg::split(out, '\n');
+    CHECK(lines.size() == 4000);
+    std::sort(lines.begin(), lines.end());
+    CHECK(std::unique(lines.begin(), lines.end()) == lines.end());
+}
+
+TEST_CASE ("Reorder buffer") {
+    std::string out;
+    size_t max_held;
+    {
+        rg::AsyncWriter writer([&out](const std::string &buf) { out += buf; }, 4, 64);
+        rg::ReorderBuffer reorder(writer, 8);
+        rg::ForPool fp(4);
+        fp.forpool([](void *data, long i, int) {
+            if (i % 7 == 0) std::this_thread::sleep_for(std::chrono::microseconds(200)); // Finish out of order
+            ((rg::ReorderBuffer *) data)->put(i, std::to_string(i) + "\n");
+        }, &reorder, 2000);
+        CHECK(reorder.written() == 2000);
+        max_held = reorder.stats().max_held;
+    }
+    CHECK(max_held <= 8);
+    const auto lines = rg::split(out, '\n');
+    REQUIRE(lines.size() == 2000);
+    for (size_t i = 0; i < lines.size(); ++i) CHECK(lines[i] == std::to_string(i));
+}
+
+TEST_CASE ("Task scheduler") {
+    struct run_log {
+        std::mutex mut;
+        std::vector<long> order;
+    } log;
+    auto body = [](void *data, long i, int) {
+        run_log &l = *(run_log *) data;
+        std::this_thread::sleep_for(std::chrono::microseconds(i < 4 ? 400 : 100)); // Group a is slow
+        std::lock_guard<std::mutex> lock(l.mut);
+        l.order.push_back(i);
+    };
+    const std::vector<std::string> groups{"a", "a", "a", "a", "b", "b", "b", "b"};
+    const std::vector<double> units{1, 4, 2, 3, 10, 40, 20, 30};
+    rg::ForPool fp(1);
+    rg::TaskScheduler sched(1);
+    CHECK(sched.rate("a") == 0);
+
+    SUBCASE("Largest first") {
+        sched.run(fp, groups, units, rg::TaskScheduler::Order::COST, body, &log);
+        // Before any rate is measured b looks 10x larger; then a turns out to be 40x slower per unit
+        REQUIRE(log.order.size() == 8);
+        CHECK(log.order[0] == 5);
+        CHECK(sched.rate("a") > sched.rate("b"));
+        CHECK(sched.stats().tasks == 8);
+        CHECK(sched.stats().busy.size() == 1);
+        CHECK(sched.stats().busy[0] <= sched.stats().wall);
+
+        // Measured rates carry over, so the slow group goes first
+        log.order.clear();
+        sched.run(fp, groups, units, rg::TaskScheduler::Order::COST, body, &log);
+        REQUIRE(log.order.size() == 8);
+        CHECK(log.order[0] == 1);
+        CHECK(sched.stats().tasks == 16);
+    }
+
+    SUBCASE("In order") {
+        log.order.clear();
+        sched.run(fp, groups, units, rg::TaskScheduler::Order::INDEX, body, &log);
+        CHECK(log.order == std::vector<long>{0, 1, 2, 3, 4, 5, 6, 7});
+        CHECK(sched.stats().switches == 1);
+    }
+
+    SUBCASE("Affinity") {
+        // Groups interleaved: a thread finishes one group, largest task first, before the next
+        const std::vector<std::string> mixed{"a", "b", "a", "b", "a", "b", "a", "b"};
+        sched.run(fp, mixed, units, rg::TaskScheduler::Order::AFFINITY, body, &log);
+        CHECK(log.order == std::vector<long>{5, 7, 1, 3, 6, 4, 2, 0});
+        CHECK(sched.stats().switches == 1);
+
+        // Switches carry over between runs
+        log.order.clear();
+        sched.run(fp, groups, units, rg::TaskScheduler::Order::INDEX, body, &log);
+        CHECK(sched.stats().switches == 2);
+    }
+}
+
+TEST_CASE ("NUMA topology") {
+    CHECK(rg::NumaTopology::parse_cpulist("0-3,8,10-11\n") == std::vector<int>{0, 1, 2, 3, 8, 10, 11});
+    CHECK(rg::NumaTopology::parse_cpulist("").empty());
+    CHECK_THROWS(rg::NumaTopology::parse_cpulist("3-1"));
+    CHECK_THROWS(rg::NumaTopology::parse_cpulist("a"));
+
+    CHECK(rg::NumaTopology::detect("tmp_no_such_dir").size() == 0);
+
+    // Fake sysfs with two nodes holding the allowed CPUs, and one CPU-less node
+    auto allowed = rg::NumaTopology::allowed_cpus();
+#ifdef __linux__
+    REQUIRE(!allowed.empty());
+#else
+    // Affinity is unknown, every CPU is kept
+    CHECK(allowed.empty());
+    allowed = {0, 1};
+#endif
+    const std::string root = "tmp_numa";
+    mkdir(root.c_str(), 0755);
+    const std::vector<std::string> lists{std::to_string(allowed[0]), "", std::to_string(allowed.back()) + ",100000"};
+    for (size_t n = 0; n < lists.size(); ++n) {
+        const std::string dir = root + "/node" + std::to_string(n * 2);
+        mkdir(dir.c_str(), 0755);
+        std::ofstream(dir + "/cpulist") << lists[n] << "\n";
+    }
+    mkdir((root + "/nodes_other").c_str(), 0755);
+
+    const auto topo = rg::NumaTopology::detect(root);
+    REQUIRE(topo.size() == 2);
+    CHECK(topo.id(0) == 0);
+    CHECK(topo.id(1) == 4);
+    CHECK(topo.cpus(0) == std::vector<int>{allowed[0]});
+#ifdef __linux__
+    CHECK(topo.cpus(1) == std::vector<int>{allowed.back()});
+    std::thread t([&topo]() { CHECK(topo.pin(1)); });
+    t.join();
+#else
+    CHECK(topo.cpus(1) == std::vector<int>{allowed.back(), 100000});
+    CHECK_FALSE(topo.pin(1));
+#endif
+
+    {
+        // One thread runs on the calling thread, which is not pinned
+        const auto before = rg::NumaTopology::allowed_cpus();
+        std::ofstream("tmp_numa.vgraph") << "@vgraph\n\n@contigs\n0\tx\n\n@graphs\nbase\t0\t\n\n@nodes\n"
+                                         << "0\t4\t1.0\t1\t4\t1\nACGT\n";
+        NumaPlacement place(topo, 1, "tmp_numa.vgraph");
+        CHECK(place.node_of(0) == 0);
+        CHECK(rg::NumaTopology::allowed_cpus() == before);
+        remove("tmp_numa.vgraph");
+    }
+
+    for (size_t n = 0; n < lists.size(); ++n) {
+        const std::string dir = root + "/node" + std::to_string(n * 2);
+        remove((dir + "/cpulist").c_str());
+        rmdir(dir.c_str());
+    }
+    rmdir((root + "/nodes_other").c_str());
+    rmdir(root.c_str());
+}
+
+TEST_CASE ("Split output") {
+    vargas::SAM::Header h1, h2;
+    h1.add(vargas::SAM::Header::ReadGroup("@RG\tID:a"));
+    h1.add(vargas::SAM::Header::ReadGroup("@RG\tID:b"));
+    h2.add(vargas::SAM::Header::ReadGroup("@RG\tID:c"));
+    std::vector<vargas::SAM::Record> r1(3), r2(2);
+    for (size_t i = 0; i < r1.size(); ++i) {
+        r1[i].query_name = "x" + std::to_string(i);
+        r1[i].aux.set("RG", i == 1 ? "b" : "a");
+    }
+    for (size_t i = 0; i < r2.size(); ++i) r2[i].query_name = "y" + std::to_string(i); // Ungrouped
+
+    // Records of each output, header lines skipped
+    auto records = [](const std::string &file) {
+        std::ifstream in(file);
+        std::vector<std::string> ret;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line[0] != '@') ret.push_back(line.substr(0, line.find('\t')));
+        }
+        remove(file.c_str());
+        return ret;
+    };
+
+    SUBCASE("File") {
+        CHECK_THROWS(AlignOutput(AlignOutput::Split::FILE, "tmp_split.sam", {"d/in1.fq", "in2.sam"}, {h1, h2},
+                                 nullptr));
+        CHECK_THROWS(AlignOutput(AlignOutput::Split::FILE, "tmp_split_%.sam", {"d/in.fq", "in.sam"}, {h1, h2},
+                                 nullptr));
+        {
+            AlignOutput out(AlignOutput::Split::FILE, "tmp_split_%.sam", {"d/in1.fq.gz", "in2.sam"}, {h1, h2},
+                            nullptr);
+            out.push(0, 0, r1);
+            out.push(1, 1, r2);
+            out.close();
+        }
+        CHECK(records("tmp_split_in1.sam") == std::vector<std::string>{"x0", "x1", "x2"});
+        CHECK(records("tmp_split_in2.sam") == std::vector<std::string>{"y0", "y1"});
+    }
+
+    SUBCASE("Read group") {
+        {
+            AlignOutput out(AlignOutput::Split::READ_GROUP, "tmp_split_%.sam", {"in1.fq", "in2.sam"}, {h1, h2},
+                            nullptr);
+            out.push(0, 0, r1);
+            out.push(1, 1, r2);
+            out.close();
+        }
+        CHECK(records("tmp_split_a.sam") == std::vector<std::string>{"x0", "x2"});
+        CHECK(records("tmp_split_b.sam") == std::vector<std::string>{"x1"});
+        CHECK(records("tmp_split_" + std::string(UNGROUPED_READGROUP) + ".sam") == std::vector<std::string>{"y0", "y1"});
+    }
+}
+
+TEST_CASE ("Stream ordered output") {
+    {
+        std::ofstream o("tmp_stream.vgraph");
+        o << "@vgraph\n\n@contigs\n0\tx\n\n@graphs\nbase\t0\t\nsub\t0\t\n\n@nodes\n"
+          << "0\t40\t1.0\t1\t40\t1\nACGTTGCAAGGCTTACCGATGCATCGGATCCAGTTGACAT\n";
+    }
+    {
+        std::ofstream o("tmp_stream.fq");
+        const std::string ref = "ACGTTGCAAGGCTTACCGATGCATCGGATCCAGTTGACAT";
+        for (int i = 0; i < 100; ++i) o << "@r" << i << "\n" << ref.substr(i % 28, 12) << "\n+\n" << std::string(12, 'I') << "\n";
+    }
+    vargas::GraphMan gm("tmp_stream.vgraph");
+    vargas::ScoreProfile prof;
+    std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> aligners;
+    for (int k = 0; k < 2; ++k) aligners.push_back(make_aligner(prof, 12, false, false, false));
+
+    ReadStream reads("tmp_stream.fq", ReadFmt::FASTQ, false);
+    {
+        vargas::SAM::Header hdr;
+        vargas::osam sam("tmp_stream.sam", hdr);
+        // A reorder window must not hold back stream tasks
+        AlignOutput out(sam, 4);
+        REQUIRE(out.ordered());
+        CHECK(align_stream(gm, {&reads}, "", out, aligners, prof, 12, 4, 2, false, false, false, false, 33) == 100);
+    }
+
+    std::ifstream in("tmp_stream.sam");
+    std::string line;
+    int n = 0;
+    while (std::getline(in, line)) {
+        if (line[0] == '@') continue;
+        CHECK(line.substr(0, line.find('\t')) == "r" + std::to_string(n));
+        ++n;
+    }
+    CHECK(n == 100);
+
+    // A shard is written in read order, although the tasks of a batch are grouped by target
+    {
+        std::ofstream o("tmp_stream_rg.sam");
+        const std::string ref = "ACGTTGCAAGGCTTACCGATGCATCGGATCCAGTTGACAT";
+        o << "@RG\tID:a\n@RG\tID:b\n";
+        for (int i = 0; i < 100; ++i) {
+            o << "r" << i << "\t4\t*\t0\t0\t*\t*\t0\t0\t" << ref.substr(i % 28, 12) << "\t" << std::string(12, 'I')
+              << "\tRG:Z:" << (i % 3 ? "a" : "b") << "\n";
+        }
+    }
+    ReadStream rg_reads("tmp_stream_rg.sam", ReadFmt::SAM, false);
+    rg_reads.set_shard(Shard::parse("1/2"));
+    {
+        vargas::osam sam("tmp_stream.sam", rg_reads.header());
+        AlignOutput out(sam);
+        CHECK(align_stream(gm, {&rg_reads}, "RG:ID:a,base;RG:ID:b,sub", out, aligners, prof, 12, 4, 2, false, false,
+                           false, false, 33) == 50);
+    }
+    vargas::isam sharded("tmp_stream.sam");
+    n = 0;
+    do {
+        size_t index = 0;
+        REQUIRE(sharded.record().aux.get(ALIGN_SAM_READ_INDEX_TAG, index));
+        CHECK(index == size_t(2 * n + 1));
+        CHECK(sharded.record().query_name == "r" + std::to_string(index));
+        ++n;
+    } while (sharded.next());
+    CHECK(n == 50);
+
+    remove("tmp_stream.vgraph");
+    remove("tmp_stream.fq");
+    remove("tmp_stream.sam");
+    remove("tmp_stream_rg.sam");
+}
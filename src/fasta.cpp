@@ -17,6 +17,44 @@
 #include "fasta.h"
 #include "doctest.h"
 
+#include <cctype>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char VARGAS_2BIT_MAGIC[] = "V2B1";
+
+template<typename T>
+static inline void twobit_put(std::ostream &os, const T &val) {
+    os.write(reinterpret_cast<const char *>(&val), sizeof(T));
+}
+
+template<typename T>
+static inline T twobit_take(const uint8_t *&p, const uint8_t *end) {
+    if (p + sizeof(T) > end) throw std::invalid_argument("Truncated 2-bit reference.");
+    T ret;
+    std::memcpy(&ret, p, sizeof(T));
+    p += sizeof(T);
+    return ret;
+}
+
+/**
+ * @brief
+ * Runs of positions satisfying pred, as <beg, len>
+ */
+template<typename Pred>
+static std::vector<std::pair<rg::pos_t, rg::pos_t>> twobit_runs(const std::string &seq, Pred pred) {
+    std::vector<std::pair<rg::pos_t, rg::pos_t>> ret;
+    for (rg::pos_t i = 0; i < seq.length(); ++i) {
+        if (!pred(seq[i])) continue;
+        if (!ret.empty() && ret.back().first + ret.back().second == i) ++ret.back().second;
+        else ret.emplace_back(i, 1);
+    }
+    return ret;
+}
+
 void vargas::ofasta::open(const std::string& file_name) {
     close();
     if (file_name.length() == 0) {
@@ -37,7 +75,32 @@ void vargas::ofasta::write(const std::string &name, const std::string &sequence)
     }
 }
 
+void vargas::ifasta::close() {
+    if (_index != nullptr) {
+        fai_destroy(_index);
+    }
+    _index = nullptr;
+    if (_map != nullptr) {
+        munmap(const_cast<uint8_t *>(_map), _map_len);
+    }
+    _map = nullptr;
+    _map_len = 0;
+    _tb_seqs.clear();
+    _tb_names.clear();
+    _resident.clear();
+    _resident.shrink_to_fit();
+    _resident_name.clear();
+}
+
 int vargas::ifasta::open(const std::string &file_name) {
+    close();
+    {
+        std::ifstream in(file_name, std::ios::binary);
+        char magic[4] = {0};
+        in.read(magic, 4);
+        if (in.good() && std::strncmp(magic, VARGAS_2BIT_MAGIC, 4) == 0) return _open_2bit(file_name);
+    }
+
     // Check if a Fasta index exists. If it doesn't build it.
     if (!rg::file_exists(file_name + ".fai")) {
         if (fai_build(file_name.c_str()) != 0) {
@@ -55,17 +118,149 @@ int vargas::ifasta::open(const std::string &file_name) {
     return 0;
 }
 
+int vargas::ifasta::_open_2bit(const std::string &file_name) {
+    const int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) return -2;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 4 + 8) {
+        ::close(fd);
+        return -2;
+    }
+    void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) return -2;
+    _map = static_cast<const uint8_t *>(m);
+    _map_len = st.st_size;
+    _file_name = file_name;
+
+    const uint8_t *end = _map + _map_len;
+    const uint8_t *p = end - 8;
+    const auto table = twobit_take<uint64_t>(p, end);
+    if (table < 4 || table >= _map_len - 8) throw std::invalid_argument("Invalid 2-bit reference: " + file_name);
+    p = _map + table;
+    end -= 8;
+
+    const auto take_runs = [&p, end](std::vector<std::pair<pos_t, pos_t>> &runs) {
+        runs.resize(twobit_take<uint32_t>(p, end));
+        for (auto &r : runs) {
+            r.first = twobit_take<uint32_t>(p, end);
+            r.second = twobit_take<uint32_t>(p, end);
+        }
+    };
+
+    _tb_seqs.resize(twobit_take<uint32_t>(p, end));
+    _seq_names.clear();
+    for (auto &s : _tb_seqs) {
+        s.name.resize(twobit_take<uint32_t>(p, end));
+        for (auto &c : s.name) c = twobit_take<char>(p, end);
+        s.len = twobit_take<uint32_t>(p, end);
+        const auto offset = twobit_take<uint64_t>(p, end);
+        if (offset + (s.len + 3) / 4 > table) throw std::invalid_argument("Invalid 2-bit reference: " + file_name);
+        s.data = _map + offset;
+        take_runs(s.nruns);
+        take_runs(s.masks);
+        _tb_names[s.name] = _seq_names.size();
+        _seq_names.push_back(s.name);
+    }
+    return 0;
+}
+
+const vargas::ifasta::twobit_seq &vargas::ifasta::_tb_seq(const std::string &name) const {
+    const auto f = _tb_names.find(name);
+    if (f == _tb_names.end()) throw std::invalid_argument("Sequence \"" + name + "\" does not exist.");
+    return _tb_seqs[f->second];
+}
+
+void vargas::ifasta::_tb_decode(const twobit_seq &s, pos_t beg, pos_t end, rg::Base *out) const {
+    for (pos_t i = beg; i <= end; ++i) {
+        *out++ = rg::Base(((s.data[i >> 2] >> ((i & 3) << 1)) & 3) + 1);
+    }
+    out -= end - beg + 1;
+    // First run that ends after beg
+    auto r = std::upper_bound(s.nruns.begin(), s.nruns.end(), beg,
+                              [](pos_t p, const std::pair<pos_t, pos_t> &run) { return p < run.first + run.second; });
+    for (; r != s.nruns.end() && r->first <= end; ++r) {
+        const pos_t b = std::max(beg, r->first), e = std::min(end, r->first + r->second - 1);
+        std::fill(out + (b - beg), out + (e - beg + 1), rg::Base::N);
+    }
+}
+
+void vargas::ifasta::write_2bit(const std::string &file_name) const {
+    if (!good()) throw std::invalid_argument("No file loaded.");
+    std::ofstream out(file_name, std::ios::binary);
+    if (!out.good()) throw std::invalid_argument("Error opening file \"" + file_name + "\"");
+    out.write(VARGAS_2BIT_MAGIC, 4);
+
+    std::vector<uint64_t> offsets;
+    std::vector<std::vector<std::pair<pos_t, pos_t>>> nruns, masks;
+    std::vector<uint8_t> packed;
+    for (const auto &name : _seq_names) {
+        const std::string s = seq(name);
+        offsets.push_back(out.tellp());
+        nruns.push_back(twobit_runs(s, [](char c) { return rg::base_to_num(c) == rg::Base::N; }));
+        masks.push_back(twobit_runs(s, [](char c) { return c >= 'a' && c <= 'z'; }));
+        packed.assign((s.length() + 3) / 4, 0);
+        for (size_t i = 0; i < s.length(); ++i) {
+            const auto b = rg::base_to_num(s[i]);
+            if (b != rg::Base::N) packed[i >> 2] |= (b - 1) << ((i & 3) << 1);
+        }
+        out.write(reinterpret_cast<const char *>(packed.data()), packed.size());
+    }
+
+    const uint64_t table = out.tellp();
+    const auto put_runs = [&out](const std::vector<std::pair<pos_t, pos_t>> &runs) {
+        twobit_put<uint32_t>(out, runs.size());
+        for (const auto &r : runs) {
+            twobit_put<uint32_t>(out, r.first);
+            twobit_put<uint32_t>(out, r.second);
+        }
+    };
+    twobit_put<uint32_t>(out, _seq_names.size());
+    for (size_t i = 0; i < _seq_names.size(); ++i) {
+        twobit_put<uint32_t>(out, _seq_names[i].length());
+        out.write(_seq_names[i].data(), _seq_names[i].length());
+        twobit_put<uint32_t>(out, seq_len(_seq_names[i]));
+        twobit_put<uint64_t>(out, offsets[i]);
+        put_runs(nruns[i]);
+        put_runs(masks[i]);
+    }
+    twobit_put<uint64_t>(out, table);
+    if (!out.good()) throw std::invalid_argument("Error writing file \"" + file_name + "\"");
+}
+
 std::vector<std::pair<std::string, std::string>> vargas::ifasta::sequences() const {
-    if (!_index) throw std::invalid_argument("No file loaded.");
+    if (!good()) throw std::invalid_argument("No file loaded.");
     std::vector<std::pair<std::string, std::string>> ret;
-    for (size_t i = 0; i < num_seq(); ++i) {
-        std::string name = std::string(faidx_iseq(_index, i));
+    for (const auto &name : _seq_names) {
         ret.emplace_back(name, seq(name));
     }
     return ret;
 }
 
 std::string vargas::ifasta::subseq(const std::string &name, pos_t beg, pos_t end) const {
+    if (_is_resident(name, beg, end)) {
+        std::string ret(end - beg + 1, 'N');
+        std::transform(_resident.begin() + (beg - _resident_beg), _resident.begin() + (end - _resident_beg + 1),
+                       ret.begin(), rg::num_to_base);
+        return ret;
+    }
+    if (is_2bit()) {
+        const auto &s = _tb_seq(name);
+        if (s.len == 0 || beg >= s.len) return "";
+        end = std::min(end, s.len - 1);
+        if (end < beg) return "";
+        std::vector<rg::Base> num(end - beg + 1);
+        _tb_decode(s, beg, end, num.data());
+        std::string ret(num.size(), 'N');
+        std::transform(num.begin(), num.end(), ret.begin(), rg::num_to_base);
+        auto r = std::upper_bound(s.masks.begin(), s.masks.end(), beg,
+                                  [](pos_t p, const std::pair<pos_t, pos_t> &run) { return p < run.first + run.second; });
+        for (; r != s.masks.end() && r->first <= end; ++r) {
+            const pos_t b = std::max(beg, r->first), e = std::min(end, r->first + r->second - 1);
+            std::transform(ret.begin() + (b - beg), ret.begin() + (e - beg + 1), ret.begin() + (b - beg), ::tolower);
+        }
+        return ret;
+    }
     int len;
     char *ss = faidx_fetch_seq(_index, name.c_str(), beg, end, &len);
     if (len < 0) {
@@ -77,11 +272,126 @@ std::string vargas::ifasta::subseq(const std::string &name, pos_t beg, pos_t end
     return ret;
 }
 
+void vargas::ifasta::load(const std::string &name, pos_t beg, pos_t end) {
+    if (!good()) throw std::invalid_argument("No file loaded.");
+    const int seq_len = is_2bit() ? int(_tb_seq(name).len) : faidx_seq_len(_index, name.c_str());
+    if (seq_len < 0) throw std::invalid_argument("Sequence \"" + name + "\" does not exist.");
+    if (end == 0 || end >= pos_t(seq_len)) end = seq_len - 1;
+
+    _resident_name.clear();
+    _resident.clear();
+    if (seq_len == 0 || beg > end) return;
+
+    if (is_2bit()) {
+        _resident.resize(end - beg + 1);
+        _tb_decode(_tb_seq(name), beg, end, _resident.data());
+        _resident_name = name;
+        _resident_beg = beg;
+        return;
+    }
+
+    _resident.reserve(end - beg + 1);
+
+    // Fetch in chunks so the text and the encoded copy are never both fully in memory
+    constexpr pos_t chunk = 1 << 24;
+    for (pos_t p = beg; p <= end; p += std::min(chunk, end - p + 1)) {
+        const pos_t last = std::min(end, p + chunk - 1);
+        int len;
+        char *ss = faidx_fetch_seq(_index, name.c_str(), p, last, &len);
+        if (len < 0 || !ss) throw std::invalid_argument("Error reading \"" + name + "\" from " + _file_name);
+        std::transform(ss, ss + len, std::back_inserter(_resident), rg::base_to_num);
+        free(ss);
+        if (last == end) break;
+    }
+    _resident_name = name;
+    _resident_beg = beg;
+}
+
+vargas::ifasta::base_view vargas::ifasta::subseq_num(const std::string &name, pos_t beg, pos_t end) {
+    if (!_is_resident(name, beg, end)) load(name);
+    if (!_is_resident(name, beg, end)) throw std::range_error("Range is outside of sequence \"" + name + "\".");
+    const rg::Base *data = _resident.data() - _resident_beg;
+    return {data + beg, data + end + 1};
+}
+
 std::string vargas::ifasta::seq_name(const size_t i) const {
-    if (i > num_seq()) throw std::range_error("Out of sequence index range.");
+    if (i >= num_seq()) throw std::range_error("Out of sequence index range.");
+    if (is_2bit()) return _tb_seqs[i].name;
     return std::string(faidx_iseq(_index, i));
 }
 
+vargas::ifastx::ifastx(const std::string &file) : _buf(1 << 16) {
+    _fp = bgzf_open(file.empty() ? "-" : file.c_str(), "r");
+    if (!_fp) throw std::invalid_argument("Unable to open file \"" + file + "\"");
+}
+
+void vargas::ifastx::close() {
+    if (_fp) bgzf_close(_fp);
+    _fp = nullptr;
+    _pool.reset();
+}
+
+void vargas::ifastx::set_thread_pool(std::shared_ptr<rg::HtsPool> pool) {
+    if (pool && pool->p_.pool && _fp) bgzf_thread_pool(_fp, pool->p_.pool, 0);
+    _pool = std::move(pool);
+}
+
+bool vargas::ifastx::_fill() {
+    if (_eof || !_fp) return false;
+    const ssize_t n = bgzf_read(_fp, _buf.data(), _buf.size());
+    if (n < 0) throw std::runtime_error("Error reading FASTA/Q file.");
+    _beg = 0;
+    _end = size_t(n);
+    _eof = n == 0;
+    return n > 0;
+}
+
+bool vargas::ifastx::_getline(std::string &s) {
+    bool any = false;
+    while (_beg < _end || _fill()) {
+        any = true;
+        const char *b = _buf.data() + _beg, *e = _buf.data() + _end;
+        const char *nl = static_cast<const char *>(std::memchr(b, '\n', e - b));
+        s.append(b, nl ? nl : e);
+        _beg = (nl ? nl + 1 : e) - _buf.data();
+        if (nl) break;
+    }
+    if (!s.empty() && s.back() == '\r') s.pop_back();
+    return any;
+}
+
+bool vargas::ifastx::next(std::string &name, std::string &seq, std::string &qual) {
+    int c;
+    if (!_last) {
+        // Skip to the first header
+        while ((c = _getc()) >= 0 && c != '>' && c != '@');
+        if (c < 0) return false;
+        _last = c;
+    }
+    _line.clear();
+    _getline(_line);
+    const auto ws = std::find_if(_line.begin(), _line.end(), isspace);
+    name.assign(_line.begin(), ws);
+
+    seq.clear();
+    qual.clear();
+    while ((c = _getc()) >= 0 && c != '>' && c != '+' && c != '@') {
+        if (c == '\n') continue; // Empty line
+        seq += char(c);
+        _getline(seq);
+    }
+    if (c == '>' || c == '@') _last = c;
+    else _last = 0;
+    if (c != '+') return true; // FASTA, or last record
+
+    // Quality follows the '+' line and is as long as the sequence
+    _line.clear();
+    if (!_getline(_line)) throw std::runtime_error("Invalid FASTA/Q file.");
+    while (qual.length() < seq.length() && _getline(qual));
+    if (qual.length() != seq.length()) throw std::runtime_error("Invalid FASTA/Q file.");
+    return true;
+}
+
 TEST_SUITE("FASTA Parser");
 
 TEST_CASE ("FASTA Reading") {
@@ -114,6 +424,55 @@ TEST_CASE ("FASTA Reading") {
         CHECK(fa.sequence_names()[0] == "x");
         CHECK(fa.sequence_names()[1] == "y");
 
+        // Resident range
+        const std::string x_sub = fa.subseq("x", 75, 90);
+        fa.load("x", 10, 100);
+        CHECK(fa.subseq("x", 75, 90) == x_sub);
+        CHECK(fa.subseq("y", 0, 2) == "GGA");
+        auto v = fa.subseq_num("x", 75, 90);
+        CHECK(v.size() == x_sub.size());
+        CHECK(std::vector<rg::Base>(v.begin(), v.end()) == rg::seq_to_num(x_sub));
+        v = fa.subseq_num("y", 0, 2); // Loads y
+        CHECK(std::vector<rg::Base>(v.begin(), v.end()) == rg::seq_to_num("GGA"));
+        CHECK_THROWS(fa.subseq_num("y", 0, 1000));
+
+    }
+
+    SUBCASE("2-bit reference") {
+        const std::string tmp2bit = "tmp_tc.2bit";
+        {
+            std::ofstream o(tmpfa);
+            o << ">a desc\nNNACGTacgtNN\nGGNNNcc\n>b\nNNNN\n>c\nACGTA\n";
+        }
+        {
+            vargas::ifasta fa(tmpfa);
+            fa.write_2bit(tmp2bit);
+        }
+        vargas::ifasta fa(tmpfa), tb(tmp2bit);
+        REQUIRE(tb.good());
+        CHECK(tb.is_2bit());
+        CHECK(!fa.is_2bit());
+        REQUIRE(tb.num_seq() == 3);
+        CHECK(tb.sequence_names() == fa.sequence_names());
+        CHECK(tb.seq_name(2) == "c");
+        for (const auto &name : fa.sequence_names()) {
+            CHECK(tb.seq_len(name) == fa.seq_len(name));
+            CHECK(tb.seq(name) == fa.seq(name));
+            for (rg::pos_t b = 0; b < fa.seq_len(name); ++b) {
+                for (rg::pos_t e = b; e < fa.seq_len(name); ++e) {
+                    CHECK(tb.subseq(name, b, e) == fa.subseq(name, b, e));
+                }
+            }
+        }
+        CHECK(tb.subseq("a", 0, 5) == "NNACGT");
+        CHECK(tb.subseq("a", 5, 9) == "Tacgt");
+        CHECK(tb.subseq("a", 11, 16) == "NGGNNN");
+
+        auto v = tb.subseq_num("a", 8, 14);
+        CHECK(std::vector<rg::Base>(v.begin(), v.end()) == rg::seq_to_num("gtNNGGN"));
+        CHECK_THROWS(tb.subseq("d", 0, 1));
+
+        remove(tmp2bit.c_str());
     }
 
     SUBCASE("iterator") {
@@ -202,4 +561,60 @@ TEST_CASE ("FASTA Writing") {
     }
 }
 
+TEST_CASE ("FASTA/Q streaming") {
+    std::string tmp = "tmp_tc_rd.fq";
+    std::string name, seq, qual;
+
+    SUBCASE("Multi-line records") {
+        {
+            std::ofstream o(tmp);
+            o << "\n@a desc\nACGT\nAC\n+a\n@@@@\n!!\n"
+              << ">b\r\nGG\r\n\nTT\r\n"
+              << "@c\nA\n+\n#\n";
+        }
+        vargas::ifastx in(tmp);
+        REQUIRE(in.next(name, seq, qual));
+        CHECK(name == "a");
+        CHECK(seq == "ACGTAC");
+        CHECK(qual == "@@@@!!");
+        REQUIRE(in.next(name, seq, qual));
+        CHECK(name == "b");
+        CHECK(seq == "GGTT");
+        CHECK(qual == "");
+        REQUIRE(in.next(name, seq, qual));
+        CHECK(name == "c");
+        CHECK(seq == "A");
+        CHECK(qual == "#");
+        CHECK_FALSE(in.next(name, seq, qual));
+    }
+
+    SUBCASE("Truncated quality") {
+        {
+            std::ofstream o(tmp);
+            o << "@a\nACGT\n+\n!!\n";
+        }
+        vargas::ifastx in(tmp);
+        CHECK_THROWS(in.next(name, seq, qual));
+    }
+
+    SUBCASE("Compressed") {
+        {
+            const std::string rec = "@a\nACGT\n+\n!!!!\n@b\nTTTT\n+\n####\n";
+            BGZF *gz = bgzf_open(tmp.c_str(), "w");
+            REQUIRE(gz);
+            bgzf_write(gz, rec.data(), rec.size());
+            bgzf_close(gz);
+        }
+        vargas::ifastx in(tmp);
+        REQUIRE(in.next(name, seq, qual));
+        CHECK(name == "a");
+        CHECK(qual == "!!!!");
+        REQUIRE(in.next(name, seq, qual));
+        CHECK(seq == "TTTT");
+        CHECK_FALSE(in.next(name, seq, qual));
+    }
+
+    remove(tmp.c_str());
+}
+
 TEST_SUITE_END();
\ No newline at end of file
@@ -191,6 +191,9 @@ void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
         }
     }
 
+    // Keep the region in memory rather than fetching each gap between variants from the file
+    _fa.load(vf.region().seq_name, vf.region().min, vf.region().max);
+
     rg::pos_t curr = vf.region().min; // The Graph has been built up to this position, exclusive
     std::unordered_set<unsigned> prev_unconnected; // ID's of nodes at the end of the Graph left unconnected
     std::unordered_set<unsigned> curr_unconnected; // ID's of nodes added that are unconnected
@@ -202,7 +205,14 @@ void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
 
     rg::pos_t prevpos = curr; // Used to validate that VCF is sorted
 
-    while (vf.next()) {
+    _decode_time = 0;
+    for (;;) {
+        // Only the variant file is timed, not the graph built from it
+        const auto decode_start = std::chrono::steady_clock::now();
+        const bool more = vf.next();
+        _decode_time += rg::chrono_duration(decode_start);
+        if (!more) break;
+
         if (vf.pos() < prevpos) throw std::invalid_argument("VCF file should be sorted by position.");
         else prevpos = vf.pos();
 
@@ -218,16 +228,16 @@ void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
             n.set_endpos(curr - 1 + pos_offset);
             n.set_seq(vf.ref());
             n.set_as_ref();
-            n.set_population(vf.allele_pop(vf.ref()));
+            n.set_population(vf.allele_pop(0));
             n.set_af(af[0]);
             curr_unconnected.insert(g.add_node(n));
         }
 
         //alt nodes
         for (unsigned i = 1; i < vf.alleles().size(); ++i) {
+            if (vf.is_duplicate(i)) continue; // Remove duplicate nodes, REF is substituted in for unknown tags
             const std::string &allele = vf.alleles()[i];
-            if (allele == vf.ref()) continue; // Remove duplicate nodes, REF is substituted in for unknown tags
-            Graph::Population pop = vf.allele_pop(allele);
+            const Graph::Population &pop = vf.allele_pop(i);
             if (g.pop_size() == 1 || (pop && all_pop)) { // Only add if someone has the allele. == 1 for KSNP
                 Graph::Node n;
                 n.set_endpos(curr - 1 + pos_offset);
@@ -245,6 +255,7 @@ void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
     // Nodes after last variant
     _build_linear_ref(g, prev_unconnected, curr_unconnected, curr, vf.region().max, pos_offset);
 
+    _num_decoded = vf.num_decoded();
     _fa.close();
     _vf.reset();
 }
@@ -272,7 +283,8 @@ rg::pos_t vargas::GraphFactory::_build_linear_ref(Graph &g, std::unordered_set<u
     n.pinch();
     n.set_population(g.pop_size(), true);
     n.set_as_ref();
-    n.set_seq(_fa.subseq(_vf->region().seq_name, pos, target - 1));
+    const auto ref = _fa.subseq_num(_vf->region().seq_name, pos, target - 1);
+    n.set_seq(ref.begin(), ref.end());
     n.set_endpos(target - 1 + pos_offset);
     curr.insert(g.add_node(n));
     _build_edges(g, prev, curr);
@@ -300,7 +312,7 @@ unsigned vargas::GraphFactory::add_sample_filter(std::string filter, bool invert
 
 unsigned vargas::GraphFactory::open_vcf(std::string const &file_name) {
     _vf.reset();
-    _vf = std::unique_ptr<VCF>(new VCF(file_name));
+    _vf = open_varfile(file_name, _fa_file);
     if (file_name.length() == 0 || file_name == "-") return 0;
     if (!_vf->good()) throw std::invalid_argument("Invalid VCF/BCF file: \"" + file_name + "\"");
     return _vf->num_haplotypes();
@@ -45,33 +45,50 @@ vargas::GraphMan::create_base(const std::string fasta, const std::string vcf, st
     size_t nhaplo = 0;
     if (vcf.size()) {
         _aux["vcf"] = vcf;
-        vargas::VCF v(vcf);
-        if (!v.good()) throw std::invalid_argument("Invalid VCF: " + vcf);
+        auto v = open_varfile(vcf, fasta);
+        if (!v->good()) throw std::invalid_argument("Invalid VCF: " + vcf);
         sample_filter.erase(std::remove_if(sample_filter.begin(), sample_filter.end(), isspace), sample_filter.end());
         auto vec = rg::split(sample_filter, ',');
-        if (vec.size()) v.create_ingroup(vec);
-        if (v.samples().size()) _aux["samples"] = rg::vec_to_str(v.samples(), ",");
-        nhaplo = v.num_haplotypes();
+        if (vec.size()) v->create_ingroup(vec);
+        if (v->samples().size()) _aux["samples"] = rg::vec_to_str(v->samples(), ",");
+        nhaplo = v->num_haplotypes();
     }
 
     _graphs["base"] = std::make_shared<Graph>(_nodes);
 
     unsigned offset = 0;
+    size_t num_decoded = 0;
+    double decode_time = 0;
 
     for (auto reg : region) {
         if (_print) std::cerr << "Building \"" << reg.seq_name << "\" (offset: " << offset << ")..." << std::endl;
         GraphFactory gf(fasta, vcf);
+        gf.set_thread_pool(_io_pool);
         gf.add_sample_filter(sample_filter);
         gf.limit_variants(limvar);
         gf.set_region(reg);
         if (_assume_contig) gf.assume_contig_chr();
         auto g = gf.build(offset);
-        if (_print) std::cerr << g.statistics().to_string() << "\n";
+        num_decoded += gf.num_decoded();
+        decode_time += gf.decode_time();
+        if (_print) {
+            std::cerr << g.statistics().to_string() << "\n";
+            if (vcf.size()) {
+                std::cerr << "Decoded " << gf.num_decoded() << " variant records in " << gf.decode_time() << "s ("
+                          << size_t(gf.num_decoded() / std::max(gf.decode_time(), 1e-9)) << " records/s).\n";
+            }
+        }
         _resolver._contig_offsets[offset] = reg.seq_name;
         offset = g.rbegin()->end_pos() + 1;
         _graphs["base"]->assimilate(g);
     }
 
+    if (_print && vcf.size()) {
+        std::cerr << "Variant decoding: " << num_decoded << " records in " << decode_time << "s, "
+                  << size_t(num_decoded / std::max(decode_time, 1e-9)) << " records/s with "
+                  << (_io_pool ? _io_pool->threads() : 0) << " I/O threads.\n";
+    }
+
     _graphs["base"]->set_filter(Graph::Population(nhaplo, true));
     _graphs["base"]->set_popsize(nhaplo);
 
@@ -82,6 +99,17 @@ vargas::GraphMan::create_base(const std::string fasta, const std::string vcf, st
     return _graphs["base"];
 }
 
+size_t vargas::GraphMan::write_cache(const std::string &vcf, const std::string &cache) {
+    if (_print) std::cerr << "Writing variant cache \"" << cache << "\"..." << std::endl;
+    auto start_time = std::chrono::steady_clock::now();
+    vargas::VCF v(vcf);
+    if (!v.good()) throw std::invalid_argument("Invalid VCF: " + vcf);
+    v.set_thread_pool(_io_pool);
+    const size_t n = VarCache::create(v, cache);
+    if (_print) std::cerr << "Cached " << n << " variant records in " << rg::chrono_duration(start_time) << "s.\n";
+    return n;
+}
+
 void vargas::GraphMan::write(const std::string &filename) {
     std::ios::sync_with_stdio(false);
     std::ofstream of(filename);
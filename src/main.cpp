@@ -22,9 +22,12 @@
 #include "align_main.h"
 #include "graphman.h"
 #include "threadpool.h"
+#include "async_writer.h"
+#include "results.h"
 
 #include <iostream>
 #include <algorithm>
+#include <queue>
 #include <scoring.h>
 #include <mutex>
 
@@ -52,6 +55,8 @@ int main(int argc, char *argv[]) {
                 return align_main(argc - 1, argv + 1);
             } else if (!strcmp(argv[1], "convert")) {
                 return convert_main(argc - 1, argv + 1);
+            } else if (!strcmp(argv[1], "merge")) {
+                return merge_main(argc - 1, argv + 1);
             } else if (!strcmp(argv[1], "query")) {
                 return query_main(argc - 1, argv + 1);
             }
@@ -70,23 +75,27 @@ int main(int argc, char *argv[]) {
 }
 
 int define_main(int argc, char *argv[]) {
-    std::string fasta_file, varfile, region, out_file, sample_filter, subdef;
+    std::string fasta_file, varfile, region, out_file, sample_filter, subdef, cache_file, twobit_file;
     bool not_contig = false;
     size_t varlim = 0;
+    int io_threads = 0;
 
     cxxopts::Options opts("vargas define", "Define subgraphs deriving from a reference and VCF file.");
     try {
         opts.add_options("Input")
-        ("f,fasta", "<str> *Reference FASTA filename.", cxxopts::value(fasta_file));
+        ("f,fasta", "<str> *Reference FASTA or 2-bit filename.", cxxopts::value(fasta_file));
 
         opts.add_options("Optional")
-        ("v,vcf", "<str> Variant file (vcf, vcf.gz, or bcf).", cxxopts::value<std::string>(varfile))
+        ("v,vcf", "<str> Variant file (vcf, vcf.gz, bcf, or kSNP .snp).", cxxopts::value<std::string>(varfile))
         ("t,out", "<str> Output filename. (default: stdout)", cxxopts::value(out_file))
         ("g,region", "<CHR[:MIN-MAX];...> list of regions. (default: all)", cxxopts::value(region))
         ("s,subgraph", "<str> Subgraph definitions, see below.", cxxopts::value(subdef))
         ("p,filter", "<str> Filter by sample names in file.", cxxopts::value(sample_filter))
         ("n,limvar", "<N> Limit to the first N variant records", cxxopts::value(varlim))
-        ("c,notcontig", "VCF records for a given contig are not contiguous.", cxxopts::value(not_contig)->implicit_value("true"));
+        ("c,notcontig", "VCF records for a given contig are not contiguous.", cxxopts::value(not_contig)->implicit_value("true"))
+        ("io-threads", "<N> Threads for decompressing the variant file. (default: 0)", cxxopts::value(io_threads)->default_value("0"))
+        ("cache", "<str> Variant cache. Written from -v if given, otherwise used in place of -v.", cxxopts::value(cache_file))
+        ("2bit", "<str> Write -f as a 2-bit reference and build from it.", cxxopts::value(twobit_file));
 
         opts.add_options()("h,help", "Display this message.");
         opts.parse(argc, argv);
@@ -104,6 +113,7 @@ int define_main(int argc, char *argv[]) {
 
     vargas::GraphMan gm;
     gm.print_progress();
+    gm.set_io_threads(io_threads);
     if (sample_filter.length()) {
         std::ifstream in(sample_filter);
         if (!in.good()) throw std::invalid_argument("Error opening file: \"" + sample_filter + "\"");
@@ -120,6 +130,18 @@ int define_main(int argc, char *argv[]) {
         std::transform(v.begin(), v.end(), std::back_inserter(region_vec), vargas::parse_region);
     }
 
+    if (!cache_file.empty()) {
+        if (!varfile.empty()) gm.write_cache(varfile, cache_file);
+        varfile = cache_file;
+    }
+
+    if (!twobit_file.empty()) {
+        vargas::ifasta ref(fasta_file);
+        if (!ref.good()) throw std::invalid_argument("Invalid reference: " + fasta_file);
+        ref.write_2bit(twobit_file);
+        fasta_file = twobit_file;
+    }
+
     if (!not_contig) gm.assume_contig_chr();
     gm.create_base(fasta_file, varfile, region_vec, sample_filter, varlim);
 
@@ -154,10 +176,15 @@ void main_helper_func(void *data, long index, int) {
     auto subgraph_ptr = gm.at(label);
     vargas::Sim sim(*subgraph_ptr, task_list[index].second.second);
     auto results = sim.get_batch(help.num_reads, gm.resolver());
-    for(auto &r: results) r.aux.set("RG", task_list[index].second.first);
+    std::string buf;
+    for(auto &r: results) {
+        r.aux.set("RG", task_list[index].second.first);
+        r.append_to(buf);
+        buf += '\n';
+    }
     {
         std::lock_guard<std::mutex> lock(help.m);
-        for(const auto &r: results) help.out.add_record(r);
+        help.out.write(buf);
     }
 }
 
@@ -338,14 +365,37 @@ int sim_main(int argc, char *argv[]) {
     return 0;
 }
 
+/**
+ * @brief
+ * A batch of records for convert, formatted in chunks on a ForPool.
+ */
+struct convert_helper {
+    std::function<void(long, std::string &, std::vector<char> &)> chunk; // Format the rows of one chunk
+    std::vector<std::string> out; // Formatted lines of each chunk
+    std::vector<std::vector<char>> missing; // Tags missing in each chunk
+};
+
+/**
+ * @brief
+ * ForPool body, format chunk i of a convert_helper.
+ */
+static void convert_chunk(void *data, long i, int) {
+    convert_helper &help = *(convert_helper *) data;
+    help.chunk(i, help.out[i], help.missing[i]);
+}
+
 int convert_main(int argc, char **argv) {
     std::string sam_file, format;
     std::vector<std::string> files;
-    cxxopts::Options opts("vargas convert", "Export a SAM file as a CSV file.");
+    int threads;
+    bool tsv = false;
+    cxxopts::Options opts("vargas convert", "Export a SAM or results file as a CSV file.");
     try {
         opts.add_options()
         ("f,format", "<str> Output format.", cxxopts::value<std::string>(format))
-        ("files", "SAM files, default stdin.", cxxopts::value<std::vector<std::string>>(files))
+        ("t,tsv", "Tab separated output.", cxxopts::value(tsv))
+        ("j,threads", "<N> Number of threads.", cxxopts::value(threads)->default_value("1"))
+        ("files", "SAM or results (.vres) files, default stdin.", cxxopts::value<std::vector<std::string>>(files))
         ("h,help", "Display this message.");
         opts.parse_positional(std::vector<std::string>{"files"});
         opts.parse(argc, argv);
@@ -360,39 +410,205 @@ int convert_main(int argc, char **argv) {
         convert_help(opts);
         throw std::invalid_argument("Format specifier required.");
     }
+    if (threads < 1) threads = 1;
 
     auto start_time = std::chrono::steady_clock::now();
 
     format.erase(std::remove(format.begin(), format.end(), ' '), format.end());
     std::vector<std::string> fmt_split = rg::split(format, ',');
+    if (fmt_split.empty()) throw std::invalid_argument("Format specifier required.");
     std::unordered_set<std::string> warned;
+    auto warn = [&](const std::string &tag) {
+        if (warned.count(tag)) return;
+        std::cerr << "WARN: Tag \"" << tag << "\" not present." << std::endl;
+        warned.insert(tag);
+    };
 
     if (files.empty()) files.resize(1);
 
+    // Formatting overlaps with writing
+    rg::AsyncWriter writer([](const std::string &buf) { std::cout.write(buf.data(), buf.size()); });
+    rg::ForPool fp(threads);
+    auto run = [&](convert_helper &help, size_t nchunks) {
+        help.out.assign(nchunks, std::string());
+        help.missing.assign(nchunks, std::vector<char>());
+        if (nchunks > 1) fp.forpool(&convert_chunk, (void *) &help, nchunks);
+        else if (nchunks) convert_chunk((void *) &help, 0, 0);
+        for (size_t c = 0; c < nchunks; ++c) {
+            for (size_t t = 0; t < help.missing[c].size(); ++t) if (help.missing[c][t]) warn(fmt_split[t]);
+            writer.push(std::move(help.out[c]));
+        }
+    };
+
+    const size_t chunk_size = 4096, batch_size = chunk_size * threads * 4;
+    const char sep = tsv ? '\t' : ',';
+    std::string buff, val, prefix;
     for (const auto &f : files) {
-        vargas::isam input(f);
-        std::string buff, val;
-        do {
-            if (files.size() > 1) buff = f + ",";
-            else buff = "";
-            for (auto &tag : fmt_split) {
-                val = "*";
-                if (!input.record().get(input.header(), tag, val) && warned.count(tag) == 0) {
-                    std::cerr << "WARN: Tag \"" << tag << "\" not present." << std::endl;
-                    warned.insert(tag);
+        prefix = files.size() > 1 ? f + sep : "";
+        convert_helper help;
+
+        if (f.length() && vargas::ResultsReader::is_results(f)) {
+            // Each block of a results file is a chunk
+            vargas::ResultsReader reader(f);
+            const vargas::ResultsProjection proj(fmt_split, reader);
+            std::vector<vargas::ResultsBlock> blocks(threads * 4);
+            help.chunk = [&](long c, std::string &out, std::vector<char> &missing) {
+                for (size_t r = 0; r < blocks[c].size(); ++r) {
+                    out += prefix;
+                    proj.append_row(blocks[c], r, out, missing, tsv);
+                }
+            };
+            size_t n;
+            do {
+                for (n = 0; n < blocks.size() && reader.next(blocks[n]); ++n);
+                run(help, n);
+            } while (n == blocks.size());
+            continue;
+        }
+
+        if (vargas::SAM::hts_format(f)) {
+            // BAM/CRAM are decoded whole by htslib
+            vargas::isam input(f);
+            do {
+                buff += prefix;
+                for (auto &tag : fmt_split) {
+                    val = "*";
+                    if (!input.record().get(input.header(), tag, val)) warn(tag);
+                    if (!tsv) buff += '"';
+                    buff += val;
+                    if (!tsv) buff += '"';
+                    buff += sep;
                 }
-                buff += "\"" + val + "\",";
+                buff.back() = '\n'; // Replace trailing separator
+                if (buff.size() >= (1 << 20)) writer.push(std::move(buff));
+            } while (input.next());
+            writer.push(std::move(buff));
+            continue;
+        }
+
+        // SAM text: only the requested columns are split out of each line
+        vargas::SAMBatchReader reader(f, size_t(threads) << 22);
+        const vargas::SAM::Projection proj(fmt_split, reader.header());
+        std::vector<vargas::SAM::RecordView> views;
+        help.chunk = [&](long c, std::string &out, std::vector<char> &missing) {
+            const size_t beg = c * chunk_size, end = std::min(beg + chunk_size, views.size());
+            for (size_t r = beg; r < end; ++r) {
+                out += prefix;
+                proj.append_row(views[r], out, missing, tsv);
             }
-            buff.resize(buff.size() - 1);
-            std::cout << buff << '\n'; // Crop trailing comma
-        } while (input.next());
+        };
+        while (reader.next(views, batch_size)) run(help, (views.size() + chunk_size - 1) / chunk_size);
     }
+    writer.close();
+    std::cout.flush();
 
     std::cerr << rg::chrono_duration(start_time) << " seconds." << std::endl;
 
     return 0;
 }
 
+int merge_main(int argc, char *argv[]) {
+    std::string out_file;
+    std::vector<std::string> files;
+    int io_threads;
+    cxxopts::Options opts("vargas merge", "Merge the outputs of vargas align --shard in input order.");
+    try {
+        opts.add_options()
+        ("S,sam", "<str> Output file. .bam or .cram to write BAM/CRAM. (default: stdout)", cxxopts::value(out_file))
+        ("io-threads", "<N> Threads for BAM/CRAM compression and decompression. (default: 0)", cxxopts::value(io_threads)->default_value("0"))
+        ("files", "SAM, BAM, or CRAM output of each shard.", cxxopts::value<std::vector<std::string>>(files))
+        ("h,help", "Display this message.");
+        opts.parse_positional(std::vector<std::string>{"files"});
+        opts.parse(argc, argv);
+    } catch (std::exception &e) {
+        throw std::invalid_argument("Error parsing options: " + std::string(e.what()));
+    }
+    if (opts.count("h")) {
+        merge_help(opts);
+        return 0;
+    }
+    if (files.empty()) {
+        merge_help(opts);
+        throw std::invalid_argument("Shard outputs required.");
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+    std::shared_ptr<rg::HtsPool> io_pool;
+    if (io_threads > 0) io_pool = std::make_shared<rg::HtsPool>(io_threads);
+
+    vargas::SAM::Header hdr;
+    std::vector<char> seen; // Shards opened so far
+    std::vector<std::unique_ptr<ReadStream>> inputs;
+    for (size_t f = 0; f < files.size(); ++f) {
+        inputs.emplace_back(new ReadStream(files[f], ReadFmt::SAM, false));
+        inputs.back()->set_thread_pool(io_pool);
+
+        // The shards differ only in the --shard option of their command line
+        vargas::SAM::Header shard_hdr = inputs.back()->header();
+        Shard shard;
+        bool found = false;
+        for (auto &pg : shard_hdr.programs) found = Shard::take_option(pg.second.command_line, shard) || found;
+        if (!found) throw std::invalid_argument("\"" + files[f] + "\" is not an output of vargas align --shard.");
+        const std::string name = std::to_string(shard.index) + "/" + std::to_string(shard.count);
+        if (f == 0) {
+            hdr = shard_hdr;
+            seen.assign(shard.count, 0);
+        } else {
+            hdr.read_groups.insert(shard_hdr.read_groups.begin(), shard_hdr.read_groups.end());
+        }
+        if (shard.count != seen.size()) {
+            throw std::invalid_argument("\"" + files[f] + "\" is shard " + name + ", expected one of " +
+                                        std::to_string(seen.size()) + " shards.");
+        }
+        if (seen[shard.index]) throw std::invalid_argument("Shard " + name + " is given twice.");
+        seen[shard.index] = 1;
+    }
+    const size_t missing = std::count(seen.begin(), seen.end(), 0);
+    if (missing) {
+        throw std::invalid_argument(std::to_string(missing) + " of " + std::to_string(seen.size()) + " shards missing.");
+    }
+
+    // Each shard is in read order, so only the next record of each shard is held.
+    // Records of one read are consecutive in its shard, and stay in that order.
+    typedef std::pair<size_t, size_t> key; // Read index, shard
+    std::priority_queue<key, std::vector<key>, std::greater<key>> queue;
+    std::vector<vargas::SAM::Record> next(files.size());
+    std::vector<size_t> last(files.size(), 0); // Read index of the last record of each shard
+    size_t merged = 0;
+    auto advance = [&](size_t f) {
+        vargas::SAM::Record &rec = next[f];
+        if (!inputs[f]->next(rec)) return;
+        // A single shard holds every read, in order, without the tag
+        size_t index = merged;
+        if (seen.size() > 1 && !rec.aux.get(ALIGN_SAM_READ_INDEX_TAG, index)) {
+            throw std::invalid_argument("Record \"" + rec.query_name + "\" in \"" + files[f] + "\" has no "
+                                        ALIGN_SAM_READ_INDEX_TAG " tag.");
+        }
+        if (index < last[f]) {
+            throw std::invalid_argument("\"" + files[f] + "\" is not in read order at record \"" + rec.query_name +
+                                        "\".");
+        }
+        last[f] = index;
+        rec.aux.erase(ALIGN_SAM_READ_INDEX_TAG);
+        queue.emplace(index, f);
+    };
+
+    vargas::osam out(out_file, hdr, io_pool);
+    for (size_t f = 0; f < inputs.size(); ++f) advance(f);
+    while (!queue.empty()) {
+        const size_t f = queue.top().second;
+        queue.pop();
+        out.add_record(next[f]);
+        ++merged;
+        advance(f);
+    }
+    out.close();
+
+    std::cerr << "Merged " << merged << " records from " << files.size() << " shards, "
+              << rg::chrono_duration(start_time) << " seconds." << std::endl;
+    return 0;
+}
+
 int profile(int argc, char *argv[]) {
     std::string bcf, fasta, region;
     size_t  ingroup;
@@ -401,7 +617,7 @@ int profile(int argc, char *argv[]) {
     try {
         opts.add_options()
         ("f,fasta", "<str> *Reference FASTA.", cxxopts::value(fasta))
-        ("v,vcf", "<str> *Variant file (vcf, vcf.gz, or bcf)", cxxopts::value(bcf))
+        ("v,vcf", "<str> *Variant file (vcf, vcf.gz, bcf, or kSNP .snp)", cxxopts::value(bcf))
         ("g,region", R"(<str> *Region of format "CHR:MIN-MAX". "CHR:0-0" for all.)", cxxopts::value(region))
         ("i,ingroup", "<N> Ingroup percentage.", cxxopts::value(ingroup)->default_value("100"))
         ("h,help", "Display this message.");
@@ -525,7 +741,8 @@ void main_help() {
     cerr << "\tdefine          Define a set of graphs for use with sim and align.\n";
     cerr << "\tsim             Simulate reads from a set of graphs.\n";
     cerr << "\talign           Align reads to a set of graphs.\n";
-    cerr << "\tconvert         Convert a SAM file to a CSV file.\n";
+    cerr << "\tconvert         Convert a SAM or results file to a CSV file.\n";
+    cerr << "\tmerge           Merge the outputs of a sharded alignment.\n";
     cerr << "\tquery           Convert a graph to DOT format.\n";
     cerr << "\ttest            Run unit tests.\n\n";
 
@@ -571,10 +788,22 @@ void convert_help(const cxxopts::Options &opts) {
     cerr << opts.help() << "\n\n";
     cerr << "Required column names:\n\tQNAME, FLAG, RNAME, POS, MAPQ, CIGAR, RNEXT, PNEXT, TLEN, SEQ, QUAL\n";
     cerr << "Prefix with \"RG:\" to obtain a value from the associated read group.\n";
+    cerr << "Results files (.vres) hold QNAME, FLAG, RNAME, RG, AS, mp, mc, ss, sp, sc, st, and su.\n";
     cerr << "Ex. vargas convert -f \"RG:ID,ms\" a.sam b.sam" << endl;
 
 }
 
+void merge_help(const cxxopts::Options &opts) {
+    using std::cerr;
+    using std::endl;
+
+    cerr << opts.help() << "\n\n";
+    cerr << "Outputs of vargas align --shard i/N for every i from 0 to N-1 are merged in input order,\n";
+    cerr << "with the header of the first and the --shard option removed from its command line.\n";
+    cerr << "Shards are merged as they are read, each should be in read order as written by align.\n";
+    cerr << "Ex. vargas merge -S aligns.sam shard0.sam shard1.sam shard2.sam" << endl;
+}
+
 TEST_CASE("Vargas CLI") {
     const std::string fa = R"(>chrA
 AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA
@@ -659,10 +888,65 @@ chrB	80	rs796688738	C	AC,<CN0>	.	.	.	.)";
     }
 
 
+    {
+        // vargas align --shard i/2 for each shard, then vargas merge -S tmpmerge.vatmp
+        for (int i = 0; i < 2; ++i) {
+            const std::string shard = std::to_string(i) + "/2", out = "tmpshard" + std::to_string(i) + ".vatmp";
+            const int argc = 11;
+            const char *argv[] = {"vargas", "align", "-g", "tmpgdef.vatmp", "-U", "tmpreads.vatmp", "-S", out.c_str(),
+                                  "-f", "--shard", shard.c_str()};
+            align_main(argc, (char **) argv);
+        }
+        {
+            const int argc = 5;
+            const char *argv[] = {"vargas", "-S", "tmpmerge.vatmp", "tmpshard1.vatmp", "tmpshard0.vatmp"};
+            merge_main(argc, (char **) argv);
+        }
+        vargas::isam reads("tmpreads.vatmp"), merged("tmpmerge.vatmp");
+        CHECK(merged.header().read_groups.size() == 8);
+        CHECK(merged.header().programs.at("VA").command_line.find("--shard") == std::string::npos);
+        size_t cnt = 0;
+        do {
+            ++cnt;
+            CHECK(merged.record().query_name == reads.record().query_name);
+            CHECK(merged.record().aux.find(ALIGN_SAM_READ_INDEX_TAG) == nullptr);
+            CHECK(merged.record().aux.find("AS") != nullptr);
+            reads.next();
+        } while (merged.next());
+        CHECK(cnt == 8);
+
+        const int argc = 4;
+        const char *argv[] = {"vargas", "-S", "tmpmerge.vatmp", "tmpshard1.vatmp"};
+        CHECK_THROWS(merge_main(argc, (char **) argv));
+        const char *dup[] = {"vargas", "tmpshard1.vatmp", "tmpshard1.vatmp"};
+        CHECK_THROWS(merge_main(3, (char **) dup));
+        const char *unsharded[] = {"vargas", "tmpsam.vatmp"};
+        CHECK_THROWS(merge_main(2, (char **) unsharded));
+
+        // Shards out of read order are rejected rather than held in memory
+        vargas::SAM::Header hdr;
+        std::vector<vargas::SAM::Record> recs;
+        {
+            vargas::isam shard("tmpshard1.vatmp");
+            hdr = shard.header();
+            do { recs.push_back(shard.record()); } while (shard.next());
+        }
+        REQUIRE(recs.size() > 1);
+        {
+            vargas::osam shard("tmpshard1.vatmp", hdr);
+            for (auto r = recs.rbegin(); r != recs.rend(); ++r) shard.add_record(*r);
+        }
+        const char *reversed[] = {"vargas", "-S", "tmpmerge.vatmp", "tmpshard0.vatmp", "tmpshard1.vatmp"};
+        CHECK_THROWS(merge_main(5, (char **) reversed));
+    }
+
     remove("tmpfa.vatmp");
     remove("tmpfa.vatmp.fai");
     remove("tmpvcf.vatmp");
     remove("tmpgdef.vatmp");
     remove("tmpreads.vatmp");
     remove("tmpsam.vatmp");
+    remove("tmpshard0.vatmp");
+    remove("tmpshard1.vatmp");
+    remove("tmpmerge.vatmp");
 }
@@ -0,0 +1,368 @@
+/**
+ * @file
+ *
+ * @brief
+ * Compact columnar output of alignment scores. Implementation.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ */
+
+#include "results.h"
+#include "align_main.h"
+#include "doctest.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const char VARGAS_RESULTS_MAGIC[] = "VRS1";
+
+constexpr int64_t vargas::ResultsBlock::NONE;
+
+template<typename T>
+static inline void results_put(std::string &out, const T &val) {
+    out.append(reinterpret_cast<const char *>(&val), sizeof(T));
+}
+
+/**
+ * @brief
+ * Append a NUL terminated string list, preceded by its size.
+ */
+static void results_put_list(std::string &out, const std::vector<std::string> &list) {
+    results_put(out, uint32_t(list.size()));
+    for (const auto &s : list) out.append(s.c_str(), s.length() + 1);
+}
+
+/**
+ * @brief
+ * Append a column as its width, base, and offsets from the base.
+ */
+static void results_put_col(std::string &out, const std::vector<int64_t> &vals) {
+    int64_t lo = std::numeric_limits<int64_t>::max(), hi = std::numeric_limits<int64_t>::min();
+    bool none = false;
+    for (const int64_t v : vals) {
+        if (v == vargas::ResultsBlock::NONE) none = true;
+        else {
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+        }
+    }
+    if (lo > hi || (lo == hi && !none)) {
+        // Constant column
+        results_put(out, uint8_t(0));
+        results_put(out, lo > hi ? vargas::ResultsBlock::NONE : lo);
+        return;
+    }
+    // The largest value of a width is reserved for missing
+    const uint64_t range = uint64_t(hi) - uint64_t(lo);
+    uint8_t width = 8;
+    if (range < 0xffu) width = 1;
+    else if (range < 0xffffu) width = 2;
+    else if (range < 0xffffffffu) width = 4;
+    results_put(out, width);
+    results_put(out, lo);
+    const uint64_t missing = width == 8 ? ~uint64_t(0) : (uint64_t(1) << (8 * width)) - 1;
+    for (const int64_t v : vals) {
+        const uint64_t code = v == vargas::ResultsBlock::NONE ? missing : uint64_t(v) - uint64_t(lo);
+        out.append(reinterpret_cast<const char *>(&code), width); // Low bytes on little endian hosts
+    }
+}
+
+vargas::ResultsFormat::ResultsFormat(const SAM::Header &hdr) : _hdr_text(hdr.to_string()) {
+    for (const auto &s : hdr.sequences) _contigs.push_back(s.first);
+    for (const auto &r : hdr.read_groups) _read_groups.push_back(r.first);
+    std::sort(_contigs.begin(), _contigs.end());
+    std::sort(_read_groups.begin(), _read_groups.end());
+    for (size_t i = 0; i < _contigs.size(); ++i) _contig_index[_contigs[i]] = i;
+    for (size_t i = 0; i < _read_groups.size(); ++i) _rg_index[_read_groups[i]] = i;
+}
+
+std::string vargas::ResultsFormat::header() const {
+    std::string ret(VARGAS_RESULTS_MAGIC, 4);
+    results_put(ret, uint32_t(_hdr_text.length()));
+    ret += _hdr_text;
+    results_put_list(ret, _contigs);
+    results_put_list(ret, _read_groups);
+    return ret;
+}
+
+int64_t vargas::ResultsFormat::_index(const std::unordered_map<std::string, int64_t> &dict,
+                                      const std::string &name) const {
+    const auto f = dict.find(name);
+    return f == dict.end() ? ResultsBlock::NONE : f->second;
+}
+
+void vargas::ResultsFormat::append_block(const std::vector<SAM::Record> &records, std::string &out) const {
+    std::vector<const SAM::Record *> ptrs(records.size());
+    for (size_t i = 0; i < records.size(); ++i) ptrs[i] = &records[i];
+    append_block(ptrs, out);
+}
+
+void vargas::ResultsFormat::append_block(const std::vector<const SAM::Record *> &records, std::string &out) const {
+    if (records.empty()) return;
+    ResultsBlock b;
+    for (auto &c : b.cols) c.reserve(records.size());
+    b.name_end.reserve(records.size());
+
+    auto tag_int = [](const SAM::Record &r, const char *tag) {
+        long long v;
+        return r.aux.get(tag, v) ? int64_t(v) : ResultsBlock::NONE;
+    };
+    std::string text;
+    for (const SAM::Record *rec : records) {
+        const SAM::Record &r = *rec;
+        b.cols[ResultsBlock::FLAG].push_back(r.flag.encode());
+        b.cols[ResultsBlock::RNAME].push_back(_index(_contig_index, r.ref_name));
+        b.cols[ResultsBlock::SCORE].push_back(tag_int(r, "AS"));
+        b.cols[ResultsBlock::MAX_POS].push_back(tag_int(r, ALIGN_SAM_MAX_POS_TAG));
+        b.cols[ResultsBlock::MAX_COUNT].push_back(tag_int(r, ALIGN_SAM_MAX_COUNT_TAG));
+        b.cols[ResultsBlock::SUB_SCORE].push_back(tag_int(r, ALIGN_SAM_SUB_SCORE_TAG));
+        b.cols[ResultsBlock::SUB_POS].push_back(tag_int(r, ALIGN_SAM_SUB_POS_TAG));
+        b.cols[ResultsBlock::SUB_COUNT].push_back(tag_int(r, ALIGN_SAM_SUB_COUNT_TAG));
+        b.cols[ResultsBlock::SUB_STRAND].push_back(
+        r.aux.get(ALIGN_SAM_SUB_STRAND_TAG, text) ? int64_t(text == "rev") : ResultsBlock::NONE);
+        b.cols[ResultsBlock::SUB_SEQ].push_back(
+        r.aux.get(ALIGN_SAM_SUB_SEQ, text) ? _index(_contig_index, text) : ResultsBlock::NONE);
+        b.cols[ResultsBlock::READ_GROUP].push_back(
+        r.aux.get("RG", text) ? _index(_rg_index, text) : ResultsBlock::NONE);
+        b.names += r.query_name;
+        b.name_end.push_back(b.names.length());
+        b.names += '\0';
+    }
+
+    results_put(out, uint32_t(records.size()));
+    for (const auto &c : b.cols) results_put_col(out, c);
+    results_put(out, uint32_t(b.names.length()));
+    out += b.names;
+}
+
+bool vargas::ResultsFormat::is_results(const std::string &file_name) {
+    return rg::ends_with(file_name, ".vres");
+}
+
+vargas::ResultsReader::ResultsReader(const std::string &file_name) {
+    _in.open(file_name, std::ios::binary);
+    if (!_in.good()) throw std::invalid_argument("Error opening file \"" + file_name + "\"");
+    char magic[4];
+    if (!_in.read(magic, 4) || std::strncmp(magic, VARGAS_RESULTS_MAGIC, 4) != 0)
+        throw std::invalid_argument("Not a results file: \"" + file_name + "\"");
+
+    uint32_t len;
+    _read(&len, sizeof(len));
+    std::string text(len, '\0');
+    _read(&text[0], len);
+    _hdr << text;
+
+    for (auto *list : {&_contigs, &_read_groups}) {
+        uint32_t n;
+        _read(&n, sizeof(n));
+        list->resize(n);
+        for (auto &s : *list) {
+            if (!std::getline(_in, s, '\0')) throw std::runtime_error("Truncated results file.");
+        }
+    }
+}
+
+bool vargas::ResultsReader::is_results(const std::string &file_name) {
+    std::ifstream in(file_name, std::ios::binary);
+    char magic[4];
+    return in.read(magic, 4) && std::strncmp(magic, VARGAS_RESULTS_MAGIC, 4) == 0;
+}
+
+void vargas::ResultsReader::_read(void *dst, size_t n) {
+    if (!_in.read(static_cast<char *>(dst), n)) throw std::runtime_error("Truncated results file.");
+}
+
+bool vargas::ResultsReader::next(ResultsBlock &block) {
+    block.clear();
+    uint32_t n;
+    if (!_in.read(reinterpret_cast<char *>(&n), sizeof(n))) {
+        if (_in.gcount() == 0) return false;
+        throw std::runtime_error("Truncated results file.");
+    }
+
+    for (auto &col : block.cols) {
+        uint8_t width;
+        int64_t base;
+        _read(&width, sizeof(width));
+        _read(&base, sizeof(base));
+        if (width == 0) {
+            col.assign(n, base);
+            continue;
+        }
+        if (width != 1 && width != 2 && width != 4 && width != 8)
+            throw std::runtime_error("Invalid column width in results file.");
+        _buf.resize(size_t(n) * width);
+        _read(_buf.data(), _buf.size());
+        const uint64_t missing = width == 8 ? ~uint64_t(0) : (uint64_t(1) << (8 * width)) - 1;
+        col.resize(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            uint64_t code = 0;
+            std::memcpy(&code, _buf.data() + size_t(i) * width, width);
+            col[i] = code == missing ? ResultsBlock::NONE : int64_t(uint64_t(base) + code);
+        }
+    }
+
+    uint32_t len;
+    _read(&len, sizeof(len));
+    block.names.resize(len);
+    _read(&block.names[0], len);
+    block.name_end.reserve(n);
+    for (size_t i = 0; i < len; ++i) {
+        if (block.names[i] == '\0') block.name_end.push_back(i);
+    }
+    if (block.name_end.size() != n) throw std::runtime_error("Invalid read names in results file.");
+    return true;
+}
+
+vargas::ResultsProjection::ResultsProjection(const std::vector<std::string> &tags, const ResultsReader &reader) :
+_contigs(reader.contigs()), _read_groups(reader.read_groups()) {
+    static const std::unordered_map<std::string, ResultsBlock::Col> columns = {
+    {SAM::Record::REQUIRED_FLAG, ResultsBlock::FLAG}, {SAM::Record::REQUIRED_RNAME, ResultsBlock::RNAME},
+    {"AS", ResultsBlock::SCORE}, {ALIGN_SAM_MAX_POS_TAG, ResultsBlock::MAX_POS},
+    {ALIGN_SAM_MAX_COUNT_TAG, ResultsBlock::MAX_COUNT}, {ALIGN_SAM_SUB_SCORE_TAG, ResultsBlock::SUB_SCORE},
+    {ALIGN_SAM_SUB_POS_TAG, ResultsBlock::SUB_POS}, {ALIGN_SAM_SUB_COUNT_TAG, ResultsBlock::SUB_COUNT},
+    {ALIGN_SAM_SUB_STRAND_TAG, ResultsBlock::SUB_STRAND}, {ALIGN_SAM_SUB_SEQ, ResultsBlock::SUB_SEQ},
+    {"RG", ResultsBlock::READ_GROUP}};
+
+    std::vector<std::string> rg_tags;
+    for (const auto &tag : tags) {
+        Column c;
+        c.kind = NONE;
+        if (tag.length() > 3 && tag.substr(0, 3) == "RG:") {
+            c.kind = READ_GROUP_TAG;
+            c.rg = rg_tags.size();
+            rg_tags.push_back(tag.substr(3));
+        } else if (tag == SAM::Record::REQUIRED_QNAME) {
+            c.kind = NAME;
+        } else {
+            const auto f = columns.find(tag);
+            if (f != columns.end()) {
+                c.kind = COLUMN;
+                c.col = f->second;
+            }
+        }
+        _cols.push_back(c);
+    }
+
+    const auto &groups = reader.header().read_groups;
+    for (const auto &id : _read_groups) {
+        _rg_values.emplace_back(rg_tags.size());
+        const auto g = groups.find(id);
+        if (g == groups.end()) continue;
+        auto &vals = _rg_values.back();
+        for (size_t i = 0; i < rg_tags.size(); ++i) vals[i].first = g->second.aux.get(rg_tags[i], vals[i].second);
+    }
+}
+
+void vargas::ResultsProjection::append_row(const ResultsBlock &block, size_t i, std::string &out,
+                                           std::vector<char> &missing, bool tsv) const {
+    missing.resize(_cols.size(), false);
+    const int64_t rg = block.cols[ResultsBlock::READ_GROUP][i];
+    for (size_t c = 0; c < _cols.size(); ++c) {
+        const Column &col = _cols[c];
+        if (!tsv) out += '"';
+        const size_t len = out.length();
+        switch (col.kind) {
+            case NAME: {
+                const rg::StrRef n = block.name(i);
+                out.append(n.begin(), n.end());
+                break;
+            }
+            case COLUMN: {
+                const int64_t v = block.cols[col.col][i];
+                if (v == ResultsBlock::NONE) break;
+                if (col.col == ResultsBlock::RNAME || col.col == ResultsBlock::SUB_SEQ) {
+                    if (size_t(v) < _contigs.size()) out += _contigs[v];
+                } else if (col.col == ResultsBlock::READ_GROUP) {
+                    if (size_t(v) < _read_groups.size()) out += _read_groups[v];
+                } else if (col.col == ResultsBlock::SUB_STRAND) {
+                    out += v ? "rev" : "fwd";
+                } else rg::append_int(out, v);
+                break;
+            }
+            case READ_GROUP_TAG:
+                if (rg != ResultsBlock::NONE && size_t(rg) < _rg_values.size() && _rg_values[rg][col.rg].first) {
+                    out += _rg_values[rg][col.rg].second;
+                }
+                break;
+            default:
+                break;
+        }
+        if (out.length() == len) {
+            out += '*';
+            missing[c] = true;
+        }
+        if (!tsv) out += '"';
+        out += tsv ? '\t' : ',';
+    }
+    if (_cols.size()) out.back() = '\n';
+}
+
+TEST_CASE ("Results file") {
+    vargas::SAM::Header hdr;
+    hdr << "@HD\tVN:1.0\n@SQ\tSN:chr1\tLN:100\n@SQ\tSN:chr2\tLN:100\n"
+           "@RG\tID:a\tms:Z:low\n@RG\tID:b\tms:Z:high\n";
+    std::vector<vargas::SAM::Record> recs(3);
+    recs[0].query_name = "r0";
+    recs[0].ref_name = "chr2";
+    recs[0].flag.rev_complement = true;
+    recs[0].aux.set("AS", 40);
+    recs[0].aux.set("mp", 5000000000LL);
+    recs[0].aux.set("RG", "b");
+    recs[0].aux.set("st", "rev");
+    recs[1].query_name = "r1";
+    recs[1].aux.set("AS", -3);
+    recs[1].aux.set("mp", 7);
+    recs[1].aux.set("RG", "a");
+    recs[2].query_name = "read_2";
+    recs[2].aux.set("AS", 12);
+    recs[2].aux.set("RG", "zz");
+    recs[2].aux.set("st", "fwd");
+
+    const vargas::ResultsFormat fmt(hdr);
+    CHECK(vargas::ResultsFormat::is_results("out.vres"));
+    CHECK_FALSE(vargas::ResultsFormat::is_results("out.sam"));
+    {
+        std::string buf = fmt.header();
+        fmt.append_block(recs, buf);
+        fmt.append_block(std::vector<vargas::SAM::Record>(), buf);
+        fmt.append_block(std::vector<vargas::SAM::Record>(recs.begin(), recs.begin() + 1), buf);
+        std::ofstream o("tmp_r.vres", std::ios::binary);
+        o.write(buf.data(), buf.size());
+    }
+    CHECK(vargas::ResultsReader::is_results("tmp_r.vres"));
+
+    vargas::ResultsReader rr("tmp_r.vres");
+    CHECK(rr.header().read_groups.size() == 2);
+    CHECK(rr.contigs() == std::vector<std::string>{"chr1", "chr2"});
+
+    vargas::ResultsBlock b;
+    REQUIRE(rr.next(b));
+    REQUIRE(b.size() == 3);
+    CHECK(b.name(0) == "r0");
+    CHECK(b.name(2) == "read_2");
+    CHECK(b.cols[vargas::ResultsBlock::SCORE] == std::vector<int64_t>{40, -3, 12});
+    CHECK(b.cols[vargas::ResultsBlock::MAX_POS] == std::vector<int64_t>{5000000000LL, 7, vargas::ResultsBlock::NONE});
+    CHECK(b.cols[vargas::ResultsBlock::MAX_COUNT] == std::vector<int64_t>(3, vargas::ResultsBlock::NONE));
+
+    const std::vector<std::string> tags = {"QNAME", "AS", "mp", "RNAME", "FLAG", "st", "RG", "RG:ms", "XX"};
+    vargas::ResultsProjection proj(tags, rr);
+    std::vector<char> missing;
+    std::string out;
+    for (size_t i = 0; i < b.size(); ++i) proj.append_row(b, i, out, missing);
+    CHECK(out == "\"r0\",\"40\",\"5000000000\",\"chr2\",\"16\",\"rev\",\"b\",\"high\",\"*\"\n"
+                 "\"r1\",\"-3\",\"7\",\"*\",\"0\",\"*\",\"a\",\"low\",\"*\"\n"
+                 "\"read_2\",\"12\",\"*\",\"*\",\"0\",\"fwd\",\"*\",\"*\",\"*\"\n");
+    CHECK(missing == std::vector<char>{false, false, true, true, false, true, true, true, true});
+
+    REQUIRE(rr.next(b));
+    REQUIRE(b.size() == 1);
+    out.clear();
+    proj.append_row(b, 0, out, missing, true);
+    CHECK(out == "r0\t40\t5000000000\tchr2\t16\trev\tb\thigh\t*\n");
+    CHECK_FALSE(rr.next(b));
+
+    CHECK_THROWS(vargas::ResultsReader("tmp_r_missing.vres"));
+}
@@ -17,9 +17,14 @@
 
 
 #include "sam.h"
+#include "results.h"
 #include "doctest.h"
 #include <assert.h>
+#include <cstdio>
+#include <cstring>
+#include <limits>
 #include <numeric>
+#include "htslib/kstring.h"
 
 const std::string vargas::SAM::Record::REQUIRED_POS = "POS";
 const std::string vargas::SAM::Record::REQUIRED_QNAME = "QNAME";
@@ -33,27 +38,54 @@ const std::string vargas::SAM::Record::REQUIRED_MAPQ = "MAPQ";
 const std::string vargas::SAM::Record::REQUIRED_TLEN = "TLEN";
 const std::string vargas::SAM::Record::REQUIRED_QUAL = "QUAL";
 
-void vargas::SAM::Optional::add(std::string a) {
-    const std::vector<std::string> s = rg::split(a, ':');
-    assert(s[0].length() == 2);
-    if (s.size() == 2) {
-        aux[s[0]] = s[1];
-        aux_fmt[s[0]] = 'Z';
-    } else if (s.size() >= 3) {
-        assert(s[1].length() == 1);
-        aux_fmt[s[0]] = s[1].at(0);
-        aux[s[0]] = a.substr(5);
+constexpr uint8_t vargas::SAM::Optional::INLINE_FIELDS;
+
+std::string vargas::SAM::Optional::Field::value() const {
+    if (kind == Kind::TEXT) return text;
+    std::string ret;
+    append_value(ret);
+    return ret;
+}
+
+void vargas::SAM::Optional::Field::append_value(std::string &out) const {
+    switch (kind) {
+        case Kind::INT:
+            rg::append_int(out, i);
+            break;
+        case Kind::REAL: {
+            char buf[64]; // Same format as std::to_string
+            const int n = std::snprintf(buf, sizeof(buf), "%f", f);
+            if (n > 0 && size_t(n) < sizeof(buf)) out.append(buf, n);
+            else out += std::to_string(f);
+            break;
+        }
+        default:
+            out += text;
+    }
+}
+
+void vargas::SAM::Optional::add(const std::string &a) {
+    if (a.length() >= 5 && a[2] == ':' && a[4] == ':') {
+        set_text(rg::StrRef(a.data(), 2), a[3], rg::StrRef(a.data() + 5, a.data() + a.length()));
+    } else if (a.length() >= 3 && a[2] == ':') {
+        set_text(rg::StrRef(a.data(), 2), 'Z', rg::StrRef(a.data() + 3, a.data() + a.length()));
     } else throw std::invalid_argument("Invalid format: " + a);
 }
 
-std::string vargas::SAM::Optional::to_string() const {
-    std::ostringstream ss;
-    for (auto &pair : aux) {
-        ss << '\t' << pair.first
-           << ':' << aux_fmt.at(pair.first)
-           << ':' << pair.second;
+void vargas::SAM::Optional::set_text(rg::StrRef tag, char fmt, rg::StrRef val) {
+    Field &f = _field(tag);
+    if (fmt == 'i' && rg::parse_int(val, f.i)) {
+        f.set_type(fmt, Field::Kind::INT);
+    } else {
+        f.set_type(fmt, Field::Kind::TEXT);
+        f.text.assign(val.begin(), val.end());
     }
-    return ss.str();
+}
+
+std::string vargas::SAM::Optional::to_string() const {
+    std::string ret;
+    append_to(ret);
+    return ret;
 }
 
 std::string vargas::SAM::Header::Sequence::to_string() const {
@@ -297,48 +329,224 @@ void vargas::SAM::Record::Flag::decode(unsigned int f) {
     supplementary = ((f & 0x800) != 0u);
 }
 
-std::string vargas::SAM::Record::to_string() const {
-    std::ostringstream ss;
-    ss << (query_name.size() ? query_name : "*") << '\t'
-       << flag.encode() << '\t'
-       << (ref_name.size() ? ref_name : "*") << '\t'
-       << pos << '\t'
-       << mapq << '\t'
-       << cigar.to_string() << '\t'
-       << (ref_next.size() ? ref_next : "*") << '\t'
-       << pos_next << '\t'
-       << tlen << '\t'
-       << seq << '\t'
-       << (qual.size() ? qual : "*")
-       << aux.to_string();
-    return ss.str();
+void vargas::SAM::Record::append_to(std::string &out) const {
+    const auto str = [&out](const std::string &s) {
+        if (s.empty()) out += '*';
+        else out += s;
+        out += '\t';
+    };
+    const auto num = [&out](int v) {
+        rg::append_int(out, v);
+        out += '\t';
+    };
+    str(query_name);
+    num(int(flag.encode()));
+    str(ref_name);
+    num(pos);
+    num(mapq);
+    cigar.append_to(out);
+    out += '\t';
+    str(ref_next);
+    num(pos_next);
+    num(tlen);
+    out += seq;
+    out += '\t';
+    if (qual.empty()) out += '*';
+    else out += qual;
+    aux.append_to(out);
 }
 
-void vargas::SAM::Record::parse(std::string line) {
-    std::vector<std::string> cols = rg::split(line, '\t');
-    if (cols.size() < 11) throw std::invalid_argument("Record should have at least 11 columns");
+void vargas::SAM::Record::parse(const std::string &line) {
+    RecordView view;
+    if (!view.parse(line.data(), line.data() + line.length()))
+        throw std::invalid_argument("Record should have at least 11 columns");
     try {
-        query_name = cols[0];
-        flag = std::stoi(cols[1]);
-        ref_name = cols[2];
-        pos = std::stoi(cols[3]);
-        mapq = std::stoi(cols[4]);
-        cigar = cols[5];
-        ref_next = cols[6];
-        pos_next = std::stoi(cols[7]);
-        tlen = std::stoi(cols[8]);
-        seq = cols[9];
-        qual = cols[10];
-        aux.clear();
+        view.to_record(*this);
     } catch (std::exception &e) {
         throw std::invalid_argument("Error parsing SAM record:\n" + line);
     }
+}
+
+bool vargas::SAM::RecordView::parse(const char *beg, const char *end) {
+    const char *p = beg;
+    bool more = true;
+    for (size_t c = 0; c < cols.size(); ++c) {
+        if (!more) return false; // Fewer columns
+        const char *tab = std::find(p, end, '\t');
+        cols[c] = rg::StrRef(p, tab);
+        if (tab == end) more = false;
+        else p = tab + 1;
+    }
+    aux = more ? rg::StrRef(p, end) : rg::StrRef();
+    return true;
+}
+
+namespace {
+  /**
+   * @brief
+   * Call f(tag, fmt, value) for each optional field. Untyped fields (XX:value) are strings.
+   */
+  template<typename F>
+  void for_each_aux(rg::StrRef aux, F f) {
+      const char *p = aux.begin();
+      while (p < aux.end()) {
+          const char *tab = std::find(p, aux.end(), '\t');
+          const rg::StrRef field(p, tab);
+          p = tab + 1;
+          if (field.empty()) continue;
+          if (field.size() >= 5 && field[2] == ':' && field[4] == ':') {
+              if (!f(rg::StrRef(field.ptr, 2), field[3], rg::StrRef(field.begin() + 5, field.end()))) return;
+          } else if (field.size() >= 3 && field[2] == ':') {
+              if (!f(rg::StrRef(field.ptr, 2), 'Z', rg::StrRef(field.begin() + 3, field.end()))) return;
+          } else throw std::invalid_argument("Invalid format: " + field.str());
+      }
+  }
+}
+
+bool vargas::SAM::RecordView::aux_get(const char *tag, rg::StrRef &val, char &fmt) const {
+    bool found = false;
+    for_each_aux(aux, [&](rg::StrRef t, char f, rg::StrRef v) {
+        if (t[0] != tag[0] || t[1] != tag[1]) return true;
+        val = v;
+        fmt = f;
+        found = true;
+        return false;
+    });
+    return found;
+}
+
+/**
+ * @brief
+ * Column of a required field name.
+ * @return false if tag is not a required field
+ */
+static bool required_col(const std::string &tag, vargas::SAM::RecordView::Col &col) {
+    using RV = vargas::SAM::RecordView;
+    using R = vargas::SAM::Record;
+    static const std::unordered_map<std::string, RV::Col> required = {
+    {R::REQUIRED_QNAME, RV::QNAME}, {R::REQUIRED_FLAG, RV::FLAG}, {R::REQUIRED_RNAME, RV::RNAME},
+    {R::REQUIRED_POS, RV::POS}, {R::REQUIRED_MAPQ, RV::MAPQ}, {R::REQUIRED_CIGAR, RV::CIGAR},
+    {R::REQUIRED_RNEXT, RV::RNEXT}, {R::REQUIRED_PNEXT, RV::PNEXT}, {R::REQUIRED_TLEN, RV::TLEN},
+    {R::REQUIRED_SEQ, RV::SEQ}, {R::REQUIRED_QUAL, RV::QUAL}};
+    const auto r = required.find(tag);
+    if (r == required.end()) return false;
+    col = r->second;
+    return true;
+}
+
+bool vargas::SAM::RecordView::get(const Header &hdr, const std::string &tag, std::string &val) const {
+    if (tag.length() > 3 && tag.substr(0, 3) == "RG:") {
+        rg::StrRef id;
+        char fmt;
+        if (!aux_get("RG", id, fmt)) return false;
+        const auto f = hdr.read_groups.find(id.str());
+        return f != hdr.read_groups.end() && f->second.aux.get(tag.substr(3), val);
+    }
+    Col c;
+    if (required_col(tag, c)) {
+        val = cols[c].str();
+        return true;
+    }
+    rg::StrRef v;
+    char fmt;
+    if (tag.length() != 2 || !aux_get(tag.c_str(), v, fmt)) return false;
+    val = v.str();
+    return true;
+}
+
+vargas::SAM::Projection::Projection(const std::vector<std::string> &tags, const Header &hdr) {
+    std::vector<std::string> rg_tags;
+    for (const auto &tag : tags) {
+        Column c;
+        c.kind = NONE;
+        if (tag.length() > 3 && tag.substr(0, 3) == "RG:") {
+            c.kind = READ_GROUP;
+            c.rg = rg_tags.size();
+            rg_tags.push_back(tag.substr(3));
+        } else if (required_col(tag, c.col)) {
+            c.kind = REQUIRED;
+        } else if (tag.length() == 2) {
+            c.kind = AUX;
+            c.tag[0] = tag[0];
+            c.tag[1] = tag[1];
+        }
+        _cols.push_back(c);
+    }
+    _use_rg = !rg_tags.empty();
+    if (!_use_rg) return;
+    for (const auto &g : hdr.read_groups) {
+        _groups.emplace_back(g.first, std::vector<std::pair<bool, std::string>>(rg_tags.size()));
+        auto &vals = _groups.back().second;
+        for (size_t i = 0; i < rg_tags.size(); ++i) vals[i].first = g.second.aux.get(rg_tags[i], vals[i].second);
+    }
+    std::sort(_groups.begin(), _groups.end()); // Binary searched by ID
+}
+
+bool vargas::SAM::Projection::_value(const RecordView &view, const Column &c, rg::StrRef &val) const {
+    char fmt;
+    switch (c.kind) {
+        case REQUIRED:
+            val = view.cols[c.col];
+            return true;
+        case AUX:
+            return view.aux_get(c.tag, val, fmt);
+        default:
+            return false;
+    }
+}
 
-    // Aux fields
-    for (size_t i = 11; i < cols.size(); ++i) {
-        aux.add(cols[i]);
+void vargas::SAM::Projection::append_row(const RecordView &view, std::string &out,
+                                         std::vector<char> &missing, bool tsv) const {
+    missing.resize(_cols.size(), false);
+    const std::vector<std::pair<bool, std::string>> *group = nullptr;
+    rg::StrRef id;
+    char fmt;
+    if (_use_rg && view.aux_get("RG", id, fmt)) {
+        const auto g = std::lower_bound(_groups.begin(), _groups.end(), id,
+                                        [](const decltype(_groups)::value_type &a, const rg::StrRef &b) {
+                                            return std::lexicographical_compare(a.first.begin(), a.first.end(),
+                                                                                b.begin(), b.end());
+                                        });
+        if (g != _groups.end() && id == rg::StrRef(g->first)) group = &g->second;
     }
 
+    rg::StrRef val;
+    for (size_t i = 0; i < _cols.size(); ++i) {
+        const Column &c = _cols[i];
+        bool found;
+        if (c.kind == READ_GROUP) {
+            found = group && (*group)[c.rg].first;
+            if (found) val = rg::StrRef((*group)[c.rg].second);
+        } else found = _value(view, c, val);
+        if (!tsv) out += '"';
+        if (found) out.append(val.begin(), val.end());
+        else {
+            out += '*';
+            missing[i] = true;
+        }
+        if (!tsv) out += '"';
+        out += tsv ? '\t' : ',';
+    }
+    if (_cols.size()) out.back() = '\n';
+}
+
+void vargas::SAM::RecordView::to_record(Record &r) const {
+    r.query_name.assign(cols[QNAME].begin(), cols[QNAME].end());
+    r.flag = unsigned(integer(FLAG));
+    r.ref_name.assign(cols[RNAME].begin(), cols[RNAME].end());
+    r.pos = integer(POS);
+    r.mapq = integer(MAPQ);
+    r.cigar.parse(cols[CIGAR]);
+    r.ref_next.assign(cols[RNEXT].begin(), cols[RNEXT].end());
+    r.pos_next = integer(PNEXT);
+    r.tlen = integer(TLEN);
+    r.seq.assign(cols[SEQ].begin(), cols[SEQ].end());
+    r.qual.assign(cols[QUAL].begin(), cols[QUAL].end());
+    r.aux.clear();
+    for_each_aux(aux, [&r](rg::StrRef t, char f, rg::StrRef v) {
+        r.aux.set_text(t, f, v);
+        return true;
+    });
 }
 
 bool vargas::SAM::Record::get_required(const std::string &tag, std::string &val) const {
@@ -368,6 +576,328 @@ bool vargas::SAM::Record::get_required(const std::string &tag, std::string &val)
     return true;
 }
 
+namespace {
+  const char BAM_CIGAR_OPS[] = "MIDNSHP=XB";
+
+  template<typename T>
+  T bam_aux_read(const uint8_t *&p) {
+      T v;
+      std::memcpy(&v, p, sizeof(T));
+      p += sizeof(T);
+      return v;
+  }
+
+  /**
+   * @brief
+   * Size of an aux value of type t, 0 if not fixed size.
+   */
+  size_t bam_aux_size(char t) {
+      switch (t) {
+          case 'A': case 'c': case 'C': return 1;
+          case 's': case 'S': return 2;
+          case 'i': case 'I': case 'f': return 4;
+          case 'd': return 8;
+          default: return 0;
+      }
+  }
+
+  long long bam_aux_int(char t, const uint8_t *&p) {
+      switch (t) {
+          case 'c': return bam_aux_read<int8_t>(p);
+          case 'C': return bam_aux_read<uint8_t>(p);
+          case 's': return bam_aux_read<int16_t>(p);
+          case 'S': return bam_aux_read<uint16_t>(p);
+          case 'i': return bam_aux_read<int32_t>(p);
+          case 'I': return bam_aux_read<uint32_t>(p);
+          default: throw std::invalid_argument(std::string("Invalid BAM aux type: ") + t);
+      }
+  }
+
+  std::string bam_aux_value(char t, const uint8_t *&p) {
+      if (t == 'f') return rg::to_string(bam_aux_read<float>(p));
+      if (t == 'd') return rg::to_string(bam_aux_read<double>(p));
+      return std::to_string(bam_aux_int(t, p));
+  }
+
+  /**
+   * @brief
+   * Smallest BAM integer type holding v.
+   */
+  char bam_int_type(long long v) {
+      if (v < 0) return v >= INT8_MIN ? 'c' : v >= INT16_MIN ? 's' : 'i';
+      return v <= UINT8_MAX ? 'C' : v <= UINT16_MAX ? 'S' : 'I';
+  }
+
+  template<typename T>
+  void bam_aux_put(std::string &buf, T v) {
+      buf.append(reinterpret_cast<const char *>(&v), sizeof(T));
+  }
+
+  void bam_aux_put_int(std::string &buf, char t, long long v) {
+      switch (t) {
+          case 'c': bam_aux_put<int8_t>(buf, v); break;
+          case 'C': bam_aux_put<uint8_t>(buf, v); break;
+          case 's': bam_aux_put<int16_t>(buf, v); break;
+          case 'S': bam_aux_put<uint16_t>(buf, v); break;
+          case 'i': bam_aux_put<int32_t>(buf, v); break;
+          case 'I': bam_aux_put<uint32_t>(buf, v); break;
+          default: throw std::invalid_argument(std::string("Invalid BAM integer type: ") + t);
+      }
+  }
+
+  void bam_aux_put(std::string &buf, char t, const std::string &val) {
+      if (t == 'f') bam_aux_put<float>(buf, std::stof(val));
+      else bam_aux_put_int(buf, t, std::stoll(val));
+  }
+
+  std::string hts_header_text(bam_hdr_t *h) {
+      #if defined(HTS_VERSION) && HTS_VERSION >= 101000
+      return std::string(sam_hdr_str(h), sam_hdr_length(h));
+      #else
+      return std::string(h->text, h->l_text);
+      #endif
+  }
+
+  bam_hdr_t *hts_header(const std::string &text) {
+      #if defined(HTS_VERSION) && HTS_VERSION >= 101000
+      bam_hdr_t *h = sam_hdr_init();
+      if (h && sam_hdr_add_lines(h, text.c_str(), text.length()) < 0) {
+          sam_hdr_destroy(h);
+          return nullptr;
+      }
+      return h;
+      #else
+      bam_hdr_t *h = sam_hdr_parse(text.length(), text.c_str());
+      if (!h) return nullptr;
+      h->l_text = text.length();
+      h->text = (char *) malloc(text.length() + 1);
+      std::memcpy(h->text, text.c_str(), text.length() + 1);
+      return h;
+      #endif
+  }
+}
+
+void vargas::SAM::Record::from_bam(const bam_hdr_t *h, const bam1_t *b) {
+    const bam1_core_t &c = b->core;
+    query_name = bam_get_qname(b);
+    flag.decode(c.flag);
+    ref_name = c.tid < 0 ? "*" : h->target_name[c.tid];
+    pos = int(c.pos + 1);
+    mapq = c.qual;
+    ref_next = c.mtid < 0 ? "*" : c.mtid == c.tid ? "=" : h->target_name[c.mtid];
+    pos_next = int(c.mpos + 1);
+    tlen = int(c.isize);
+
+    cigar.clear();
+    const uint32_t *cig = bam_get_cigar(b);
+    for (uint32_t i = 0; i < c.n_cigar; ++i) {
+        cigar.push_back(bam_cigar_oplen(cig[i]), BAM_CIGAR_OPS[bam_cigar_op(cig[i])]);
+    }
+
+    const uint8_t *bseq = bam_get_seq(b), *bqual = bam_get_qual(b);
+    if (c.l_qseq == 0) {
+        seq = "*";
+        qual = "*";
+    } else {
+        seq.resize(c.l_qseq);
+        for (int i = 0; i < c.l_qseq; ++i) seq[i] = seq_nt16_str[bam_seqi(bseq, i)];
+        if (bqual[0] == 0xff) qual = "*";
+        else {
+            qual.resize(c.l_qseq);
+            for (int i = 0; i < c.l_qseq; ++i) qual[i] = char(bqual[i] + 33);
+        }
+    }
+
+    aux.clear();
+    const uint8_t *p = bam_get_aux(b), *end = b->data + b->l_data;
+    std::string val;
+    while (p + 3 <= end) {
+        const std::string tag(reinterpret_cast<const char *>(p), 2);
+        const char t = p[2];
+        p += 3;
+        if (t == 'A') {
+            const char c = char(*p++);
+            aux.set_text(rg::StrRef(tag), 'A', rg::StrRef(&c, 1));
+        } else if (t == 'Z' || t == 'H') {
+            const uint8_t *e = static_cast<const uint8_t *>(std::memchr(p, 0, end - p));
+            if (!e) throw std::invalid_argument("Unterminated BAM aux string in " + query_name);
+            aux.set_text(rg::StrRef(tag), t, rg::StrRef(reinterpret_cast<const char *>(p), e - p));
+            p = e + 1;
+        } else if (t == 'B') {
+            const char sub = *p++;
+            const uint32_t n = bam_aux_read<uint32_t>(p);
+            if (!bam_aux_size(sub) || p + n * bam_aux_size(sub) > end)
+                throw std::invalid_argument("Invalid BAM aux array in " + query_name);
+            val = std::string(1, sub);
+            for (uint32_t i = 0; i < n; ++i) {
+                val += ',';
+                val += bam_aux_value(sub, p);
+            }
+            aux.set_text(rg::StrRef(tag), 'B', rg::StrRef(val));
+        } else {
+            if (!bam_aux_size(t) || p + bam_aux_size(t) > end)
+                throw std::invalid_argument(std::string("Invalid BAM aux type: ") + t);
+            if (t == 'f') aux.set(tag, bam_aux_read<float>(p));
+            else if (t == 'd') aux.set(tag, bam_aux_read<double>(p));
+            else aux.set(tag, bam_aux_int(t, p));
+        }
+    }
+}
+
+void vargas::SAM::Record::to_bam(const bam_hdr_t *h, bam1_t *b) const {
+    const bool has_seq = seq != "*" && !seq.empty();
+    const bool has_qual = has_seq && qual != "*" && qual.length() == seq.length();
+    const size_t l_qname = query_name.length() + 1, l_extranul = (4 - l_qname % 4) % 4;
+    const size_t l_qseq = has_seq ? seq.length() : 0;
+    const size_t l_data = l_qname + l_extranul + 4 * cigar.size() + (l_qseq + 1) / 2 + l_qseq;
+    if (l_qname > 255) throw std::invalid_argument("Query name too long for BAM: " + query_name);
+
+    if (b->m_data < l_data) {
+        size_t m = l_data;
+        kroundup32(m);
+        uint8_t *d = (uint8_t *) realloc(b->data, m);
+        if (!d) throw std::bad_alloc();
+        b->data = d;
+        b->m_data = m;
+    }
+    b->l_data = int(l_data);
+
+    bam1_core_t &c = b->core;
+    c.tid = ref_name == "*" ? -1 : bam_name2id(const_cast<bam_hdr_t *>(h), ref_name.c_str());
+    c.pos = pos - 1;
+    c.qual = uint8_t(mapq);
+    c.flag = uint16_t(flag.encode());
+    c.l_qname = uint16_t(l_qname + l_extranul);
+    c.l_extranul = uint8_t(l_extranul);
+    c.n_cigar = uint32_t(cigar.size());
+    c.l_qseq = int32_t(l_qseq);
+    c.mtid = ref_next == "*" ? -1 : ref_next == "=" ? c.tid : bam_name2id(const_cast<bam_hdr_t *>(h), ref_next.c_str());
+    c.mpos = pos_next - 1;
+    c.isize = tlen;
+
+    uint8_t *d = b->data;
+    std::memcpy(d, query_name.c_str(), l_qname);
+    std::memset(d + l_qname, 0, l_extranul);
+    d += l_qname + l_extranul;
+
+    uint32_t *cig = reinterpret_cast<uint32_t *>(d);
+    for (size_t i = 0; i < cigar.size(); ++i) {
+        const char *op = std::strchr(BAM_CIGAR_OPS, cigar.at(i).second);
+        if (!op || !*op) throw std::invalid_argument("Invalid CIGAR operator in " + query_name);
+        cig[i] = uint32_t(cigar.at(i).first << BAM_CIGAR_SHIFT) | uint32_t(op - BAM_CIGAR_OPS);
+    }
+    d += 4 * cigar.size();
+    const int64_t rlen = c.n_cigar ? bam_cigar2rlen(c.n_cigar, cig) : 1;
+    c.bin = uint16_t(hts_reg2bin(c.pos < 0 ? 0 : c.pos, (c.pos < 0 ? 0 : c.pos) + (rlen ? rlen : 1), 14, 5));
+
+    std::memset(d, 0, (l_qseq + 1) / 2);
+    for (size_t i = 0; i < l_qseq; ++i) d[i >> 1] |= seq_nt16_table[(unsigned char) seq[i]] << ((~i & 1) << 2);
+    d += (l_qseq + 1) / 2;
+    if (has_qual) for (size_t i = 0; i < l_qseq; ++i) d[i] = uint8_t(qual[i] - 33);
+    else std::memset(d, 0xff, l_qseq);
+
+    std::string buf;
+    aux.for_each([&](const Optional::Field &f) {
+        const std::string tag(f.tag, f.tag[1] ? 2 : 1);
+        if (tag.length() != 2) throw std::invalid_argument("Invalid aux tag: " + tag);
+        buf.clear();
+        char t = f.fmt;
+        if (f.kind == Optional::Field::Kind::INT) {
+            t = bam_int_type(f.i);
+            bam_aux_put_int(buf, t, f.i);
+        } else if (f.kind == Optional::Field::Kind::REAL) {
+            t = 'f';
+            bam_aux_put<float>(buf, float(f.f));
+        } else if (t == 'A') {
+            if (f.text.length() != 1) throw std::invalid_argument("Invalid character tag " + tag + ":A:" + f.text);
+            buf = f.text;
+        } else if (t == 'Z' || t == 'H') {
+            buf.assign(f.text.c_str(), f.text.length() + 1);
+        } else if (t == 'i') {
+            const long long v = std::stoll(f.text);
+            t = bam_int_type(v);
+            bam_aux_put_int(buf, t, v);
+        } else if (t == 'f') {
+            bam_aux_put(buf, t, f.text);
+        } else if (t == 'B') {
+            const auto vals = rg::split(f.text, ',');
+            if (vals.empty() || vals[0].length() != 1) throw std::invalid_argument("Invalid array tag " + tag);
+            buf += vals[0][0];
+            bam_aux_put<uint32_t>(buf, vals.size() - 1);
+            for (size_t i = 1; i < vals.size(); ++i) bam_aux_put(buf, vals[0][0], vals[i]);
+        } else throw std::invalid_argument("Invalid aux type " + tag + ":" + t);
+        bam_aux_append(b, tag.c_str(), t, int(buf.length()), reinterpret_cast<const uint8_t *>(buf.data()));
+    });
+}
+
+char vargas::SAM::hts_format(const std::string &file_name) {
+    if (rg::ends_with(file_name, ".bam")) return 'b';
+    if (rg::ends_with(file_name, ".cram")) return 'c';
+    return 0;
+}
+
+vargas::SAMBatchReader::SAMBatchReader(const std::string &file_name, size_t block_size) :
+_buf(std::max<size_t>(block_size, 64)) {
+    if (file_name.empty()) _in = &std::cin;
+    else {
+        _file.open(file_name);
+        if (!_file.good()) throw std::invalid_argument("Error opening file \"" + file_name + "\"");
+        _in = &_file;
+    }
+
+    std::string hdr;
+    rg::StrRef line;
+    while (_line(line, false)) {
+        if (!line.empty() && line[0] != '@') {
+            _beg = line.begin() - _buf.data(); // Leave the first record
+            break;
+        }
+        hdr.append(line.begin(), line.end());
+        hdr += '\n';
+    }
+    if (hdr.length()) _hdr << hdr;
+}
+
+bool vargas::SAMBatchReader::_line(rg::StrRef &line, bool pinned) {
+    while (true) {
+        const char *b = _buf.data() + _beg, *e = _buf.data() + _end;
+        const char *nl = static_cast<const char *>(std::memchr(b, '\n', e - b));
+        if (nl || (_eof && b != e)) {
+            if (!nl) nl = e;
+            _beg = nl - _buf.data() + (nl != e);
+            if (nl != b && nl[-1] == '\r') --nl;
+            line = rg::StrRef(b, nl);
+            return true;
+        }
+        if (_eof) return false;
+        if (_end == _buf.size()) {
+            if (pinned) return false; // Moving the buffer would invalidate views
+            if (_beg == 0) _buf.resize(_buf.size() * 2); // Line longer than the buffer
+            else {
+                std::memmove(_buf.data(), b, e - b);
+                _end -= _beg;
+                _beg = 0;
+            }
+        }
+        _in->read(_buf.data() + _end, _buf.size() - _end);
+        const size_t n = _in->gcount();
+        _end += n;
+        if (n == 0) _eof = true;
+    }
+}
+
+size_t vargas::SAMBatchReader::next(std::vector<SAM::RecordView> &views, size_t max_records) {
+    views.clear();
+    rg::StrRef line;
+    while (views.size() < max_records && _line(line, !views.empty())) {
+        if (line.empty()) continue;
+        views.emplace_back();
+        if (!views.back().parse(line.begin(), line.end()))
+            throw std::invalid_argument("Record should have at least 11 columns:\n" + line.str());
+    }
+    return views.size();
+}
+
 void vargas::isam::open(std::istream &is) {
     std::ostringstream hdr;
     while (std::getline(is, _curr_line) && _curr_line.at(0) == '@') {
@@ -380,7 +910,10 @@ void vargas::isam::open(std::istream &is) {
 
 void vargas::isam::open(std::string file_name) {
     close();
-    if (file_name.length() == 0) {
+    if (hts_format(file_name)) {
+        _use_stdio = false;
+        _open_hts(file_name);
+    } else if (file_name.length() == 0) {
         _use_stdio = true;
         open(std::cin);
     }
@@ -392,23 +925,47 @@ void vargas::isam::open(std::string file_name) {
     }
 }
 
-void vargas::isam::subset(size_t n) {
-    if (!good()) throw std::invalid_argument("No records available.");
-    std::vector<Record> pending;
-    do { pending.push_back(_pprec); } while (next());
-    if (pending.size() == 0) throw std::invalid_argument("No records available.");
+void vargas::isam::_open_hts(const std::string &file_name) {
+    _hts = sam_open(file_name.c_str(), "r");
+    if (!_hts) throw std::invalid_argument("Error opening file \"" + file_name + "\"");
+    if (_pool) _pool->attach(_hts);
+    _hts_hdr = sam_hdr_read(_hts);
+    if (!_hts_hdr) {
+        close();
+        throw std::invalid_argument("Invalid BAM/CRAM header in \"" + file_name + "\"");
+    }
+    const std::string text = hts_header_text(_hts_hdr);
+    if (text.length()) _hdr << text;
+    _bam = bam_init1();
+    if (sam_read1(_hts, _hts_hdr, _bam) >= 0) _pprec.from_bam(_hts_hdr, _bam);
+}
 
-    std::vector<size_t> idx(pending.size());
-    std::iota(idx.begin(), idx.end(), 0);
-    std::random_shuffle(idx.begin(), idx.begin());
+void vargas::isam::close() {
+    in.close();
+    if (_bam) bam_destroy1(_bam);
+    if (_hts_hdr) bam_hdr_destroy(_hts_hdr);
+    if (_hts) sam_close(_hts);
+    _bam = nullptr;
+    _hts_hdr = nullptr;
+    _hts = nullptr;
+    _hdr = SAM::Header();
+    _pprec = SAM::Record();
+}
 
-    if (n >= pending.size() || n == 0) {
-        _buff = pending;
+void vargas::isam::subset(size_t n, uint64_t seed) {
+    if (!good()) throw std::invalid_argument("No records available.");
+    std::vector<Record> pending;
+    if (n == 0) {
+        do { pending.push_back(std::move(_pprec)); } while (next());
     } else {
-        for (size_t i = 0; i < n; ++i) {
-            _buff.push_back(pending[idx[i]]);
-        }
+        rg::Reservoir<Record> sample(n, seed);
+        do { sample.add(std::move(_pprec)); } while (next());
+        pending = sample.take();
     }
+    if (pending.size() == 0) throw std::invalid_argument("No records available.");
+
+    // _buff is consumed from the back, keep it reversed so records come out in file order
+    _buff.assign(std::make_move_iterator(pending.rbegin()), std::make_move_iterator(pending.rend()));
     next();
 }
 
@@ -419,6 +976,14 @@ bool vargas::isam::next() {
         return true;
     }
 
+    if (_hts) {
+        const int ret = sam_read1(_hts, _hts_hdr, _bam);
+        if (ret < -1) throw std::runtime_error("Truncated or corrupt BAM/CRAM record.");
+        if (ret < 0) return false;
+        _pprec.from_bam(_hts_hdr, _bam);
+        return true;
+    }
+
     if (!std::getline((_use_stdio ? std::cin : in), _curr_line)) return false;
     _pprec.parse(_curr_line);
     return true;
@@ -426,6 +991,19 @@ bool vargas::isam::next() {
 
 void vargas::osam::open(std::string file_name) {
     close();
+    if (const char fmt = hts_format(file_name)) {
+        _use_stdio = false;
+        _open_hts(file_name, fmt);
+        return;
+    }
+    if (ResultsFormat::is_results(file_name)) {
+        _use_stdio = false;
+        _results = std::make_shared<ResultsFormat>(_hdr);
+        out.open(file_name, std::ios::binary);
+        if (!out.good()) throw std::invalid_argument("Error opening output file \"" + file_name + "\"");
+        out << _results->header() << std::flush;
+        return;
+    }
     if (file_name.length() == 0) _use_stdio = true;
     else {
         _use_stdio = false;
@@ -435,19 +1013,86 @@ void vargas::osam::open(std::string file_name) {
     (_use_stdio ? std::cout : out) << _hdr.to_string() << std::flush;
 }
 
+void vargas::osam::_open_hts(const std::string &file_name, char fmt) {
+    _hts = sam_open(file_name.c_str(), fmt == 'c' ? "wc" : "wb");
+    if (!_hts) throw std::invalid_argument("Error opening output file \"" + file_name + "\"");
+    if (fmt == 'c') hts_set_opt(_hts, CRAM_OPT_NO_REF, 1);
+    if (_pool) _pool->attach(_hts);
+    _hts_hdr = hts_header(_hdr.to_string());
+    if (!_hts_hdr || sam_hdr_write(_hts, _hts_hdr) < 0) {
+        close();
+        throw std::invalid_argument("Error writing header to \"" + file_name + "\"");
+    }
+    _bam = bam_init1();
+}
+
+void vargas::osam::close() {
+    if (out.is_open()) {
+        out.close();
+    }
+    if (_use_stdio) std::cout.flush();
+    if (_bam) bam_destroy1(_bam);
+    if (_hts_hdr) bam_hdr_destroy(_hts_hdr);
+    if (_hts) sam_close(_hts);
+    _bam = nullptr;
+    _hts_hdr = nullptr;
+    _hts = nullptr;
+    _results.reset();
+}
+
+void vargas::osam::add_record(const SAM::Record &r) {
+    if (!good()) throw std::invalid_argument("No valid file open.");
+    if (_hts) {
+        r.to_bam(_hts_hdr, _bam);
+        if (sam_write1(_hts, _hts_hdr, _bam) < 0) throw std::runtime_error("Error writing record " + r.query_name);
+        return;
+    }
+    _line.clear();
+    if (_results) _results->append_block(std::vector<const SAM::Record *>{&r}, _line);
+    else {
+        r.append_to(_line);
+        _line += '\n';
+    }
+    (_use_stdio ? std::cout : out).write(_line.data(), _line.size());
+}
+
+void vargas::osam::write(const std::string &buf) {
+    if (!good()) throw std::invalid_argument("No valid file open.");
+    if (!_hts) {
+        (_use_stdio ? std::cout : out).write(buf.data(), buf.size());
+        return;
+    }
+    // Let htslib parse the text records straight into BAM
+    size_t beg = 0, end;
+    while (beg < buf.length()) {
+        end = buf.find('\n', beg);
+        if (end == std::string::npos) end = buf.length();
+        if (end > beg) {
+            _line.assign(buf, beg, end - beg);
+            kstring_t ks = {_line.length(), _line.capacity() + 1, &_line[0]};
+            if (sam_parse1(&ks, _hts_hdr, _bam) < 0) throw std::runtime_error("Invalid SAM record: " + _line);
+            if (sam_write1(_hts, _hts_hdr, _bam) < 0) throw std::runtime_error("Error writing BAM/CRAM record.");
+        }
+        beg = end + 1;
+    }
+}
+
 vargas::Cigar vargas::Cigar::operator=(const std::string &s) {
     parse(s);
     return *this;
 }
 
-void vargas::Cigar::parse(const std::string &s) {
+void vargas::Cigar::parse(rg::StrRef s) {
     _cigar.clear();
-    if (s.length() < 2) return;
-    size_t prev = 0, curr;
-    while (prev != s.length()) {
-        curr = s.find_first_of(CIGAR_OPERATORS, prev);
-        _cigar.push_back(std::pair<size_t, char>(prev == curr ? 1 : std::stoi(s.substr(prev, curr)), s[curr]));
-        prev = ++curr;
+    if (s.size() < 2) return;
+    const char *p = s.begin(), *op;
+    while (p != s.end()) {
+        op = std::find_first_of(p, s.end(), CIGAR_OPERATORS, CIGAR_OPERATORS + sizeof(CIGAR_OPERATORS) - 1);
+        if (op == s.end()) throw std::invalid_argument("Invalid CIGAR: " + s.str());
+        size_t len = 1;
+        if (op != p && !rg::parse_int(rg::StrRef(p, op), len)) throw std::invalid_argument("Invalid CIGAR: " + s.str());
+        _cigar.emplace_back(len, *op);
+        p = op + 1;
     }
 }
 
@@ -484,6 +1129,90 @@ TEST_CASE ("SAM Optional") {
         CHECK(o.get("d", val));
         CHECK(val == "DD");
     }
+
+    SUBCASE("Insertion order and overflow") {
+        for (int i = 0; i < 12; ++i) o.set("t" + std::to_string(i % 10), i);
+        o.set("b", 5);
+        CHECK(o.size() == 14);
+        std::string s = o.to_string();
+        CHECK(s.find("\ta:Z:b\tb:i:5\t") == 0);
+        CHECK(s.find("\td:Z:DD\tt0:i:10\tt1:i:11\tt2:i:2") != std::string::npos);
+        long long val;
+        CHECK(o.get("t1", val));
+        CHECK(val == 11);
+        CHECK(o.find("t2")->kind == vargas::SAM::Optional::Field::Kind::INT);
+        CHECK_FALSE(o.get("zz", val));
+
+        // Erasing an inline field pulls the first overflow field in
+        CHECK(o.erase("b"));
+        CHECK(o.erase("t9"));
+        CHECK_FALSE(o.erase("b"));
+        CHECK(o.size() == 12);
+        s = o.to_string();
+        CHECK(s.find("\ta:Z:b\tc:f:") == 0);
+        CHECK(s.find("\tt3:i:3\tt4:i:4\tt5:i:5") != std::string::npos);
+        CHECK(s.find("t9") == std::string::npos);
+        CHECK(o.get("t1", val));
+        CHECK(val == 11);
+        o.clear();
+        CHECK(o.size() == 0);
+        CHECK(o.to_string() == "");
+    }
+
+    SUBCASE("Parse") {
+        vargas::SAM::Optional p;
+        p.add("NM:i:-3");
+        p.add("MD:Z:10A5");
+        p.add("XS:f:1.5");
+        p.add("RG:grp");
+        CHECK(p.find("NM")->kind == vargas::SAM::Optional::Field::Kind::INT);
+        CHECK(p.find("NM")->i == -3);
+        CHECK(p.find("XS")->kind == vargas::SAM::Optional::Field::Kind::TEXT);
+        CHECK(p.to_string() == "\tNM:i:-3\tMD:Z:10A5\tXS:f:1.5\tRG:Z:grp");
+        CHECK_THROWS(p.add("NM"));
+        CHECK_THROWS(p.set("ABC", 1));
+    }
+}
+
+TEST_CASE ("SAM serializer") {
+    vargas::SAM::Record r;
+    r.query_name = "q1";
+    r.flag = 16;
+    r.ref_name = "chr1";
+    r.pos = 1234567;
+    r.mapq = 0;
+    r.cigar = "3S10M2I1000D";
+    r.pos_next = -99;
+    r.tlen = -2147483647 - 1;
+    r.seq = "ACGT";
+    r.aux.set("AS", -300);
+    r.aux.set("XL", std::numeric_limits<long long>::min());
+    r.aux.set("XU", std::numeric_limits<long long>::max());
+    r.aux.set("XF", 0.25);
+    r.aux.set("RG", "grp");
+    r.aux.add("XA:A:c");
+
+    const std::string expected = "q1\t16\tchr1\t1234567\t0\t3S10M2I1000D\t*\t-99\t-2147483648\tACGT\t*"
+    "\tAS:i:-300\tXL:i:-9223372036854775808\tXU:i:9223372036854775807\tXF:f:0.250000\tRG:Z:grp\tXA:A:c";
+    CHECK(r.to_string() == expected);
+
+    std::string buf = "x\n";
+    r.append_to(buf);
+    r.append_to(buf);
+    CHECK(buf == "x\n" + expected + expected);
+
+    r.aux.set("AS", 7);
+    CHECK(r.aux.to_string().find("\tAS:i:7\t") == 0);
+    r.aux.set("AS", "seven");
+    CHECK(r.aux.to_string().find("\tAS:Z:seven\t") == 0);
+
+    vargas::Cigar c;
+    CHECK(c.to_string() == "*");
+    for (int v : {0, 9, 10, 99, 100, 12345}) {
+        buf.clear();
+        rg::append_int(buf, v);
+        CHECK(buf == std::to_string(v));
+    }
 }
 
 TEST_CASE ("SAM File") {
@@ -631,11 +1360,124 @@ TEST_CASE ("SAM File") {
                 CHECK(orig.record().query_name.length());
                 CHECK_FALSE(orig.next());
             }
+
+            {
+                // Keeping every record preserves file order
+                vargas::isam orig("tmp_s.sam");
+                orig.subset(0);
+                CHECK(orig.record().query_name == "1:497:R:-272+13M17D24M");
+                CHECK(orig.next());
+                CHECK(orig.record().flag.encode() == 99);
+                CHECK(orig.next());
+                CHECK(orig.record().flag.encode() == 147);
+            }
+
+            {
+                // The same seed gives the same sample
+                vargas::isam a("tmp_s.sam"), b("tmp_s.sam");
+                a.subset(2, 7);
+                b.subset(2, 7);
+                std::vector<std::string> ra, rb;
+                do { ra.push_back(a.record().to_string()); } while (a.next());
+                do { rb.push_back(b.record().to_string()); } while (b.next());
+                CHECK(ra.size() == 2);
+                CHECK(ra == rb);
+            }
+        }
+
+        SUBCASE("Batch reader") {
+            // Small blocks force the buffer to be refilled, moved and grown
+            vargas::SAMBatchReader br("tmp_s.sam", 64);
+            vargas::isam orig("tmp_s.sam");
+            CHECK(br.header().read_groups.size() == 2);
+            std::vector<vargas::SAM::RecordView> views;
+            vargas::SAM::Record rec;
+            std::string val;
+            size_t n = 0;
+            while (br.next(views, 3)) {
+                CHECK(views.size() <= 3);
+                for (const auto &v : views) {
+                    if (n++) REQUIRE(orig.next());
+                    v.to_record(rec);
+                    CHECK(rec.to_string() == orig.record().to_string());
+                    CHECK(v.integer(vargas::SAM::RecordView::POS) == orig.record().pos);
+                    REQUIRE(v.get(br.header(), "MD", val));
+                    CHECK(val == orig.record().aux.find("MD")->value());
+                    CHECK_FALSE(v.get(br.header(), "ZZ", val));
+                }
+            }
+            CHECK(n == 4);
+            CHECK_FALSE(orig.next());
+        }
+
+        SUBCASE("Projection") {
+            const std::vector<std::string> tags = {"QNAME", "POS", "RG:ms", "MD", "ZZ", "RG:ZZ", "QUAL"};
+            vargas::SAMBatchReader br("tmp_s.sam");
+            vargas::isam orig("tmp_s.sam");
+            br.header().read_groups.at("UM0098:1").aux.set("ms", 5);
+            orig.header().read_groups.at("UM0098:1").aux.set("ms", 5);
+            const vargas::SAM::Projection proj(tags, br.header());
+            CHECK(proj.size() == tags.size());
+            std::vector<vargas::SAM::RecordView> views;
+            std::vector<char> missing;
+            std::string line, expected, val;
+            REQUIRE(br.next(views, 10) == 4);
+            for (size_t i = 0; i < views.size(); ++i) {
+                if (i) REQUIRE(orig.next());
+                expected.clear();
+                for (const auto &t : tags) {
+                    val = "*";
+                    orig.record().get(orig.header(), t, val);
+                    expected += "\"" + val + "\",";
+                }
+                expected.back() = '\n';
+                line.clear();
+                proj.append_row(views[i], line, missing);
+                CHECK(line == expected);
+            }
+            CHECK(missing == std::vector<char>{false, false, true, false, true, true, false});
+            line.clear();
+            proj.append_row(views[1], line, missing, true);
+            CHECK(line == "19:20389:F:275+18M2D19M\t17644\t5\t37\t*\t*\t>>>>>>>>>>>>>>>>>>>><<>>><<>>4::>>:<9\n");
+        }
+
+        SUBCASE("BAM") {
+            {
+                vargas::isam sf("tmp_s.sam");
+                vargas::osam os("tmp_s.bam", sf.header());
+                do {
+                    os.add_record(sf.record());
+                } while (sf.next());
+            }
+            vargas::isam a("tmp_s.sam");
+            vargas::isam b("tmp_s.bam");
+            CHECK(b.header().sequences.size() == 3);
+            CHECK(b.header().read_groups.size() == 2);
+            size_t n = 0;
+            do {
+                const auto &ar = a.record(), &br = b.record();
+                CHECK(ar.query_name == br.query_name);
+                CHECK(ar.flag.encode() == br.flag.encode());
+                CHECK(ar.ref_name == br.ref_name);
+                CHECK(ar.pos == br.pos);
+                CHECK(ar.mapq == br.mapq);
+                CHECK(ar.cigar.to_string() == br.cigar.to_string());
+                CHECK(br.ref_next == (ar.ref_next == "15" ? "*" : ar.ref_next)); // 15 is not an @SQ, unmapped in BAM
+                CHECK(ar.pos_next == br.pos_next);
+                CHECK(ar.tlen == br.tlen);
+                CHECK(ar.seq == br.seq);
+                CHECK(ar.qual == br.qual);
+                CHECK(ar.aux.to_string() == br.aux.to_string());
+                ++n;
+            } while (a.next() && b.next());
+            CHECK(n == 4);
+            CHECK_FALSE(b.next());
         }
 
     }
 
     remove("tmp_s.sam");
+    remove("tmp_s.bam");
     remove("osam.sam");
 }
 
@@ -94,4 +94,38 @@ TEST_CASE ("Split strings") {
 
 }
 
+TEST_CASE ("Reservoir") {
+    {
+        // Fewer items than the reservoir keeps all of them
+        rg::Reservoir<int> r(10, 1);
+        for (int i = 0; i < 5; ++i) r.add(int(i));
+        CHECK(r.seen() == 5);
+        CHECK(r.take() == std::vector<int>({0, 1, 2, 3, 4}));
+    }
+
+    {
+        rg::Reservoir<int> a(10, 42), b(10, 42);
+        for (int i = 0; i < 1000; ++i) {
+            a.add(int(i));
+            b.add(int(i));
+        }
+        auto sa = a.take();
+        CHECK(sa.size() == 10);
+        CHECK(sa == b.take());
+        CHECK(std::is_sorted(sa.begin(), sa.end()));
+    }
+
+    {
+        // Each of 100 items is kept with probability 1/10
+        std::vector<int> counts(100, 0);
+        for (uint64_t seed = 0; seed < 2000; ++seed) {
+            rg::Reservoir<int> r(10, seed);
+            for (int i = 0; i < 100; ++i) r.add(int(i));
+            for (int i : r.take()) ++counts[i];
+        }
+        CHECK(*std::min_element(counts.begin(), counts.end()) > 130);
+        CHECK(*std::max_element(counts.begin(), counts.end()) < 270);
+    }
+}
+
 #endif
\ No newline at end of file
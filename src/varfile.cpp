@@ -14,6 +14,13 @@
  */
 
 #include "varfile.h"
+#include "htslib/bgzf.h"
+
+#include <cstring>
+#include <unordered_set>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 vargas::Region vargas::parse_region(const std::string &region_str) {
     vargas::Region ret;
@@ -47,6 +54,7 @@ vargas::Region vargas::parse_region(const std::string &region_str) {
 
 void vargas::VCF::set_region(const Region &region) {
     _region = region;
+    _seeked = false;
 }
 
 
@@ -70,60 +78,103 @@ std::vector<std::string> vargas::VCF::seq_names() const {
 bool vargas::VCF::next() {
     if (_limit > 0 && _counter >= _limit) return false;
     if (!_header || !_bcf) return false;
+    if (!_seeked) _seek_region();
     bool seqmatch;
     do {
-        if (bcf_read(_bcf, _header, _curr_rec) != 0) return false;
+        if (_read_record() != 0) return false;
         seqmatch = _region.seq_name.empty() || strcmp(_region.seq_name.c_str(), bcf_seqname(_header, _curr_rec)) == 0;
         if (seqmatch) _entered_contig = true;
         else if (_assume_contig && _entered_contig) return false;
     } while (!seqmatch || unsigned(_curr_rec->pos) < _region.min || (_region.max > 0 && unsigned(_curr_rec->pos) > _region.max));
 
+    _pos = _curr_rec->pos;
     unpack_all();
-    gen_genotypes();
+    _decode_genotypes();
+    const int num_af = bcf_get_info_float(_header, _curr_rec, "AF", &_af, &_af_cap);
+    _info_af.assign(_af, _af + std::max(num_af, 0));
+    _compute_frequencies();
     ++_counter;
     return true;
 }
 
 
 const std::vector<std::string> &vargas::VCF::gen_genotypes() {
-    FormatField<int> gt(_header, _curr_rec, "GT");
-    _genotypes.resize(gt.values.size());
-    for (size_t i = 0; i < _genotypes.size(); ++i) {
-        _genotypes[i] = (_alleles[bcf_gt_allele(gt.values.at(i))]);
+    if (_genotypes_valid) return _genotypes;
+    _genotypes.resize(_gt_n);
+    for (int i = 0; i < _gt_n; ++i) {
+        const int a = bcf_gt_allele(_gt[i]);
+        if (a >= 0 && unsigned(a) < _alleles.size()) _genotypes[i] = _alleles[a];
+        else _genotypes[i] = ".";
     }
+    _genotypes_valid = true;
+    return _genotypes;
+}
 
-    // Map of which indivs have each allele
-    _genotype_indivs.clear();
-    for (auto &allele : alleles()) {
-        _genotype_indivs[allele] = Population(_genotypes.size(), false);
-    }
-    for (size_t s = 0; s < _genotypes.size(); ++s) {
-        _genotype_indivs[_genotypes[s]].set(s);
+
+void vargas::VCF::_decode_genotypes() {
+    constexpr size_t block = 64; // Population core size
+    _genotypes_valid = false;
+    _gt_n = bcf_get_genotypes(_header, _curr_rec, &_gt, &_gt_cap);
+    if (_gt_n < 0) _gt_n = 0;
+
+    const size_t num_alleles = _alleles.size(), n = _gt_n;
+    _allele_pops.resize(num_alleles);
+    for (auto &pop : _allele_pops) pop.assign(n);
+    _gt_words.resize(num_alleles);
+
+    // Build each 64 haplotype block of every population in registers, then store it whole.
+    for (size_t base = 0; base < n; base += block) {
+        std::fill(_gt_words.begin(), _gt_words.end(), 0);
+        const size_t lim = std::min(block, n - base);
+        const int32_t *gt = _gt + base;
+        for (size_t b = 0; b < lim; ++b) {
+            const int a = bcf_gt_allele(gt[b]); // Negative for missing and vector end
+            if (a >= 0 && unsigned(a) < num_alleles) _gt_words[_allele_canon[a]] |= uint64_t(1) << b;
+        }
+        for (size_t a = 0; a < num_alleles; ++a) {
+            if (_gt_words[a]) _allele_pops[a].set_block(base / block, _gt_words[a]);
+        }
     }
 
-    return _genotypes;
+    for (size_t a = 0; a < num_alleles; ++a) {
+        if (_allele_canon[a] != a) _allele_pops[a] = _allele_pops[_allele_canon[a]];
+    }
 }
 
 
-const std::vector<float> &vargas::VCF::frequencies() const {
-    InfoField<float> af(_header, _curr_rec, "AF");
-    static std::vector<float> _allele_freqs;
-    const auto &val = af.values;
-    _allele_freqs.resize(val.size() + 1); // make room for the ref
-    float sum = 0;
+void vargas::VarFile::_compute_frequencies() {
+    const size_t num_alleles = _alleles.size();
+
+    // INFO/AF describes all samples, so it is stale once the ingroup is filtered
+    const bool use_info = _info_af.size() + 1 == num_alleles && _ingroup.size() == _samples.size();
+    if (!use_info && _allele_pops.size() == num_alleles) {
+        _allele_counts.resize(num_alleles);
+        size_t total = 0;
+        for (size_t a = 0; a < num_alleles; ++a) {
+            _allele_counts[a] = _allele_canon[a] == a ? _allele_pops[a].count() : 0;
+            total += _allele_counts[a];
+        }
+        if (total > 0) {
+            _allele_freqs.resize(num_alleles);
+            for (size_t a = 0; a < num_alleles; ++a) {
+                _allele_freqs[a] = float(_allele_counts[_allele_canon[a]]) / total;
+            }
+            return;
+        }
+    }
 
     // Get the ref frequency and add to result vector +1, so we can put ref at index 0
-    for (size_t i = 0; i < val.size(); ++i) {
-        sum += val[i];
-        _allele_freqs[i + 1] = val[i];
+    _allele_freqs.resize(_info_af.size() + 1);
+    float sum = 0;
+    for (size_t i = 0; i < _info_af.size(); ++i) {
+        sum += _info_af[i];
+        _allele_freqs[i + 1] = _info_af[i];
     }
     _allele_freqs[0] = 1 - sum;
-
-    return _allele_freqs;
 }
 
 
-void vargas::VCF::create_ingroup(int percent) {
+void vargas::VarFile::create_ingroup(int percent) {
     _ingroup.clear();
 
     if (percent == 100) {
@@ -141,11 +192,14 @@ void vargas::VCF::create_ingroup(int percent) {
 int vargas::VCF::_init() {
     _assume_contig = false;
     _entered_contig = false;
+    _seeked = false;
     _counter = 0;
+    _num_decoded = 0;
     _limit = 0;
     if (_file_name.length() && _file_name != "-") {
         _bcf = bcf_open(_file_name.c_str(), "r");
         if (!_bcf) return -1;
+        if (_pool) _pool->attach(_bcf);
 
         _header = bcf_hdr_read(_bcf);
         if (_header == nullptr) {
@@ -157,29 +211,98 @@ int vargas::VCF::_init() {
             _samples.emplace_back(_header->samples[i]);
         }
         create_ingroup(100);
+        _load_index();
     }
     return 0;
 }
 
 
+void vargas::VCF::_load_index() {
+    const htsFormat *fmt = hts_get_format(_bcf);
+    if (fmt->format == bcf) {
+        if (rg::file_exists(_file_name + ".csi")) _idx = bcf_index_load(_file_name.c_str());
+    } else if (fmt->format == vcf && fmt->compression == bgzf) {
+        if (rg::file_exists(_file_name + ".tbi") || rg::file_exists(_file_name + ".csi"))
+            _tbx = tbx_index_load(_file_name.c_str());
+    }
+}
+
+
+void vargas::VCF::_seek_region() {
+    _seeked = true;
+    _region_absent = false;
+    if (_itr) {
+        hts_itr_destroy(_itr);
+        _itr = nullptr;
+    }
+    if (!indexed() || _region.seq_name.empty()) return;
+
+    // Index queries are 0 based, half open. A region max of 0 runs to the end of the contig.
+    const int beg = _region.min;
+    const int end = _region.max > 0 ? _region.max + 1 : INT_MAX;
+    const int tid = _tbx ? tbx_name2id(_tbx, _region.seq_name.c_str())
+                         : bcf_hdr_name2id(_header, _region.seq_name.c_str());
+
+    if (tid < 0) _region_absent = true; // No records for the contig
+    else if (_tbx) _itr = tbx_itr_queryi(_tbx, tid, beg, end);
+    else _itr = bcf_itr_queryi(_idx, tid, beg, end);
+
+    if (tid >= 0 && !_itr) {
+        throw std::invalid_argument("Unable to query index of " + _file_name + " for " + _region.seq_name);
+    }
+}
+
+
+int vargas::VCF::_read_record() {
+    if (_region_absent) return -1;
+    int ret;
+    if (!_itr) ret = bcf_read(_bcf, _header, _curr_rec);
+    else if (_tbx) {
+        if (tbx_itr_next(_bcf, _tbx, _itr, &_line) < 0) return -1;
+        ret = vcf_parse(&_line, _header, _curr_rec);
+    } else {
+        if (bcf_itr_next(_bcf, _itr, _curr_rec) < 0) return -1;
+        // bcf_read applies the sample subset, iterator reads do not.
+        ret = _header->keep_samples ? bcf_subset_format(_header, _curr_rec) : 0;
+    }
+    if (ret == 0) ++_num_decoded;
+    return ret;
+}
+
+
 void vargas::VCF::_load_shared() {
-    _alleles.clear();
+    _alleles.resize(_curr_rec->n_allele);
     for (int i = 0; i < _curr_rec->n_allele; ++i) {
-        std::string allele(_curr_rec->d.allele[i]);
+        std::string &allele = _alleles[i];
+        allele = _curr_rec->d.allele[i];
         // Some replacement tag
         if (allele.at(0) == '<') {
-            std::string ref = _curr_rec->d.allele[0];
+            const char *ref = _curr_rec->d.allele[0];
             // Copy number
             if (allele.substr(1, 2) == "CN" && allele.at(3) != 'V') {
                 int copy = std::stoi(allele.substr(3, allele.length() - 4));
-                allele = "";
+                allele.clear();
                 for (int o = 0; o < copy; ++o) allele += ref;
             } else {
                 // Other types are just subbed with the ref.
                 allele = ref;
             }
         }
-        _alleles.push_back(allele);
+    }
+    _find_duplicates();
+}
+
+
+void vargas::VarFile::_find_duplicates() {
+    _allele_canon.resize(_alleles.size());
+    for (unsigned i = 0; i < _alleles.size(); ++i) {
+        _allele_canon[i] = i;
+        for (unsigned j = 0; j < i; ++j) {
+            if (_alleles[j] == _alleles[i]) {
+                _allele_canon[i] = j;
+                break;
+            }
+        }
     }
 }
 
@@ -222,6 +345,10 @@ size_t vargas::VCF::num_haplotypes() const {
 }
 
 void vargas::VCF::close() {
+    if (_itr) hts_itr_destroy(_itr);
+    if (_idx) hts_idx_destroy(_idx);
+    if (_tbx) tbx_destroy(_tbx);
+    free(_line.s);
     if (_bcf) bcf_close(_bcf);
     if (_header != nullptr) {
         bcf_hdr_destroy(_header);
@@ -232,12 +359,437 @@ void vargas::VCF::close() {
     if (_ingroup_cstr != nullptr) {
         free(_ingroup_cstr);
     }
+    free(_gt);
+    free(_af);
+    _gt = nullptr;
+    _af = nullptr;
+    _gt_cap = _gt_n = _af_cap = 0;
     _bcf = nullptr;
     _header = nullptr;
     _curr_rec = nullptr;
     _ingroup_cstr = nullptr;
+    _itr = nullptr;
+    _idx = nullptr;
+    _tbx = nullptr;
+    _line = {0, 0, nullptr};
+}
+
+// Little endian binary IO for the variant cache
+template<typename T>
+static inline void cache_put(std::string &buf, const T &val) {
+    buf.append(reinterpret_cast<const char *>(&val), sizeof(T));
+}
+
+static inline void cache_put_str(std::string &buf, const std::string &str) {
+    cache_put<uint32_t>(buf, str.length());
+    buf.append(str);
+}
+
+template<typename T>
+static inline T cache_take(const char *&p) {
+    T val;
+    std::memcpy(&val, p, sizeof(T));
+    p += sizeof(T);
+    return val;
+}
+
+template<typename T>
+static inline T cache_read(std::istream &is) {
+    T val;
+    is.read(reinterpret_cast<char *>(&val), sizeof(T));
+    return val;
+}
+
+static inline std::string cache_read_str(std::istream &is) {
+    std::string ret(cache_read<uint32_t>(is), '\0');
+    is.read(&ret[0], ret.length());
+    return ret;
+}
+
+// Gather the bits of x selected by mask m into the low bits of the result.
+static inline uint64_t extract_bits(uint64_t x, uint64_t m) {
+    #ifdef __BMI2__
+    return _pext_u64(x, m);
+    #else
+    if (!(x & m)) return 0;
+    uint64_t ret = 0;
+    for (uint64_t bit = 1; m; bit <<= 1) {
+        if (x & m & -m) ret |= bit;
+        m &= m - 1;
+    }
+    return ret;
+    #endif
+}
+
+static const char VARGAS_CACHE_MAGIC[] = "VVC1";
+
+
+bool vargas::VarCache::is_cache(const std::string &file) {
+    std::ifstream in(file, std::ios::binary);
+    char magic[4];
+    if (!in.read(magic, 4)) return false;
+    return std::strncmp(magic, VARGAS_CACHE_MAGIC, 4) == 0;
+}
+
+
+size_t vargas::VarCache::create(VCF &vcf, const std::string &file) {
+    if (!vcf.good()) throw std::invalid_argument("Invalid VCF: " + vcf.file());
+    std::ofstream out(file, std::ios::binary);
+    if (!out.good()) throw std::invalid_argument("Error opening file: " + file);
+
+    vcf.create_ingroup(100);
+    const auto contigs = vcf.seq_names();
+    const size_t num_words = (vcf.samples().size() * 2 + 63) / 64;
+
+    std::string buf(VARGAS_CACHE_MAGIC, 4);
+    cache_put<uint32_t>(buf, vcf.samples().size());
+    for (const auto &smp : vcf.samples()) cache_put_str(buf, smp);
+    cache_put<uint32_t>(buf, contigs.size());
+    for (const auto &c : contigs) cache_put_str(buf, c);
+    out.write(buf.data(), buf.size());
+    uint64_t offset = buf.size();
+
+    std::vector<uint64_t> contig_offsets(contigs.size(), UINT64_MAX);
+    std::vector<unsigned char> contiguous(contigs.size(), 1);
+    int last_contig = -1;
+    size_t count = 0;
+
+    while (vcf.next()) {
+        const int rid = vcf.contig_id();
+        if (rid < 0 || unsigned(rid) >= contigs.size()) {
+            throw std::invalid_argument("Record contig is not in the header of " + vcf.file());
+        }
+        if (rid != last_contig) {
+            if (contig_offsets[rid] == UINT64_MAX) contig_offsets[rid] = offset;
+            else contiguous[rid] = 0;
+            last_contig = rid;
+        }
+
+        const auto &af = vcf.info_af();
+        buf.clear();
+        cache_put<uint16_t>(buf, vcf.alleles().size());
+        cache_put<uint16_t>(buf, af.size());
+        for (const auto &a : vcf.alleles()) cache_put_str(buf, a);
+        for (float f : af) cache_put(buf, f);
+        for (unsigned a = 0; a < vcf.alleles().size(); ++a) {
+            if (vcf.is_duplicate(a)) continue;
+            const auto &blocks = vcf.allele_pop(a).bitset();
+            for (size_t w = 0; w < num_words; ++w) {
+                cache_put<uint64_t>(buf, w < blocks.size() ? blocks[w].to_ullong() : 0);
+            }
+        }
+
+        std::string hdr;
+        cache_put<uint32_t>(hdr, rid);
+        cache_put<uint32_t>(hdr, vcf.pos());
+        cache_put<uint32_t>(hdr, buf.size());
+        out.write(hdr.data(), hdr.size());
+        out.write(buf.data(), buf.size());
+        offset += hdr.size() + buf.size();
+        ++count;
+    }
+
+    buf.clear();
+    for (size_t i = 0; i < contigs.size(); ++i) {
+        cache_put(buf, contig_offsets[i]);
+        cache_put(buf, contiguous[i]);
+    }
+    cache_put(buf, offset);
+    out.write(buf.data(), buf.size());
+    if (!out.good()) throw std::invalid_argument("Error writing variant cache: " + file);
+    return count;
+}
+
+
+void vargas::VarCache::open(std::string file) {
+    _file_name = file;
+    _in.close();
+    _in.clear();
+    _in.open(file, std::ios::binary);
+    if (!_in.good()) throw std::invalid_argument("Error opening file: " + file);
+    char magic[4];
+    if (!_in.read(magic, 4) || std::strncmp(magic, VARGAS_CACHE_MAGIC, 4) != 0) {
+        throw std::invalid_argument(file + " is not a variant cache.");
+    }
+
+    _samples.resize(cache_read<uint32_t>(_in));
+    for (auto &smp : _samples) smp = cache_read_str(_in);
+    _contigs.resize(cache_read<uint32_t>(_in));
+    for (auto &c : _contigs) c = cache_read_str(_in);
+    _data_offset = _in.tellg();
+
+    _in.seekg(-int(sizeof(uint64_t)), std::ios::end);
+    _table_offset = cache_read<uint64_t>(_in);
+    _in.seekg(_table_offset);
+    _contig_offsets.resize(_contigs.size());
+    _contig_contiguous.resize(_contigs.size());
+    for (size_t i = 0; i < _contigs.size(); ++i) {
+        _contig_offsets[i] = cache_read<uint64_t>(_in);
+        _contig_contiguous[i] = cache_read<unsigned char>(_in);
+    }
+    if (!_in.good()) throw std::invalid_argument("Truncated variant cache: " + file);
+
+    _num_words = (_samples.size() * 2 + 63) / 64;
+    _counter = 0;
+    _num_decoded = 0;
+    _seeked = false;
+    create_ingroup(100);
+}
+
+
+void vargas::VarCache::_seek_region() {
+    _seeked = true;
+    _region_contig = -1;
+    _offset = _data_offset;
+    if (!_region.seq_name.empty()) {
+        auto c = std::find(_contigs.begin(), _contigs.end(), _region.seq_name);
+        if (c == _contigs.end() || _contig_offsets[c - _contigs.begin()] == UINT64_MAX) {
+            _offset = _table_offset; // No records
+        } else {
+            _region_contig = c - _contigs.begin();
+            _offset = _contig_offsets[_region_contig];
+        }
+    }
+    _in.clear();
+    _in.seekg(_offset);
+}
+
+
+bool vargas::VarCache::next() {
+    if (_limit > 0 && _counter >= _limit) return false;
+    if (!good()) return false;
+    if (!_seeked) _seek_region();
+
+    while (true) {
+        if (_offset >= _table_offset) return false;
+        const uint32_t rid = cache_read<uint32_t>(_in);
+        const uint32_t pos = cache_read<uint32_t>(_in);
+        const uint32_t len = cache_read<uint32_t>(_in);
+        _payload.resize(len);
+        _in.read(_payload.data(), len);
+        if (!_in.good()) return false;
+        _offset += 3 * sizeof(uint32_t) + len;
+        ++_num_decoded;
+
+        if (_region_contig >= 0 && int(rid) != _region_contig) {
+            if (_contig_contiguous[_region_contig]) _offset = _table_offset; // Left the contig
+            continue;
+        }
+        if (pos < _region.min || (_region.max > 0 && pos > _region.max)) continue;
+        _pos = pos;
+        break;
+    }
+
+    const char *p = _payload.data();
+    const uint16_t num_alleles = cache_take<uint16_t>(p);
+    const uint16_t num_af = cache_take<uint16_t>(p);
+    _alleles.resize(num_alleles);
+    for (auto &a : _alleles) {
+        const uint32_t len = cache_take<uint32_t>(p);
+        a.assign(p, len);
+        p += len;
+    }
+    _find_duplicates();
+
+    _info_af.resize(num_af);
+    for (auto &f : _info_af) f = cache_take<float>(p);
+
+    _allele_pops.resize(num_alleles);
+    _words.resize(_num_words);
+    for (unsigned a = 0; a < num_alleles; ++a) {
+        if (_allele_canon[a] != a) {
+            _allele_pops[a] = _allele_pops[_allele_canon[a]];
+            continue;
+        }
+        std::memcpy(_words.data(), p, _num_words * sizeof(uint64_t));
+        p += _num_words * sizeof(uint64_t);
+        _load_pop(_words.data(), _allele_pops[a]);
+    }
+    _compute_frequencies();
+
+    ++_counter;
+    return true;
+}
+
+
+void vargas::VarCache::_load_pop(const uint64_t *words, Population &pop) const {
+    pop.assign(_num_kept);
+    if (_num_kept == _samples.size() * 2) {
+        for (size_t w = 0; w < _num_words; ++w) pop.set_block(w, words[w]);
+        return;
+    }
+
+    // Append the ingroup bits of each word to the output block
+    size_t block = 0;
+    unsigned fill = 0;
+    uint64_t acc = 0;
+    for (size_t w = 0; w < _num_words; ++w) {
+        const uint64_t m = _mask[w];
+        if (!m) continue;
+        const uint64_t x = extract_bits(words[w], m);
+        const unsigned k = __builtin_popcountll(m);
+        acc |= x << fill;
+        if (fill + k >= 64) {
+            pop.set_block(block++, acc);
+            acc = fill ? x >> (64 - fill) : 0;
+            fill = fill + k - 64;
+        } else {
+            fill += k;
+        }
+    }
+    if (fill) pop.set_block(block, acc);
+}
+
+
+void vargas::VarCache::_apply_ingroup_filter() {
+    const std::unordered_set<std::string> keep(_ingroup.begin(), _ingroup.end());
+    _mask.assign(_num_words, 0);
+    _num_kept = 0;
+    for (size_t i = 0; i < _samples.size(); ++i) {
+        if (!keep.count(_samples[i])) continue;
+        for (size_t h = 2 * i; h < 2 * i + 2; ++h) _mask[h / 64] |= uint64_t(1) << (h % 64);
+        _num_kept += 2;
+    }
+}
+
+
+void vargas::KSNP::open(std::string file, std::string reference) {
+    _file_name = file;
+    _in.close();
+    _in.clear();
+    _in.open(file);
+    if (!_in.good()) throw std::invalid_argument("Error opening file: " + file);
+    if (_ref.open(reference) != 0) throw std::invalid_argument("Invalid reference: " + reference);
+    _counter = 0;
+    _num_decoded = 0;
+    _has_pending = false;
+    _rewind = false;
+    _loaded.clear();
+}
+
+
+bool vargas::KSNP::is_ksnp(const std::string &file) {
+    const auto ends_with = [&file](const std::string &ext) {
+        return file.length() >= ext.length() && file.compare(file.length() - ext.length(), ext.length(), ext) == 0;
+    };
+    return ends_with(".snp") || ends_with(".ksnp");
+}
+
+
+bool vargas::KSNP::_read_line() {
+    while (std::getline(_in, _line)) {
+        if (_line.empty() || _line[0] == '#') continue;
+        ++_num_decoded;
+        std::istringstream ss(_line);
+        std::string id, type, alt;
+        long pos = -1;
+        ss >> id >> type >> _pending.chr >> pos >> alt;
+        if (!ss || pos < 0) throw std::invalid_argument("Invalid kSNP line: " + _line);
+
+        // Replace ref_len bases at start with alt. Indels are anchored to the preceding base,
+        // or the following base at the start of the sequence.
+        const pos_t p = pos;
+        _pending.raw = p;
+        if (type == "single") {
+            _pending.start = p;
+            _pending.ref_len = 1;
+            _pending.alt = alt;
+        } else if (type == "deletion") {
+            const pos_t len = std::stoul(alt);
+            _pending.start = p > 0 ? p - 1 : 0;
+            _pending.ref_len = len + 1;
+            _pending.alt = _ref.subseq(_pending.chr, p > 0 ? p - 1 : len, p > 0 ? p - 1 : len);
+        } else if (type == "insertion") {
+            _pending.start = p > 0 ? p - 1 : 0;
+            _pending.ref_len = 1;
+            const std::string anchor = _ref.subseq(_pending.chr, _pending.start, _pending.start);
+            _pending.alt = p > 0 ? anchor + alt : alt + anchor;
+        } else {
+            throw std::invalid_argument("Unknown kSNP variant type \"" + type + "\" in line: " + _line);
+        }
+        return true;
+    }
+    return false;
+}
+
+
+bool vargas::KSNP::next() {
+    if (_limit > 0 && _counter >= _limit) return false;
+    if (!good()) return false;
+    if (_rewind) {
+        _in.clear();
+        _in.seekg(0);
+        _has_pending = false;
+        _entered_contig = false;
+        _rewind = false;
+    }
+
+    while (true) {
+        if (!_has_pending && !_read_line()) return false;
+        _has_pending = false;
+
+        // Collect the following lines whose replaced ranges overlap. Anchoring can move an indel
+        // before an earlier line at the same position, so order is checked on the file positions.
+        _group.assign(1, _pending);
+        _start = _pending.start;
+        _end = _pending.start + _pending.ref_len;
+        while (_read_line()) {
+            if (_pending.chr == _group.back().chr && _pending.raw < _group.back().raw) {
+                throw std::invalid_argument("kSNP file should be sorted by position (sort -k3,3 -k4,4n): " + _line);
+            }
+            if (_pending.chr != _group[0].chr || _pending.start >= _end) {
+                _has_pending = true;
+                break;
+            }
+            _group.push_back(_pending);
+            _start = std::min(_start, _pending.start);
+            _end = std::max(_end, _pending.start + _pending.ref_len);
+        }
+
+        const edit &first = _group[0];
+        const bool seqmatch = _region.seq_name.empty() || _region.seq_name == first.chr;
+        if (seqmatch) _entered_contig = true;
+        else if (_assume_contig && _entered_contig) return false;
+        if (seqmatch && _start >= _region.min && (_region.max == 0 || _start <= _region.max)) break;
+    }
+
+    // Ref spans every replaced range, each alt is padded with the ref bases around its own
+    const edit &first = _group[0];
+    if (first.chr != _loaded) {
+        _ref.load(first.chr);
+        _loaded = first.chr;
+    }
+    _pos = _start;
+    _alleles.resize(_group.size() + 1);
+    _alleles[0] = _ref.subseq(first.chr, _start, _end - 1);
+    for (size_t i = 0; i < _group.size(); ++i) {
+        const edit &e = _group[i];
+        const size_t before = e.start - _start;
+        _alleles[i + 1] = _alleles[0].substr(0, before) + e.alt +
+                          _alleles[0].substr(std::min<size_t>(before + e.ref_len, _alleles[0].length()));
+    }
+    _find_duplicates();
+
+    _allele_pops.assign(_alleles.size(), Population(1, true));
+    _info_af.assign(_group.size(), 0);
+    _compute_frequencies();
+
+    ++_counter;
+    return true;
+}
+
+
+std::unique_ptr<vargas::VarFile> vargas::open_varfile(const std::string &file, const std::string &reference) {
+    if (file.length() && file != "-" && VarCache::is_cache(file)) {
+        return std::unique_ptr<VarFile>(new VarCache(file));
+    }
+    if (KSNP::is_ksnp(file)) {
+        return std::unique_ptr<VarFile>(new KSNP(file, reference));
+    }
+    return std::unique_ptr<VarFile>(new VCF(file));
 }
 
+
 TEST_SUITE("VCF Parser");
 
 TEST_CASE ("VCF File handler") {
@@ -347,6 +899,46 @@ TEST_CASE ("VCF File handler") {
             CHECK(vcf.next() == 0); // Region end
         }
 
+        SUBCASE("Indexed region query") {
+            std::string tmpgz = tmpvcf + ".gz";
+            {
+                std::ifstream in(tmpvcf);
+                std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                BGZF *gz = bgzf_open(tmpgz.c_str(), "w");
+                REQUIRE(gz != nullptr);
+                bgzf_write(gz, contents.data(), contents.size());
+                bgzf_close(gz);
+            }
+            REQUIRE(tbx_index_build(tmpgz.c_str(), 0, &tbx_conf_vcf) == 0);
+
+            {
+                vargas::VCF vcf;
+                vcf.set_region(std::string("y:0-0"));
+                vcf.open(tmpgz);
+                CHECK(vcf.indexed());
+
+                REQUIRE(vcf.next());
+                CHECK(vcf.ref() == "TATA");
+                REQUIRE(vcf.next());
+                CHECK(vcf.ref() == "T");
+                CHECK(vcf.next() == 0); // Contig end
+
+                vcf.set_region(std::string("x:9-13"));
+                REQUIRE(vcf.next());
+                CHECK(vcf.ref() == "C");
+                CHECK(vcf.pos() == 9);
+                REQUIRE(vcf.next());
+                CHECK(vcf.pos() == 13);
+                CHECK(vcf.next() == 0); // Region end
+
+                vcf.set_region(std::string("z:0-0"));
+                CHECK(vcf.next() == 0); // Contig not in index
+            }
+
+            remove(tmpgz.c_str());
+            remove((tmpgz + ".tbi").c_str());
+        }
+
         SUBCASE("Ingroup generation") { //Some tests fail due to random number
             vargas::VCF vcf;
             srand(12345);
@@ -403,6 +995,21 @@ TEST_CASE ("VCF File handler") {
 
         }
 
+        SUBCASE("Duplicate allele populations") {
+            vargas::VCF vcf;
+            vcf.open(tmpvcf);
+            vcf.next();
+            vcf.next();
+            vcf.next();
+
+            // <DUP> and <BLAH> are substituted with the ref
+            CHECK(vcf.is_duplicate(1));
+            CHECK(vcf.is_duplicate(2));
+            REQUIRE(vcf.allele_pop("G").size() == 4);
+            CHECK(vcf.allele_pop("G").count() == 4);
+            CHECK(vcf.allele_pop(2) == vcf.allele_pop(0));
+        }
+
         SUBCASE("Filtered allele populations") {
             vargas::VCF vcf;
             vcf.open(tmpvcf);
@@ -427,6 +1034,90 @@ TEST_CASE ("VCF File handler") {
             CHECK(!vcf.allele_pop("T")[1]);
         }
 
+        SUBCASE("Variant cache") {
+            std::string tmpvvc = "tmp_tc.vvc";
+            {
+                vargas::VCF vcf(tmpvcf);
+                CHECK(vargas::VarCache::create(vcf, tmpvvc) == 5);
+            }
+            CHECK(vargas::VarCache::is_cache(tmpvvc));
+            CHECK(!vargas::VarCache::is_cache(tmpvcf));
+
+            {
+                auto vf = vargas::open_varfile(tmpvvc);
+                REQUIRE(vf->good());
+                CHECK(vf->num_haplotypes() == 4);
+                REQUIRE(vf->samples().size() == 2);
+                CHECK(vf->samples()[1] == "s2");
+                CHECK(vf->seq_names().size() == 2);
+
+                REQUIRE(vf->next());
+                CHECK(vf->pos() == 8);
+                REQUIRE(vf->alleles().size() == 4);
+                CHECK(vf->alleles()[3] == "T");
+                CHECK(vf->allele_pop("C")[2]);
+                CHECK(vf->allele_pop("C").count() == 1);
+                REQUIRE(vf->frequencies().size() == 4);
+                CHECK(vf->frequencies()[2] == 0.6f);
+
+                REQUIRE(vf->next());
+                CHECK(vf->alleles()[2] == "");
+            }
+
+            {
+                vargas::VarCache vc(tmpvvc);
+                vc.set_region(std::string("y:0-0"));
+                REQUIRE(vc.next());
+                CHECK(vc.ref() == "TATA");
+                REQUIRE(vc.next());
+                CHECK(vc.ref() == "T");
+                CHECK(vc.next() == 0);
+            }
+
+            {
+                // Sample filter should match the VCF's
+                vargas::VCF vcf(tmpvcf);
+                vargas::VarCache vc(tmpvvc);
+                vcf.create_ingroup({"s2"});
+                vc.create_ingroup({"s2"});
+                CHECK(vc.num_haplotypes() == vcf.num_haplotypes());
+                while (vcf.next()) {
+                    REQUIRE(vc.next());
+                    CHECK(vc.pos() == vcf.pos());
+                    for (unsigned i = 0; i < vcf.alleles().size(); ++i) {
+                        CHECK(vc.allele_pop(i) == vcf.allele_pop(i));
+                    }
+                }
+                CHECK(vc.next() == 0);
+            }
+
+            remove(tmpvvc.c_str());
+        }
+
+        SUBCASE("Filtered allele frequencies") {
+            // INFO/AF describes all samples, so the ingroup genotypes are used
+            vargas::VCF vcf;
+            vcf.open(tmpvcf);
+            vcf.create_ingroup({"s1"});
+            vcf.next();
+            {
+                const auto &af = vcf.frequencies();
+                REQUIRE(af.size() == 4);
+                CHECK(af[0] == 0.5f);
+                CHECK(af[1] == 0.5f);
+                CHECK(af[2] == 0);
+                CHECK(af[3] == 0);
+            }
+            vcf.next();
+            {
+                const auto &af = vcf.frequencies();
+                REQUIRE(af.size() == 3);
+                CHECK(af[0] == 0);
+                CHECK(af[1] == 1);
+                CHECK(af[2] == 0);
+            }
+        }
+
         SUBCASE("Allele frequencies") {
             vargas::VCF vcf;
             vcf.open(tmpvcf);
@@ -446,4 +1137,94 @@ TEST_CASE ("VCF File handler") {
     remove(tmpvcf.c_str());
 }
 
+TEST_CASE ("kSNP reader") {
+    const std::string tmpfa = "tmp_ksnp.fa", tmpsnp = "tmp_ksnp.snp";
+    {
+        std::ofstream fo(tmpfa);
+        fo << ">x\nACGTACGTAC\n>y\nGGGGTTTT\n";
+        std::ofstream so(tmpsnp);
+        so << "rs1\tsingle\tx\t0\tT\n"
+           << "rs2\tsingle\tx\t4\tG\n"
+           << "rs3\tdeletion\tx\t5\t2\n" // Anchored at 4, deletes CG
+           << "rs4\tinsertion\tx\t8\tTT\n" // After the T at 7
+           << "rs5\tsingle\ty\t2\tA\n";
+    }
+
+    CHECK(vargas::KSNP::is_ksnp(tmpsnp));
+    CHECK(!vargas::KSNP::is_ksnp(tmpfa));
+
+    SUBCASE("Records") {
+        auto vf = vargas::open_varfile(tmpsnp, tmpfa);
+        REQUIRE(vf->good());
+        CHECK(vf->num_haplotypes() == 0);
+
+        REQUIRE(vf->next());
+        CHECK(vf->pos() == 0);
+        CHECK(vf->alleles() == std::vector<std::string>({"A", "T"}));
+        CHECK(vf->frequencies()[0] == 1);
+        CHECK(vf->frequencies()[1] == 0);
+
+        REQUIRE(vf->next());
+        CHECK(vf->pos() == 4);
+        CHECK(vf->alleles() == std::vector<std::string>({"ACG", "GCG", "A"}));
+
+        REQUIRE(vf->next());
+        CHECK(vf->pos() == 7);
+        CHECK(vf->alleles() == std::vector<std::string>({"T", "TTT"}));
+
+        REQUIRE(vf->next());
+        CHECK(vf->pos() == 2);
+        CHECK(vf->alleles() == std::vector<std::string>({"G", "A"}));
+        CHECK(!vf->next());
+        CHECK(vf->num_decoded() == 5);
+    }
+
+    SUBCASE("Region") {
+        vargas::KSNP ks(tmpsnp, tmpfa);
+        ks.set_region(vargas::parse_region("x:3-10"));
+        REQUIRE(ks.next());
+        CHECK(ks.pos() == 4);
+        REQUIRE(ks.next());
+        CHECK(ks.pos() == 7);
+        CHECK(!ks.next());
+
+        ks.set_region(vargas::parse_region("y:0-0"));
+        REQUIRE(ks.next());
+        CHECK(ks.ref() == "G");
+        CHECK(!ks.next());
+    }
+
+    SUBCASE("Overlapping lines") {
+        // The deletion at 5 is anchored at 4, before the SNP at 5. Either order is one record.
+        for (int order = 0; order < 2; ++order) {
+            {
+                std::ofstream so(tmpsnp);
+                const std::string snp = "rs1\tsingle\tx\t5\tT\n", del = "rs2\tdeletion\tx\t5\t2\n";
+                so << (order ? del + snp : snp + del) << "rs3\tsingle\tx\t6\tA\n" << "rs4\tsingle\tx\t8\tG\n";
+            }
+            vargas::KSNP ks(tmpsnp, tmpfa);
+            REQUIRE(ks.next());
+            CHECK(ks.pos() == 4);
+            // The SNP at 6 lies in the deleted range
+            if (order) CHECK(ks.alleles() == std::vector<std::string>({"ACG", "A", "ATG", "ACA"}));
+            else CHECK(ks.alleles() == std::vector<std::string>({"ACG", "ATG", "A", "ACA"}));
+            REQUIRE(ks.next());
+            CHECK(ks.pos() == 8);
+            CHECK(ks.alleles() == std::vector<std::string>({"A", "G"}));
+            CHECK(!ks.next());
+        }
+
+        {
+            std::ofstream so(tmpsnp);
+            so << "rs1\tsingle\tx\t6\tT\n" << "rs2\tdeletion\tx\t5\t2\n";
+        }
+        vargas::KSNP ks(tmpsnp, tmpfa);
+        CHECK_THROWS(ks.next());
+    }
+
+    remove(tmpfa.c_str());
+    remove((tmpfa + ".fai").c_str());
+    remove(tmpsnp.c_str());
+}
+
 TEST_SUITE_END();
\ No newline at end of file